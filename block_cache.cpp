@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+
+#include "block_cache.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "hardware.h"
+#include "latency.h"
+
+#define BC_PAGE_SIZE  4096
+#define BC_UNIT       128 // dirty tracking granularity, no read-modify-write needed
+#define BC_UNITS      (BC_PAGE_SIZE / BC_UNIT)
+#define FLUSH_DELAY   1000
+#define DIRTY_SOFT    (1024 * 1024)     // flush right away
+#define DIRTY_MAX     (8 * 1024 * 1024) // writer waits for the running flush
+#define MAX_CACHES    16
+
+struct bc_page_t
+{
+	uint32_t mask;
+	uint8_t data[BC_PAGE_SIZE];
+};
+
+typedef std::map<uint64_t, bc_page_t*> bc_page_map;
+
+struct block_cache_t
+{
+	std::string path;
+	int fd;
+	block_cache_io_t io; // used instead of fd if it has a write
+	__off64_t size;
+
+	// dirty is only touched by the main thread. flushing belongs to the
+	// running flush and is read only until the flush frees it under lock.
+	pthread_mutex_t lock;
+	bc_page_map dirty;
+	bc_page_map flushing;
+	unsigned long flush_timer;
+	offload_handle_t flush_h;
+
+	struct
+	{
+		uint64_t writes;
+		uint64_t write_bytes;
+		uint64_t reads;
+		uint64_t overlays;
+		uint64_t stalls;
+		uint64_t flushes;
+		uint64_t flush_bytes;
+		uint32_t flush_max_us;
+		uint32_t errors;
+	} stats;
+};
+
+static block_cache_t *caches[MAX_CACHES] = {};
+
+static inline uint32_t unit_mask(uint32_t first, uint32_t count)
+{
+	return ((count >= 32) ? 0xFFFFFFFF : ((1u << count) - 1)) << first;
+}
+
+static ssize_t bc_pread(block_cache_t *bc, void *buf, size_t len, __off64_t pos)
+{
+	return bc->io.write ? bc->io.read(bc->io.ctx, pos, buf, len) : pread(bc->fd, buf, len, pos);
+}
+
+static ssize_t bc_pwrite(block_cache_t *bc, const void *buf, size_t len, __off64_t pos)
+{
+	return bc->io.write ? bc->io.write(bc->io.ctx, pos, buf, len) : pwrite(bc->fd, buf, len, pos);
+}
+
+static bool bc_sync(block_cache_t *bc)
+{
+	return bc->io.write ? bc->io.sync(bc->io.ctx) : !fdatasync(bc->fd);
+}
+
+static void flush_pages(block_cache_t *bc)
+{
+	uint64_t start = latency_now_us();
+	uint64_t bytes = 0;
+	bool err = false;
+
+	// ascending file order, then a single barrier
+	for (auto &it : bc->flushing)
+	{
+		bc_page_t *page = it.second;
+		__off64_t base = (__off64_t)it.first * BC_PAGE_SIZE;
+		uint32_t mask = page->mask;
+		while (mask)
+		{
+			uint32_t first = __builtin_ctz(mask);
+			uint32_t count = 0;
+			while (first + count < BC_UNITS && (mask & (1u << (first + count)))) count++;
+			mask &= ~unit_mask(first, count);
+
+			ssize_t len = count * BC_UNIT;
+			if (bc_pwrite(bc, page->data + first * BC_UNIT, len, base + first * BC_UNIT) != len) err = true;
+			bytes += len;
+		}
+	}
+
+	if (!bc_sync(bc)) err = true;
+	uint32_t us = (uint32_t)(latency_now_us() - start);
+
+	pthread_mutex_lock(&bc->lock);
+	for (auto &it : bc->flushing) delete it.second;
+	bc->flushing.clear();
+	bc->stats.flushes++;
+	bc->stats.flush_bytes += bytes;
+	if (us > bc->stats.flush_max_us) bc->stats.flush_max_us = us;
+	if (err) bc->stats.errors++;
+	pthread_mutex_unlock(&bc->lock);
+
+	if (err) printf("block_cache: error writing %s\n", bc->path.c_str());
+}
+
+static void start_flush(block_cache_t *bc)
+{
+	if (bc->dirty.empty() || !offload_done(bc->flush_h)) return;
+
+	pthread_mutex_lock(&bc->lock);
+	bc->flushing.swap(bc->dirty);
+	pthread_mutex_unlock(&bc->lock);
+
+	bc->flush_h = offload_add_work([bc] { flush_pages(bc); });
+}
+
+static void block_cache_poll()
+{
+	for (int i = 0; i < MAX_CACHES; i++)
+	{
+		block_cache_t *bc = caches[i];
+		if (!bc || bc->dirty.empty()) continue;
+
+		if (CheckTimer(bc->flush_timer) || bc->dirty.size() * BC_PAGE_SIZE >= DIRTY_SOFT) start_flush(bc);
+	}
+}
+
+static block_cache_t *cache_add(const char *name, int fd, __off64_t size, const block_cache_io_t *io)
+{
+	static bool poll_added = false;
+	if (!poll_added)
+	{
+		scheduler_add_background(block_cache_poll);
+		poll_added = true;
+	}
+
+	int slot = -1;
+	for (int i = 0; i < MAX_CACHES && slot < 0; i++) if (!caches[i]) slot = i;
+	if (slot < 0) return nullptr;
+
+	block_cache_t *bc = new block_cache_t();
+	bc->path = name;
+	bc->fd = fd;
+	if (io) bc->io = *io;
+	bc->size = size;
+	pthread_mutex_init(&bc->lock, NULL);
+
+	caches[slot] = bc;
+	return bc;
+}
+
+block_cache_t *block_cache_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	struct stat64 st;
+	block_cache_t *bc = (fstat64(fd, &st) < 0) ? nullptr : cache_add(path, fd, st.st_size, nullptr);
+	if (!bc) close(fd);
+	return bc;
+}
+
+block_cache_t *block_cache_open_io(const char *name, __off64_t size, const block_cache_io_t *io)
+{
+	return cache_add(name, -1, size, io);
+}
+
+static void print_stats(block_cache_t *bc)
+{
+	printf("block_cache: %s\n", bc->path.c_str());
+	printf("  writes=%llu (%llu KB) reads=%llu overlays=%llu stalls=%llu\n",
+		(unsigned long long)bc->stats.writes, (unsigned long long)(bc->stats.write_bytes / 1024),
+		(unsigned long long)bc->stats.reads, (unsigned long long)bc->stats.overlays, (unsigned long long)bc->stats.stalls);
+	printf("  flushes=%llu (%llu KB) max=%uus errors=%u dirty=%u pages\n",
+		(unsigned long long)bc->stats.flushes, (unsigned long long)(bc->stats.flush_bytes / 1024),
+		bc->stats.flush_max_us, bc->stats.errors, (uint32_t)bc->dirty.size());
+}
+
+void block_cache_close(block_cache_t *bc)
+{
+	if (!bc) return;
+
+	block_cache_flush(bc, true);
+	print_stats(bc);
+
+	for (int i = 0; i < MAX_CACHES; i++) if (caches[i] == bc) caches[i] = nullptr;
+
+	if (bc->fd >= 0) close(bc->fd);
+	pthread_mutex_destroy(&bc->lock);
+	delete bc;
+}
+
+int block_cache_write(block_cache_t *bc, __off64_t offset, const void *buf, int len)
+{
+	if ((offset | len) % BC_UNIT)
+	{
+		// not expected from the cores, write through
+		block_cache_flush(bc, true);
+		ssize_t ret = bc_pwrite(bc, buf, len, offset);
+		if (ret <= 0) return 0;
+		if (offset + ret > bc->size) bc->size = offset + ret;
+		return ret;
+	}
+
+	if (bc->dirty.size() * BC_PAGE_SIZE >= DIRTY_MAX)
+	{
+		bc->stats.stalls++;
+		offload_wait(bc->flush_h);
+		start_flush(bc);
+	}
+
+	if (bc->dirty.empty()) bc->flush_timer = GetTimer(FLUSH_DELAY);
+
+	const uint8_t *src = (const uint8_t*)buf;
+	__off64_t pos = offset;
+	int left = len;
+
+	pthread_mutex_lock(&bc->lock);
+	while (left)
+	{
+		uint64_t idx = pos / BC_PAGE_SIZE;
+		uint32_t ofs = pos % BC_PAGE_SIZE;
+		uint32_t cnt = BC_PAGE_SIZE - ofs;
+		if (cnt > (uint32_t)left) cnt = left;
+
+		bc_page_t *&page = bc->dirty[idx];
+		if (!page)
+		{
+			page = new bc_page_t;
+			page->mask = 0;
+		}
+
+		memcpy(page->data + ofs, src, cnt);
+		page->mask |= unit_mask(ofs / BC_UNIT, cnt / BC_UNIT);
+
+		src += cnt;
+		pos += cnt;
+		left -= cnt;
+	}
+	pthread_mutex_unlock(&bc->lock);
+
+	if (offset + len > bc->size) bc->size = offset + len;
+	bc->stats.writes++;
+	bc->stats.write_bytes += len;
+
+	if (bc->dirty.size() * BC_PAGE_SIZE >= DIRTY_SOFT) start_flush(bc);
+	return len;
+}
+
+static int overlay(const bc_page_map &pages, __off64_t offset, uint8_t *buf, int len)
+{
+	int end = 0;
+	for (uint64_t idx = offset / BC_PAGE_SIZE; idx <= (uint64_t)(offset + len - 1) / BC_PAGE_SIZE; idx++)
+	{
+		auto it = pages.find(idx);
+		if (it == pages.end()) continue;
+
+		const bc_page_t *page = it->second;
+		__off64_t base = (__off64_t)idx * BC_PAGE_SIZE;
+		for (uint32_t u = 0; u < BC_UNITS; u++)
+		{
+			if (!(page->mask & (1u << u))) continue;
+
+			__off64_t from = base + u * BC_UNIT;
+			__off64_t to = from + BC_UNIT;
+			if (from < offset) from = offset;
+			if (to > offset + len) to = offset + len;
+			if (from >= to) continue;
+
+			memcpy(buf + (from - offset), page->data + (from - base), to - from);
+			if (to - offset > end) end = to - offset;
+		}
+	}
+
+	return end;
+}
+
+int block_cache_read(block_cache_t *bc, __off64_t offset, void *buf, int len)
+{
+	if (len <= 0) return 0;
+
+	// Held across the pread: a flush finishing in between would leave the
+	// old disk data with nothing to patch it from.
+	pthread_mutex_lock(&bc->lock);
+
+	ssize_t ret = bc_pread(bc, buf, len, offset);
+	if (ret < 0) ret = 0;
+	if (ret < len) memset((uint8_t*)buf + ret, 0, len - ret);
+
+	int end = ret;
+	bc->stats.reads++;
+
+	if (!bc->flushing.empty() || !bc->dirty.empty())
+	{
+		// newest data last
+		int fend = overlay(bc->flushing, offset, (uint8_t*)buf, len);
+		int dend = overlay(bc->dirty, offset, (uint8_t*)buf, len);
+		if (fend || dend) bc->stats.overlays++;
+		if (fend > end) end = fend;
+		if (dend > end) end = dend;
+	}
+	pthread_mutex_unlock(&bc->lock);
+
+	return end;
+}
+
+__off64_t block_cache_size(block_cache_t *bc)
+{
+	return bc->size;
+}
+
+void block_cache_flush(block_cache_t *bc, bool wait)
+{
+	if (wait) offload_wait(bc->flush_h);
+	start_flush(bc);
+	if (wait) offload_wait(bc->flush_h);
+}
+
+void block_cache_drop(block_cache_t *bc)
+{
+	offload_wait(bc->flush_h);
+
+	pthread_mutex_lock(&bc->lock);
+	for (auto &it : bc->dirty) delete it.second;
+	bc->dirty.clear();
+	pthread_mutex_unlock(&bc->lock);
+}
+
+void block_cache_flush_all(bool wait)
+{
+	for (int i = 0; i < MAX_CACHES; i++)
+	{
+		if (caches[i]) block_cache_flush(caches[i], wait);
+	}
+}
+
+void block_cache_print_stats()
+{
+	int n = 0;
+	for (int i = 0; i < MAX_CACHES; i++)
+	{
+		if (caches[i])
+		{
+			print_stats(caches[i]);
+			n++;
+		}
+	}
+
+	if (!n) printf("block_cache: no cached images\n");
+}
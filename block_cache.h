@@ -0,0 +1,52 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+// Write-back cache for writable disk images. Writes only copy into memory,
+// a background flush writes the dirty pages in file order and fdatasync()s
+// the image. Dirty data is flushed at most FLUSH_DELAY after the first
+// write, on unmount, on core reset and before the core is reloaded.
+
+struct block_cache_t;
+
+// Opens its own descriptor of the image (path must be absolute).
+block_cache_t *block_cache_open(const char *path);
+
+// Backend for images that are not a plain file (overlays). Called from the
+// flush worker and from readers, so it has to be thread safe. sync() is
+// called once at the end of each flush.
+struct block_cache_io_t
+{
+	void *ctx;
+	int (*read)(void *ctx, __off64_t offset, void *buf, int len);
+	int (*write)(void *ctx, __off64_t offset, const void *buf, int len);
+	bool (*sync)(void *ctx);
+};
+
+// name is only used in messages.
+block_cache_t *block_cache_open_io(const char *name, __off64_t size, const block_cache_io_t *io);
+
+// Flushes and waits for the flush to finish.
+void block_cache_close(block_cache_t *bc);
+
+// offset and len must be multiples of 128 (the smallest core block size).
+int block_cache_write(block_cache_t *bc, __off64_t offset, const void *buf, int len);
+
+// Reads the image and overlays data that is not flushed yet. Returns the
+// number of bytes read, 0 on error.
+int block_cache_read(block_cache_t *bc, __off64_t offset, void *buf, int len);
+
+// Image size including data that is not flushed yet.
+__off64_t block_cache_size(block_cache_t *bc);
+
+void block_cache_flush(block_cache_t *bc, bool wait);
+
+// Waits for the running flush and throws away the data not flushed yet.
+void block_cache_drop(block_cache_t *bc);
+void block_cache_flush_all(bool wait);
+
+void block_cache_print_stats();
+
+#endif
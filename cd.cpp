@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "cd.h"
+#include "file_io.h"
+#include "support/chd/mister_chd.h"
+
+int cd_sgets(char *out, int sz, char **in)
+{
+	*out = 0;
+	do
+	{
+		char *instr = *in;
+		int cnt = 0;
+
+		while (*instr && *instr != 10)
+		{
+			if (*instr == 13)
+			{
+				instr++;
+				continue;
+			}
+
+			if (cnt < sz - 1)
+			{
+				out[cnt++] = *instr;
+				out[cnt] = 0;
+			}
+
+			instr++;
+		}
+
+		if (*instr == 10) instr++;
+		*in = instr;
+	} while (!*out && **in);
+
+	return *out;
+}
+
+void cd_swab16(uint8_t *buf, int len)
+{
+	int i = 0;
+
+#ifdef __ARM_NEON__
+	for (; i + 16 <= len; i += 16) vst1q_u8(buf + i, vrev16q_u8(vld1q_u8(buf + i)));
+#endif
+
+	// without NEON the compiler vectorizes this loop better than word swaps
+	for (; i < len - 1; i += 2)
+	{
+		uint8_t tmp = buf[i];
+		buf[i] = buf[i + 1];
+		buf[i + 1] = tmp;
+	}
+}
+
+void cd_xor(uint8_t *buf, const uint8_t *pattern, int len)
+{
+	int i = 0;
+
+#ifdef __ARM_NEON__
+	for (; i + 16 <= len; i += 16) vst1q_u8(buf + i, veorq_u8(vld1q_u8(buf + i), vld1q_u8(pattern + i)));
+#endif
+
+	for (; i < len; i++) buf[i] ^= pattern[i];
+}
+
+// Slicing-by-4 tables for the reflected EDC polynomial.
+static uint32_t edc_tab[4][256];
+
+static void edc_init()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+		for (int j = 0; j < 8; j++) c = (c >> 1) ^ ((c & 1) ? 0xD8018001 : 0);
+		edc_tab[0][i] = c;
+	}
+
+	for (int i = 0; i < 256; i++)
+	{
+		for (int k = 1; k < 4; k++) edc_tab[k][i] = (edc_tab[k - 1][i] >> 8) ^ edc_tab[0][edc_tab[k - 1][i] & 0xFF];
+	}
+}
+
+uint32_t cd_edc(const uint8_t *buf, int len)
+{
+	static bool init = false;
+	if (!init)
+	{
+		edc_init();
+		init = true;
+	}
+
+	uint32_t crc = 0;
+	int i = 0;
+
+	// buffers are often in uncached shared memory, fetch a word at a time
+	for (; i + 4 <= len; i += 4)
+	{
+		crc ^= buf[i] | (buf[i + 1] << 8) | (buf[i + 2] << 16) | ((uint32_t)buf[i + 3] << 24);
+		crc = edc_tab[3][crc & 0xFF] ^ edc_tab[2][(crc >> 8) & 0xFF] ^ edc_tab[1][(crc >> 16) & 0xFF] ^ edc_tab[0][crc >> 24];
+	}
+
+	for (; i < len; i++)
+	{
+		crc ^= buf[i];
+		crc = (crc >> 8) ^ edc_tab[0][crc & 0xFF];
+	}
+
+	return crc;
+}
+
+void cd_interleave_subcode(const uint8_t *in, uint16_t *out)
+{
+	// For every input byte: its four bit pairs moved to bits 15 and 7 of
+	// four 16-bit lanes. Row j then only needs a shift right by j.
+	static uint64_t lut[256];
+	static bool init = false;
+	if (!init)
+	{
+		for (int b = 0; b < 256; b++)
+		{
+			uint64_t v = 0;
+			for (int k = 0; k < 4; k++)
+			{
+				uint64_t lane = (((b >> (6 - 2 * k)) & 1) << 15) | (((b >> (7 - 2 * k)) & 1) << 7);
+				v |= lane << (16 * k);
+			}
+			lut[b] = v;
+		}
+		init = true;
+	}
+
+	for (int c = 0; c < 12; c++)
+	{
+		uint64_t acc = 0;
+		for (int j = 0; j < 8; j++) acc |= lut[in[j * 12 + c]] >> j;
+
+		for (int k = 0; k < 4; k++) out[c * 4 + k] = (uint16_t)(acc >> (16 * k));
+	}
+}
+
+static int cd_read_file(toc_t *toc, int track, int pos, int cnt, uint8_t *dest)
+{
+	cd_track_t *trk = &toc->tracks[track];
+	fileTYPE *f = trk->offset ? &toc->tracks[0].f : &trk->f;
+	__off64_t off = (trk->offset ? trk->offset : 0) + (__off64_t)pos * CD_RAW_SECTOR_SIZE;
+	int len = cnt * CD_RAW_SECTOR_SIZE;
+
+	int ret;
+	if (f->filp)
+	{
+		// positioned read, doesn't disturb the stdio stream position
+		ret = pread(fileno(f->filp), dest, len, off);
+	}
+	else
+	{
+		FileSeek(f, off, SEEK_SET);
+		ret = FileReadAdv(f, dest, len);
+	}
+
+	if (ret < 0) ret = 0;
+	if (ret < len) memset(dest + ret, 0, len - ret);
+	return ret / CD_RAW_SECTOR_SIZE;
+}
+
+int cd_read_sectors(toc_t *toc, int track, int pos, int cnt, uint8_t *dest, int stride)
+{
+	if (cnt <= 0) return 0;
+
+	int done = 0;
+	if (toc->chd_f)
+	{
+		for (int i = 0; i < cnt; i++)
+		{
+			uint8_t *buf = dest + i * stride;
+			if (mister_chd_read_sector(toc->chd_f, pos + i, 0, 0, CD_RAW_SECTOR_SIZE, buf) != CHDERR_NONE)
+			{
+				printf("CD: CHD read error: %d\n", pos + i);
+				memset(buf, 0, CD_RAW_SECTOR_SIZE);
+				continue;
+			}
+
+			if (!toc->tracks[track].type) cd_swab16(buf, CD_RAW_SECTOR_SIZE);
+			done++;
+		}
+		return done;
+	}
+
+	done = cd_read_file(toc, track, pos, cnt, dest);
+
+	// spread the sectors out from the back so nothing is overwritten before it is moved
+	if (stride != CD_RAW_SECTOR_SIZE)
+	{
+		for (int i = cnt - 1; i > 0; i--) memmove(dest + i * stride, dest + i * CD_RAW_SECTOR_SIZE, CD_RAW_SECTOR_SIZE);
+	}
+
+	return done;
+}
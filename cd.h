@@ -62,6 +62,34 @@ typedef struct
 
 #define BCD(v)				 ((uint8_t)((((v)/10) << 4) | ((v)%10)))
 
+#define CD_RAW_SECTOR_SIZE   2352
+
 typedef int (*SendDataFunc) (uint8_t* buf, int len, uint8_t index);
 
+// Reads the next non-empty line of a CUE sheet, strips CR.
+int cd_sgets(char *out, int sz, char **in);
+
+// Per-sector kernels, NEON accelerated when built for it.
+
+// Swaps bytes of 16-bit samples (CHD stores audio big endian).
+void cd_swab16(uint8_t *buf, int len);
+
+// buf ^= pattern, used for sector (de)scrambling.
+void cd_xor(uint8_t *buf, const uint8_t *pattern, int len);
+
+// CD-ROM EDC checksum (reflected polynomial 0xD8018001).
+uint32_t cd_edc(const uint8_t *buf, int len);
+
+// Converts 96 bytes of packed subcode into the 48 interleaved words
+// the MegaCD core expects.
+void cd_interleave_subcode(const uint8_t *in, uint16_t *out);
+
+// Reads cnt consecutive raw sectors of a track into dest, one sector every
+// stride bytes (stride >= CD_RAW_SECTOR_SIZE). pos is the CHD frame for CHD
+// images, otherwise the sector index within the track's data (relative to
+// track.offset in the first file if it is set). Contiguous BIN sectors are
+// fetched with a single read. CHD audio is byteswapped.
+// Returns the number of sectors read.
+int cd_read_sectors(toc_t *toc, int track, int pos, int cnt, uint8_t *dest, int stride = CD_RAW_SECTOR_SIZE);
+
 #endif
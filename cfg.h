@@ -99,6 +99,8 @@ typedef struct {
 	uint16_t osd_lock_time;
 	char debug;
 	uint8_t lookahead;
+	uint8_t disk_overlay;
+	uint16_t neogeo_cache;
 	char main[1024];
 	char vfilter_interlace_default[1023];
 } cfg_t;
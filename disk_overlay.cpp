@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "disk_overlay.h"
+#include "block_cache.h"
+#include "file_io.h"
+
+#define OVL_MAGIC         0x4C564F4D // "MOVL"
+#define OVL_VERSION       1
+#define OVL_CLUSTER       (64 * 1024)
+#define OVL_HEADER_SIZE   4096
+#define OVL_MIN_SIZE      (16 * 1024 * 1024) // smaller images are not hard disks
+#define OVL_COMMITTING    1                  // base is being written, resume on open
+#define OVL_DIR           CONFIG_DIR "/overlays"
+#define MAX_OVERLAYS      16
+
+struct ovl_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cluster_size;
+	uint32_t entries;
+	int64_t  base_size;
+	int64_t  base_mtime;
+	uint64_t data_start;
+	char     base_path[1024];
+	uint32_t flags;
+};
+
+struct disk_overlay_t
+{
+	std::string path;
+	int fd;
+	int base_fd;
+	ovl_header_t hdr;
+
+	// delta cluster number per base cluster, 0 - not changed
+	std::vector<uint32_t> map;
+	uint32_t clusters;
+	uint32_t gen;
+	std::vector<uint8_t> tmp;
+
+	// new clusters whose map entry goes to disk after their data is synced
+	std::vector<uint32_t> unpublished;
+
+	// writes are cached and reach the delta on the flush worker
+	block_cache_t *bc;
+
+	pthread_mutex_t lock;
+
+	struct
+	{
+		uint64_t reads;
+		uint64_t writes;
+		uint32_t allocs;
+		uint32_t errors;
+	} stats;
+};
+
+static disk_overlay_t *overlays[MAX_OVERLAYS] = {};
+
+static void overlay_file_name(const char *base_path, char *out, size_t len)
+{
+	// FNV-1a, keeps images with the same name in different folders apart
+	uint32_t hash = 0x811c9dc5;
+	for (const char *p = base_path; *p; p++)
+	{
+		hash ^= (uint8_t)*p;
+		hash *= 0x01000193;
+	}
+
+	const char *name = strrchr(base_path, '/');
+	name = name ? name + 1 : base_path;
+	snprintf(out, len, "%s/" OVL_DIR "/%s-%08x.ovl", getRootDir(), name, hash);
+}
+
+static bool base_key(const char *path, int64_t *size, int64_t *mtime)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0) return false;
+
+	*size = st.st_size;
+	*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	return true;
+}
+
+static inline __off64_t cluster_pos(const disk_overlay_t *ovl, uint32_t n)
+{
+	return (__off64_t)ovl->hdr.data_start + (__off64_t)(n - 1) * OVL_CLUSTER;
+}
+
+static int overlay_create(const char *path, const char *base_path, int64_t size, int64_t mtime)
+{
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s", path);
+	char *p = strrchr(dir, '/');
+	if (p) *p = 0;
+	mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0) return -1;
+
+	ovl_header_t hdr = {};
+	hdr.magic = OVL_MAGIC;
+	hdr.version = OVL_VERSION;
+	hdr.cluster_size = OVL_CLUSTER;
+	hdr.entries = (size + OVL_CLUSTER - 1) / OVL_CLUSTER;
+	hdr.base_size = size;
+	hdr.base_mtime = mtime;
+	hdr.data_start = ((OVL_HEADER_SIZE + hdr.entries * 4ULL) + OVL_CLUSTER - 1) & ~(uint64_t)(OVL_CLUSTER - 1);
+	snprintf(hdr.base_path, sizeof(hdr.base_path), "%s", base_path);
+
+	// the map is a hole until clusters are written
+	if (ftruncate(fd, hdr.data_start) || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(fd))
+	{
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	printf("overlay: created %s\n", path);
+	return fd;
+}
+
+static int ovl_read(void *ctx, __off64_t offset, void *buf, int len);
+static int ovl_write(void *ctx, __off64_t offset, const void *buf, int len);
+static bool ovl_sync(void *ctx);
+static bool commit_locked(disk_overlay_t *ovl);
+
+disk_overlay_t *disk_overlay_open(const char *base_path, bool create)
+{
+	int slot = -1;
+	for (int i = 0; i < MAX_OVERLAYS && slot < 0; i++) if (!overlays[i]) slot = i;
+	if (slot < 0) return nullptr;
+
+	int64_t size, mtime;
+	if (!base_key(base_path, &size, &mtime) || size < OVL_MIN_SIZE) return nullptr;
+
+	char path[1024];
+	overlay_file_name(base_path, path, sizeof(path));
+
+	ovl_header_t hdr;
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		bool ok = pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == OVL_MAGIC &&
+			hdr.version == OVL_VERSION && hdr.cluster_size == OVL_CLUSTER && !strcmp(hdr.base_path, base_path);
+
+		// an interrupted commit has already changed the base, it's finished below
+		if (!ok || hdr.base_size != size || (hdr.base_mtime != mtime && !(hdr.flags & OVL_COMMITTING)))
+		{
+			// never show old changes on top of a different base
+			std::string stale = std::string(path) + ".stale";
+			printf("overlay: %s doesn't match %s, moved to %s\n", path, base_path, stale.c_str());
+			close(fd);
+			rename(path, stale.c_str());
+			fd = -1;
+		}
+	}
+
+	if (fd < 0)
+	{
+		if (!create) return nullptr;
+
+		fd = overlay_create(path, base_path, size, mtime);
+		if (fd < 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		{
+			if (fd >= 0) close(fd);
+			printf("overlay: cannot create %s\n", path);
+			return nullptr;
+		}
+	}
+
+	int base_fd = open(base_path, O_RDONLY | O_CLOEXEC);
+	if (base_fd < 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	disk_overlay_t *ovl = new disk_overlay_t();
+	ovl->path = path;
+	ovl->fd = fd;
+	ovl->base_fd = base_fd;
+	ovl->hdr = hdr;
+	ovl->map.resize(hdr.entries);
+	ovl->tmp.resize(OVL_CLUSTER);
+	pthread_mutex_init(&ovl->lock, NULL);
+
+	ssize_t mlen = hdr.entries * sizeof(uint32_t);
+	if (pread(fd, ovl->map.data(), mlen, OVL_HEADER_SIZE) != mlen) memset(ovl->map.data(), 0, mlen);
+
+	for (auto n : ovl->map) if (n > ovl->clusters) ovl->clusters = n;
+
+	if (ovl->hdr.flags & OVL_COMMITTING)
+	{
+		printf("overlay: %s has an interrupted commit, resuming\n", path);
+		pthread_mutex_lock(&ovl->lock);
+		commit_locked(ovl);
+		pthread_mutex_unlock(&ovl->lock);
+	}
+
+	block_cache_io_t io = { ovl, ovl_read, ovl_write, ovl_sync };
+	ovl->bc = block_cache_open_io(path, hdr.base_size, &io);
+	if (!ovl->bc)
+	{
+		close(fd);
+		close(base_fd);
+		pthread_mutex_destroy(&ovl->lock);
+		delete ovl;
+		return nullptr;
+	}
+
+	printf("overlay: %s on %s, %u changed clusters\n", path, base_path, ovl->clusters);
+	overlays[slot] = ovl;
+	return ovl;
+}
+
+static void print_stats(disk_overlay_t *ovl)
+{
+	printf("overlay: %s\n", ovl->path.c_str());
+	printf("  clusters=%u (%u KB) new=%u reads=%llu writes=%llu errors=%u\n",
+		ovl->clusters, ovl->clusters * (OVL_CLUSTER / 1024), ovl->stats.allocs,
+		(unsigned long long)ovl->stats.reads, (unsigned long long)ovl->stats.writes, ovl->stats.errors);
+}
+
+void disk_overlay_close(disk_overlay_t *ovl)
+{
+	if (!ovl) return;
+
+	block_cache_close(ovl->bc);
+	print_stats(ovl);
+	for (int i = 0; i < MAX_OVERLAYS; i++) if (overlays[i] == ovl) overlays[i] = nullptr;
+
+	close(ovl->fd);
+	close(ovl->base_fd);
+	pthread_mutex_destroy(&ovl->lock);
+	delete ovl;
+}
+
+static int ovl_read(void *ctx, __off64_t offset, void *buf, int len)
+{
+	disk_overlay_t *ovl = (disk_overlay_t*)ctx;
+	if (len <= 0 || offset >= ovl->hdr.base_size) return 0;
+	if (offset + len > ovl->hdr.base_size) len = ovl->hdr.base_size - offset;
+
+	uint8_t *dst = (uint8_t*)buf;
+	bool err = false;
+
+	pthread_mutex_lock(&ovl->lock);
+	for (int done = 0; done < len;)
+	{
+		__off64_t pos = offset + done;
+		uint32_t idx = pos / OVL_CLUSTER;
+		uint32_t ofs = pos % OVL_CLUSTER;
+		int cnt = OVL_CLUSTER - ofs;
+		if (cnt > len - done) cnt = len - done;
+
+		uint32_t n = ovl->map[idx];
+		ssize_t ret = n ? pread(ovl->fd, dst + done, cnt, cluster_pos(ovl, n) + ofs) : pread(ovl->base_fd, dst + done, cnt, pos);
+		if (ret < 0)
+		{
+			err = true;
+			break;
+		}
+
+		if (ret < cnt) memset(dst + done + ret, 0, cnt - ret);
+		done += cnt;
+	}
+
+	ovl->stats.reads++;
+	if (err) ovl->stats.errors++;
+	pthread_mutex_unlock(&ovl->lock);
+
+	return err ? 0 : len;
+}
+
+// Runs on the flush worker. New clusters are used right away but only
+// published in the on-disk map by ovl_sync() after their data is synced,
+// so a crash never exposes a half-written cluster.
+static int ovl_write(void *ctx, __off64_t offset, const void *buf, int len)
+{
+	disk_overlay_t *ovl = (disk_overlay_t*)ctx;
+	if (len <= 0 || offset >= ovl->hdr.base_size) return 0;
+	if (offset + len > ovl->hdr.base_size) len = ovl->hdr.base_size - offset;
+
+	const uint8_t *src = (const uint8_t*)buf;
+	bool err = false;
+
+	pthread_mutex_lock(&ovl->lock);
+	for (int done = 0; done < len && !err;)
+	{
+		__off64_t pos = offset + done;
+		uint32_t idx = pos / OVL_CLUSTER;
+		uint32_t ofs = pos % OVL_CLUSTER;
+		int cnt = OVL_CLUSTER - ofs;
+		if (cnt > len - done) cnt = len - done;
+
+		uint32_t n = ovl->map[idx];
+		if (n)
+		{
+			err = pwrite(ovl->fd, src + done, cnt, cluster_pos(ovl, n) + ofs) != cnt;
+		}
+		else
+		{
+			// copy the rest of the cluster from the base
+			uint8_t *data = ovl->tmp.data();
+			if (cnt < OVL_CLUSTER)
+			{
+				ssize_t ret = pread(ovl->base_fd, data, OVL_CLUSTER, (__off64_t)idx * OVL_CLUSTER);
+				if (ret < 0) ret = 0;
+				if (ret < OVL_CLUSTER) memset(data + ret, 0, OVL_CLUSTER - ret);
+			}
+			memcpy(data + ofs, src + done, cnt);
+
+			n = ovl->clusters + 1;
+			err = pwrite(ovl->fd, data, OVL_CLUSTER, cluster_pos(ovl, n)) != OVL_CLUSTER;
+			if (!err)
+			{
+				ovl->map[idx] = n;
+				ovl->clusters = n;
+				ovl->unpublished.push_back(idx);
+				ovl->stats.allocs++;
+			}
+		}
+
+		done += cnt;
+	}
+
+	ovl->stats.writes++;
+	if (err) ovl->stats.errors++;
+	pthread_mutex_unlock(&ovl->lock);
+
+	if (err) printf("overlay: error writing %s\n", ovl->path.c_str());
+	return err ? 0 : len;
+}
+
+static bool ovl_sync(void *ctx)
+{
+	disk_overlay_t *ovl = (disk_overlay_t*)ctx;
+
+	// the data of everything unpublished so far is written, sync it without
+	// holding the lock so readers keep going
+	pthread_mutex_lock(&ovl->lock);
+	std::vector<uint32_t> publish;
+	publish.swap(ovl->unpublished);
+	pthread_mutex_unlock(&ovl->lock);
+
+	bool ok = !fdatasync(ovl->fd);
+
+	pthread_mutex_lock(&ovl->lock);
+	for (uint32_t idx : publish)
+	{
+		uint32_t n = ovl->map[idx];
+		if (ok && n) ok = pwrite(ovl->fd, &n, sizeof(n), OVL_HEADER_SIZE + idx * sizeof(n)) == sizeof(n);
+	}
+	pthread_mutex_unlock(&ovl->lock);
+
+	if (!publish.empty()) ok = !fdatasync(ovl->fd) && ok;
+	return ok;
+}
+
+int disk_overlay_read(disk_overlay_t *ovl, __off64_t offset, void *buf, int len)
+{
+	return block_cache_read(ovl->bc, offset, buf, len);
+}
+
+int disk_overlay_write(disk_overlay_t *ovl, __off64_t offset, const void *buf, int len)
+{
+	if (len <= 0 || offset >= ovl->hdr.base_size) return 0;
+	if (offset + len > ovl->hdr.base_size) len = ovl->hdr.base_size - offset;
+	return block_cache_write(ovl->bc, offset, buf, len);
+}
+
+__off64_t disk_overlay_size(disk_overlay_t *ovl)
+{
+	return ovl->hdr.base_size;
+}
+
+uint32_t disk_overlay_generation(disk_overlay_t *ovl)
+{
+	return ovl->gen;
+}
+
+static bool discard_locked(disk_overlay_t *ovl)
+{
+	std::fill(ovl->map.begin(), ovl->map.end(), 0);
+	ovl->clusters = 0;
+	ovl->unpublished.clear();
+	ovl->gen++;
+
+	// punch the map and the data out again
+	return !ftruncate(ovl->fd, OVL_HEADER_SIZE) && !ftruncate(ovl->fd, ovl->hdr.data_start) && !fdatasync(ovl->fd);
+}
+
+bool disk_overlay_discard(disk_overlay_t *ovl)
+{
+	block_cache_drop(ovl->bc);
+
+	pthread_mutex_lock(&ovl->lock);
+	bool ok = discard_locked(ovl);
+	pthread_mutex_unlock(&ovl->lock);
+
+	printf("overlay: %s discarded%s\n", ovl->path.c_str(), ok ? "" : " with errors");
+	return ok;
+}
+
+static bool write_header(disk_overlay_t *ovl)
+{
+	return pwrite(ovl->fd, &ovl->hdr, sizeof(ovl->hdr), 0) == sizeof(ovl->hdr) && !fdatasync(ovl->fd);
+}
+
+// The flag is on disk before the base is touched. Copying the clusters
+// again is harmless, so an interrupted commit is simply run again on the
+// next open (the delta is kept even though the base mtime changed).
+static bool commit_locked(disk_overlay_t *ovl)
+{
+	int fd = open(ovl->hdr.base_path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("overlay: %s can't be committed, %s is not writable\n", ovl->path.c_str(), ovl->hdr.base_path);
+		return false;
+	}
+
+	ovl->hdr.flags |= OVL_COMMITTING;
+	bool ok = write_header(ovl);
+	uint32_t count = 0;
+
+	for (uint32_t idx = 0; ok && idx < ovl->hdr.entries; idx++)
+	{
+		uint32_t n = ovl->map[idx];
+		if (!n) continue;
+
+		__off64_t pos = (__off64_t)idx * OVL_CLUSTER;
+		ssize_t len = (ovl->hdr.base_size - pos < OVL_CLUSTER) ? ovl->hdr.base_size - pos : OVL_CLUSTER;
+		ok = pread(ovl->fd, ovl->tmp.data(), len, cluster_pos(ovl, n)) == len &&
+			pwrite(fd, ovl->tmp.data(), len, pos) == len;
+		count++;
+	}
+
+	ok = !fdatasync(fd) && ok;
+	close(fd);
+
+	// the base has changed, the delta has to follow its new mtime
+	if (ok) ok = base_key(ovl->hdr.base_path, &ovl->hdr.base_size, &ovl->hdr.base_mtime) && discard_locked(ovl);
+	if (ok)
+	{
+		ovl->hdr.flags &= ~OVL_COMMITTING;
+		ok = write_header(ovl);
+	}
+
+	printf("overlay: %s %s, %u clusters\n", ovl->path.c_str(), ok ? "committed" : "commit failed", count);
+	return ok;
+}
+
+bool disk_overlay_commit(disk_overlay_t *ovl)
+{
+	block_cache_flush(ovl->bc, true);
+
+	pthread_mutex_lock(&ovl->lock);
+	bool ok = commit_locked(ovl);
+	pthread_mutex_unlock(&ovl->lock);
+	return ok;
+}
+
+bool disk_overlay_snapshot(disk_overlay_t *ovl, const char *dst_path)
+{
+	block_cache_flush(ovl->bc, true);
+
+	int fd = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0) return false;
+
+	pthread_mutex_lock(&ovl->lock);
+
+	// same layout with the clusters renumbered in map order
+	std::vector<uint32_t> map(ovl->hdr.entries);
+	uint32_t count = 0;
+	bool ok = !ftruncate(fd, ovl->hdr.data_start) && pwrite(fd, &ovl->hdr, sizeof(ovl->hdr), 0) == sizeof(ovl->hdr);
+
+	for (uint32_t idx = 0; ok && idx < ovl->hdr.entries; idx++)
+	{
+		uint32_t n = ovl->map[idx];
+		if (!n) continue;
+
+		map[idx] = ++count;
+		ok = pread(ovl->fd, ovl->tmp.data(), OVL_CLUSTER, cluster_pos(ovl, n)) == OVL_CLUSTER &&
+			pwrite(fd, ovl->tmp.data(), OVL_CLUSTER, cluster_pos(ovl, count)) == OVL_CLUSTER;
+	}
+
+	ssize_t mlen = map.size() * sizeof(uint32_t);
+	if (ok) ok = pwrite(fd, map.data(), mlen, OVL_HEADER_SIZE) == mlen;
+
+	pthread_mutex_unlock(&ovl->lock);
+
+	ok = !fsync(fd) && ok;
+	close(fd);
+	if (!ok) unlink(dst_path);
+
+	printf("overlay: snapshot %s %s, %u clusters\n", dst_path, ok ? "saved" : "failed", count);
+	return ok;
+}
+
+void disk_overlay_cmd(const char *cmd)
+{
+	int n = 0;
+	for (int i = 0; i < MAX_OVERLAYS; i++)
+	{
+		disk_overlay_t *ovl = overlays[i];
+		if (!ovl) continue;
+		n++;
+
+		if (!strcmp(cmd, "commit")) disk_overlay_commit(ovl);
+		else if (!strcmp(cmd, "discard")) disk_overlay_discard(ovl);
+		else if (!strcmp(cmd, "snapshot"))
+		{
+			char stamp[32];
+			time_t t = time(NULL);
+			strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+
+			std::string dst = ovl->path.substr(0, ovl->path.size() - 4) + "-" + stamp + ".ovl";
+			disk_overlay_snapshot(ovl, dst.c_str());
+		}
+		else print_stats(ovl);
+	}
+
+	if (!n) printf("overlay: no overlays are open\n");
+}
@@ -0,0 +1,43 @@
+#ifndef DISK_OVERLAY_H
+#define DISK_OVERLAY_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+// Copy-on-write overlay for hard disk images. The base image is only read,
+// changed clusters go to a sparse delta file in config/overlays with a
+// cluster map in front of the data. An existing delta is always used, a new
+// one is created only if disk_overlay=1 is set in MiSTer.ini. Writes go
+// through a block cache and reach the delta on its flush worker.
+
+struct disk_overlay_t;
+
+// Path must be absolute. Returns null if the image has no overlay or is
+// too small to be a hard disk.
+disk_overlay_t *disk_overlay_open(const char *base_path, bool create);
+void disk_overlay_close(disk_overlay_t *ovl);
+
+// Reads are thread safe, writes come from the main thread. Writes past the
+// end of the base image are dropped.
+int disk_overlay_read(disk_overlay_t *ovl, __off64_t offset, void *buf, int len);
+int disk_overlay_write(disk_overlay_t *ovl, __off64_t offset, const void *buf, int len);
+
+__off64_t disk_overlay_size(disk_overlay_t *ovl);
+
+// Changes with every discard, cached data of an older generation is stale.
+uint32_t disk_overlay_generation(disk_overlay_t *ovl);
+
+// Writes the changed clusters into the base image and empties the delta.
+// If it's interrupted, the next open finishes it.
+bool disk_overlay_commit(disk_overlay_t *ovl);
+
+// Drops all changes.
+bool disk_overlay_discard(disk_overlay_t *ovl);
+
+// Copies the delta (only the changed clusters) to dst_path.
+bool disk_overlay_snapshot(disk_overlay_t *ovl, const char *dst_path);
+
+// MiSTer_cmd "overlay commit|discard|snapshot|stats", applies to all open overlays.
+void disk_overlay_cmd(const char *cmd);
+
+#endif
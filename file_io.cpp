@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/vfs.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
@@ -19,6 +20,7 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <memory>
 #include "lib/miniz/miniz.h"
 #include "osd.h"
 #include "fpga_io.h"
@@ -32,6 +34,8 @@
 #include "scheduler.h"
 #include "video.h"
 #include "support.h"
+#include "zip_cache.h"
+#include "offload.h"
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
 
@@ -44,19 +48,9 @@ DirentVector DirItem;
 DirNameSet DirNames;
 
 
-// Directory scanning can cause the same zip file to be opened multiple times
-// due to testing file types to adjust the path
-// (and the fact the code path is shared with regular files)
-// cache the opened mz_zip_archive so we only open it once
-// this has the extra benefit that if a user is navigating through multiple directories
-// in a zip archive, the zip will only be opened once and things will be more responsive
-// ** We have to open the file outselves with open() so we can set O_CLOEXEC to prevent
-// leaking the file descriptor when the user changes cores
+// Zip archives are looked up through zip_cache: browsing only needs the
+// central directory index, opened files share one parsed archive.
 
-static mz_zip_archive last_zip_archive = {};
-static int last_zip_fd = -1;
-static FILE *last_zip_cfile = NULL;
-static char last_zip_fname[256] = {};
 static char scanned_path[1024] = {};
 static int scanned_opts = 0;
 
@@ -88,52 +82,13 @@ int fileTYPE::opened()
 
 struct fileZipArchive
 {
-	mz_zip_archive                    archive;
+	mz_zip_archive*                   archive;
 	int                               index;
 	mz_zip_reader_extract_iter_state* iter;
 	__off64_t                         offset;
 };
 
 
-static int OpenZipfileCached(char *path, int flags)
-{
-  if (last_zip_fname[0] && !strcasecmp(path, last_zip_fname))
-  {
-    return 1;
-  }
-
-  mz_zip_reader_end(&last_zip_archive);
-  mz_zip_zero_struct(&last_zip_archive);
-  if (last_zip_cfile)
-  {
-    fclose(last_zip_cfile);
-    last_zip_cfile = nullptr;
-  }
-
-  last_zip_fname[0] = '\0';
-  last_zip_fd = open(path, O_RDONLY|O_CLOEXEC);
-  if (last_zip_fd < 0)
-  {
-    return 0;
-  }
-
-  last_zip_cfile = fdopen(last_zip_fd, "r");
-  if (!last_zip_cfile)
-  {
-    close(last_zip_fd);
-    last_zip_fd = -1;
-    return 0;
-  }
-
-  int mz_ret = mz_zip_reader_init_cfile(&last_zip_archive, last_zip_cfile, 0, flags);
-  if (mz_ret)
-  {
-    strncpy(last_zip_fname, path, sizeof(last_zip_fname));
-  }
-  return mz_ret;
-}
-
-
 static int FileIsZipped(char* path, char** zip_path, char** file_path)
 {
 	char* z = strcasestr(path, ".zip");
@@ -190,10 +145,10 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 			return 1;
 		}
 
-		if (!OpenZipfileCached(full_path, 0))
+		auto idx = zip_index_get(zip_path);
+		if (!idx)
 		{
-			printf("isPathDirectory(OpenZipfileCached) Zip:%s, error:%s\n", zip_path,
-				mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+			printf("isPathDirectory(zip_index_get) Zip:%s, can't read the archive\n", zip_path);
 			return 0;
 		}
 
@@ -206,17 +161,15 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 		// this is a binary search (usually) If that fails then scan for the first
 		// entry that starts with file_path
 
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
-		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index))
+		const int file_index = idx->locate(file_path);
+		if (file_index >= 0 && idx->entries[file_index].is_dir)
 		{
 			return 1;
 		}
 
-		for (size_t i = 0; i < mz_zip_reader_get_num_files(&last_zip_archive); i++)
+		for (uint32_t i = 0; i < idx->count(); i++)
 		{
-			char zip_fname[256];
-			mz_zip_reader_get_filename(&last_zip_archive, i, &zip_fname[0], sizeof(zip_fname));
-			if (strcasestr(zip_fname, file_path))
+			if (strcasestr(idx->name(i), file_path))
 			{
 				return 1;
 			}
@@ -250,13 +203,13 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 		{
 			return 0;
 		}
-		if (!OpenZipfileCached(full_path, 0))
+		auto idx = zip_index_get(zip_path);
+		if (!idx)
 		{
-			//printf("isPathRegularFile(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-			//       mz_zip_get_error_string(mz_zip_get_last_error(&z)));
+			//printf("isPathRegularFile(zip_index_get) Zip:%s, can't read the archive\n", zip_path);
 			return 0;
 		}
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
+		const int file_index = idx->locate(file_path);
 		if (file_index < 0)
 		{
 			//printf("isPathRegularFile(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
@@ -265,7 +218,7 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 			return 0;
 		}
 
-		if (!mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index) && mz_zip_reader_is_file_supported(&last_zip_archive, file_index))
+		if (!idx->entries[file_index].is_dir && idx->entries[file_index].supported)
 		{
 			return 1;
 		}
@@ -286,7 +239,7 @@ void FileClose(fileTYPE *file)
 		{
 			mz_zip_reader_extract_iter_free(file->zip->iter);
 		}
-		mz_zip_reader_end(&file->zip->archive);
+		zip_archive_put(file->zip->archive);
 
 		delete file->zip;
 	}
@@ -310,23 +263,6 @@ void FileClose(fileTYPE *file)
 	file->size = 0;
 }
 
-static int zip_search_by_crc(mz_zip_archive *zipArchive, uint32_t crc32)
-{
-	for (unsigned int file_index = 0; file_index < zipArchive->m_total_files; file_index++)
-	{
-		mz_zip_archive_file_stat s;
-		if (mz_zip_reader_file_stat(zipArchive, file_index, &s))
-		{
-			if (s.m_crc32 == crc32)
-			{
-				return file_index;
-			}
-		}
-	}
-
-	return -1;
-}
-
 int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 {
 	make_fullpath(name);
@@ -344,43 +280,51 @@ int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 		return 0;
 	}
 
+	auto idx = zip_index_get(zip_path);
+	if (!idx)
+	{
+		printf("FileOpenZip(zip_index_get) Zip:%s, can't read the archive\n", zip_path);
+		return 0;
+	}
+
 	file->zip = new fileZipArchive{};
-	if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+	file->zip->archive = zip_archive_get(zip_path);
+	if (!file->zip->archive)
 	{
-		printf("FileOpenZip(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+		printf("FileOpenZip(zip_archive_get) Zip:%s, can't open the archive\n", zip_path);
+		FileClose(file);
 		return 0;
 	}
 
 	file->zip->index = -1;
-	if (crc32) file->zip->index = zip_search_by_crc(&file->zip->archive, crc32);
-	if (file->zip->index < 0) file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+	if (crc32) file->zip->index = idx->find_crc(crc32);
+	if (file->zip->index < 0) file->zip->index = idx->locate(file_path);
 	if (file->zip->index < 0)
 	{
 		printf("FileOpenZip(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 
 	mz_zip_archive_file_stat s;
-	if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+	if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 	{
 		printf("FileOpenZip(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 	file->size = s.m_uncomp_size;
 
-	file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+	file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 	if (!file->zip->iter)
 	{
 		printf("FileOpenZip(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
@@ -412,40 +356,41 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 		}
 
 		file->zip = new fileZipArchive{};
-		if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+		file->zip->archive = zip_archive_get(zip_path);
+		if (!file->zip->archive)
 		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+			if(!mute) printf("FileOpenEx(zip_archive_get) Zip:%s, can't open the archive\n", zip_path);
+			FileClose(file);
 			return 0;
 		}
 
-		file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+		file->zip->index = mz_zip_reader_locate_file(file->zip->archive, file_path, NULL, 0);
 		if (file->zip->index < 0)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 
 		mz_zip_archive_file_stat s;
-		if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+		if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 		file->size = s.m_uncomp_size;
 
-		file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+		file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 		if (!file->zip->iter)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
@@ -565,11 +510,11 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 
 		if (offset < file->zip->offset)
 		{
-			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 			if (!iter)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_new) Failed to rewind iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 				return 0;
 			}
 
@@ -587,7 +532,7 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			if (read_len < want_len)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 				return 0;
 			}
 		}
@@ -628,7 +573,7 @@ int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
 		if (!ret)
 		{
 			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
-			       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+			       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			return failres;
 		}
 		file->zip->offset += ret;
@@ -1208,9 +1153,18 @@ void FindStorage(void)
 	else if (ENOENT == errno) mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
 }
 
-struct DirentComp
+// Sort keys are computed once per entry instead of on every comparison
+// and only the small keys get moved around while sorting.
+struct DirentKey
 {
-	bool operator()(const direntext_t& de1, const direntext_t& de2)
+	const direntext_t *item;
+	int len;  // name length without extension
+	int rank; // "..", folders, files
+};
+
+struct DirentKeyComp
+{
+	bool operator()(const DirentKey& k1, const DirentKey& k2)
 	{
 
 #ifdef USE_SCHEDULER
@@ -1220,26 +1174,17 @@ struct DirentComp
 		}
 #endif
 
-		if ((de1.de.d_type == DT_DIR) && !strcmp(de1.altname, "..")) return true;
-		if ((de2.de.d_type == DT_DIR) && !strcmp(de2.altname, "..")) return false;
-
-		if ((de1.de.d_type == DT_DIR) && (de2.de.d_type != DT_DIR)) return true;
-		if ((de1.de.d_type != DT_DIR) && (de2.de.d_type == DT_DIR)) return false;
+		if (k1.rank != k2.rank) return k1.rank < k2.rank;
 
-		int len1 = strlen(de1.altname);
-		int len2 = strlen(de2.altname);
-		if ((len1 > 4) && (de1.altname[len1 - 4] == '.')) len1 -= 4;
-		if ((len2 > 4) && (de2.altname[len2 - 4] == '.')) len2 -= 4;
-
-		int len = (len1 < len2) ? len1 : len2;
-		int ret = strncasecmp(de1.altname, de2.altname, len);
+		int len = (k1.len < k2.len) ? k1.len : k2.len;
+		int ret = strncasecmp(k1.item->altname, k2.item->altname, len);
 		if (!ret)
 		{
-			if(len1 != len2)
+			if (k1.len != k2.len)
 			{
-				return len1 < len2;
+				return k1.len < k2.len;
 			}
-			ret = strcasecmp(de1.datecode, de2.datecode);
+			ret = strcasecmp(k1.item->datecode, k2.item->datecode);
 		}
 
 		return ret < 0;
@@ -1248,6 +1193,170 @@ struct DirentComp
 	size_t iterations = 0;
 };
 
+static void SortDirItems()
+{
+	std::vector<DirentKey> keys(DirItem.size());
+	for (size_t i = 0; i < DirItem.size(); i++)
+	{
+		const direntext_t *item = &DirItem[i];
+		DirentKey *key = &keys[i];
+
+		key->item = item;
+		key->rank = (item->de.d_type != DT_DIR) ? 2 : strcmp(item->altname, "..") ? 1 : 0;
+		key->len = strlen(item->altname);
+		if ((key->len > 4) && (item->altname[key->len - 4] == '.')) key->len -= 4;
+	}
+
+	std::sort(keys.begin(), keys.end(), DirentKeyComp());
+
+	DirentVector sorted;
+	sorted.reserve(keys.size());
+	for (auto &key : keys) sorted.push_back(*key.item);
+	DirItem.swap(sorted);
+}
+
+// Start of every run of entries with the same type and first letter
+// (SCANF_NEXT_CHAR/SCANF_PREV_CHAR) and entries by first letter for the
+// direct letter jumps, so both are binary searches.
+static std::vector<int> DirGroups;
+static std::vector<int> DirLetters[36];
+
+static int DirGroupChar(const direntext_t *item, int options)
+{
+	char c = item->altname[0];
+	if ((c == '_') && (item->de.d_type == DT_DIR) && (options & SCANO_CORES)) c = item->altname[1];
+	return toupper(c);
+}
+
+static int DirLetterIndex(int c)
+{
+	c = toupper(c);
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'Z') return c - 'A' + 10;
+	return -1;
+}
+
+static void IndexDirItems(int options)
+{
+	DirGroups.clear();
+	for (auto &letter : DirLetters) letter.clear();
+
+	for (int i = 0; i < (int)DirItem.size(); i++)
+	{
+		const direntext_t *item = &DirItem[i];
+		if (!i || DirGroupChar(item, options) != DirGroupChar(&DirItem[i - 1], options) || item->de.d_type != DirItem[i - 1].de.d_type)
+		{
+			DirGroups.push_back(i);
+		}
+
+		int letter = DirLetterIndex(item->altname[0]);
+		if (letter >= 0) DirLetters[letter].push_back(i);
+	}
+}
+
+// Raw listing of a folder, reused by every scan of the same folder (with
+// any extension filter or options) until the folder's mtime changes.
+// FAT keeps directory mtime in 2 second steps, so a listing taken too
+// close to the last change is never reused.
+struct DirSnapshot
+{
+	std::string path;
+	struct timespec mtime;
+	bool stable;
+	std::vector<std::string> names;
+	std::vector<uint8_t> types;
+};
+
+#define DIR_SNAPSHOTS    4
+#define DIR_MTIME_SLACK  2
+
+static std::vector<std::shared_ptr<DirSnapshot>> DirSnapshots; // most recent first
+
+static std::shared_ptr<DirSnapshot> ReadDirSnapshot(const std::string &path)
+{
+	struct stat64 st;
+	if (stat64(path.c_str(), &st) < 0) return nullptr;
+
+	DIR *d = opendir(path.c_str());
+	if (!d) return nullptr;
+
+	auto snap = std::make_shared<DirSnapshot>();
+	snap->path = path;
+	snap->mtime = st.st_mtim;
+	snap->stable = time(NULL) > st.st_mtime + DIR_MTIME_SLACK;
+
+	std::string entry_path = path + "/";
+	struct dirent64 *de;
+	while ((de = readdir64(d)))
+	{
+		uint8_t type = de->d_type;
+
+		// Resolve symbolic links and file systems without d_type
+		if (type == DT_LNK || type == DT_UNKNOWN)
+		{
+			entry_path.resize(path.size() + 1);
+			entry_path += de->d_name;
+
+			struct stat entrystat;
+			if (!stat(entry_path.c_str(), &entrystat))
+			{
+				if (S_ISREG(entrystat.st_mode)) type = DT_REG;
+				else if (S_ISDIR(entrystat.st_mode)) type = DT_DIR;
+			}
+		}
+
+		snap->names.push_back(de->d_name);
+		snap->types.push_back(type);
+	}
+
+	closedir(d);
+	return snap;
+}
+
+static std::shared_ptr<const DirSnapshot> GetDirSnapshot(const char *path)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0) return nullptr;
+
+	for (auto it = DirSnapshots.begin(); it != DirSnapshots.end(); ++it)
+	{
+		auto snap = *it;
+		if (snap->path != path) continue;
+
+		DirSnapshots.erase(it);
+		if (snap->stable && snap->mtime.tv_sec == st.st_mtim.tv_sec && snap->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		{
+			DirSnapshots.insert(DirSnapshots.begin(), snap);
+			return snap;
+		}
+		break;
+	}
+
+	// Large folders on USB or network shares take a while to list,
+	// keep input and core I/O going in the meantime. Not on HIGH, the
+	// listing would hold up IDE read-ahead and ROM transfers for seconds.
+	std::shared_ptr<DirSnapshot> snap;
+	std::string dir = path;
+	offload_handle_t h = offload_add_work([&snap, dir] { snap = ReadDirSnapshot(dir); }, OFFLOAD_LOW);
+
+#ifdef USE_SCHEDULER
+	if (scheduler_in_task())
+	{
+		while (!offload_done(h)) scheduler_yield();
+	}
+	else
+#endif
+	offload_wait(h);
+
+	if (snap)
+	{
+		DirSnapshots.insert(DirSnapshots.begin(), snap);
+		if (DirSnapshots.size() > DIR_SNAPSHOTS) DirSnapshots.pop_back();
+	}
+
+	return snap;
+}
+
 void AdjustDirectory(char *path)
 {
 	if (!FileExists(path)) return;
@@ -1435,20 +1544,20 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		char *zip_path, *file_path_in_zip = (char*)"";
 		FileIsZipped(full_path, &zip_path, &file_path_in_zip);
 
-		DIR *d = nullptr;
-		mz_zip_archive *z = nullptr;
+		std::shared_ptr<const DirSnapshot> d;
+		std::shared_ptr<const zip_index_t> z;
 		if (is_zipped)
 		{
-			if (!OpenZipfileCached(full_path, 0))
+			z = zip_index_get(zip_path);
+			if (!z)
 			{
-				printf("Couldn't open zip file %s: %s\n", full_path, mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+				printf("Couldn't open zip file %s\n", full_path);
 				return 0;
 			}
-			z = &last_zip_archive;
 		}
 		else
 		{
-			d = opendir(full_path);
+			d = GetDirSnapshot(full_path);
 			if (!d)
 			{
 				printf("Couldn't open dir: %s\n", full_path);
@@ -1457,8 +1566,8 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		}
 
 		struct dirent64 *de = nullptr;
-		for (size_t i = 0; (d && (de = readdir64(d)))
-				 || (z && i < mz_zip_reader_get_num_files(z)); i++)
+		for (size_t i = 0; (d && i < d->names.size())
+				 || (z && i < z->count()); i++)
 		{
 #ifdef USE_SCHEDULER
 			if (0 < i && i % YieldIterations == 0)
@@ -1471,7 +1580,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 
 			if (z)
 			{
-				mz_zip_reader_get_filename(z, i, &_de.d_name[0], sizeof(_de.d_name));
+				strncpy(_de.d_name, z->name(i), sizeof(_de.d_name) - 1);
 				const char *rname = GetRelativeFileName(file_path_in_zip, _de.d_name);
 				if (rname)
 				{
@@ -1505,7 +1614,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 
 				de = &_de;
 
-				_de.d_type = mz_zip_reader_is_file_a_directory(z, i) ? DT_DIR : DT_REG;
+				_de.d_type = z->entries[i].is_dir ? DT_DIR : DT_REG;
 				if (_de.d_type == DT_DIR) {
 					// Remove trailing slash.
 					if (DirNames.find(_de.d_name) != DirNames.end())
@@ -1519,24 +1628,11 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 					}
 				}
 			}
-			// Handle (possible) symbolic link type in the directory entry
-			else if (de->d_type == DT_LNK || de->d_type == DT_REG)
+			else
 			{
-				sprintf(full_path + path_len, "/%s", de->d_name);
-
-				struct stat entrystat;
-
-				if (!stat(full_path, &entrystat))
-				{
-					if (S_ISREG(entrystat.st_mode))
-					{
-						de->d_type = DT_REG;
-					}
-					else if (S_ISDIR(entrystat.st_mode))
-					{
-						de->d_type = DT_DIR;
-					}
-				}
+				strncpy(_de.d_name, d->names[i].c_str(), sizeof(_de.d_name) - 1);
+				_de.d_type = d->types[i];
+				de = &_de;
 			}
 
             if (filter)
@@ -1713,15 +1809,11 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			DirItem.push_back(dext);
 		}
 
-		if (d)
-		{
-			closedir(d);
-		}
-
 		printf("Got %d dir entries\n", flist_nDirEntries());
 		if (!flist_nDirEntries()) return 0;
 
-		std::sort(DirItem.begin(), DirItem.end(), DirentComp());
+		SortDirItems();
+		IndexDirItems(options);
 		if (file_name[0])
 		{
 			int pos = -1;
@@ -1908,32 +2000,13 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		}
 		else if (mode == SCANF_NEXT_CHAR)
 		{
-			//DirItem is sorted, so just advance until the first character changes.
-			//if we reach the end before that don't change anything.
-			//If we change d_type also consider that 'next'. This means next
-			//advances through directories, and then advances through files
-			//
-			int found = -1;
-			char curdType = DirItem[iSelectedEntry].de.d_type;
-			char curChar = DirItem[iSelectedEntry].altname[0]; 
-			if ((curChar == '_') && (curdType == DT_DIR) && (options & SCANO_CORES))
-				curChar = DirItem[iSelectedEntry].altname[1];
-			curChar = toupper(curChar);
-
-			for (int i = iSelectedEntry+1; i < flist_nDirEntries(); i++)
-			{
-				char tryChar = DirItem[i].altname[0];
-				if ((tryChar == '_') && (DirItem[i].de.d_type == DT_DIR) && (options & SCANO_CORES))
-					tryChar = DirItem[i].altname[1];
-				if (toupper(tryChar) != curChar || DirItem[i].de.d_type != curdType)
-				{
-					found = i;
-					break;
-				}
-			}
-			if (found >= 0)
+			//DirItem is sorted, so the next run of entries with another first character
+			//(or another d_type) is the next group. Directories come before files.
+			//If the selection is in the last group don't change anything.
+			int group = std::upper_bound(DirGroups.begin(), DirGroups.end(), iSelectedEntry) - DirGroups.begin();
+			if (group < (int)DirGroups.size())
 			{
-				iSelectedEntry = found;
+				iSelectedEntry = DirGroups[group];
 				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
 				else iFirstEntry = iSelectedEntry - (OsdGetSize()/2) + 1;
 				if (iFirstEntry < 0) iFirstEntry = 0;
@@ -1941,40 +2014,11 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		}
 		else if (mode == SCANF_PREV_CHAR)
 		{
-			//Previous seek seeks to the FIRST entry that starts with the previous letter
-			//Search backward until the first char changes, and then continue looking backward
-			//until it changes again. 
-
-
-			int found = -1;
-			char curdType = DirItem[iSelectedEntry].de.d_type;
-			bool sawChange = false;
-			char curChar = DirItem[iSelectedEntry].altname[0]; 
-			if ((curChar == '_') && (curdType == DT_DIR) && (options & SCANO_CORES))
-				curChar = DirItem[iSelectedEntry].altname[1];
-			curChar = toupper(curChar);
-			for (int i = iSelectedEntry-1; i >= 0; i--)
+			//Previous seek seeks to the FIRST entry of the previous group.
+			int group = std::upper_bound(DirGroups.begin(), DirGroups.end(), iSelectedEntry) - DirGroups.begin() - 1;
+			if (group > 0)
 			{
-				char tryChar = DirItem[i].altname[0];
-				if ((tryChar == '_') && (DirItem[i].de.d_type == DT_DIR) && (options & SCANO_CORES))
-					tryChar = DirItem[i].altname[1];
-				if (toupper(tryChar) != curChar || DirItem[i].de.d_type != curdType)
-				{
-					if (sawChange)
-					{
-						found = i+1;
-						break;
-					}
-					sawChange = true;
-					curChar = DirItem[i].altname[0];
-					if (curChar == '_')
-						curChar = DirItem[i].altname[1];
-					curChar = toupper(curChar);
-				}
-			}
-			if (found >= 0)
-			{
-				iSelectedEntry = found;
+				iSelectedEntry = DirGroups[group - 1];
 				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
 				else iFirstEntry = iSelectedEntry - (OsdGetSize()/2) + 1;
 				if (iFirstEntry < 0) iFirstEntry = 0;
@@ -1983,30 +2027,14 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		else
 		{
 			//printf("dir scan for key: %x/%c\n", mode, mode);
-			mode = toupper(mode);
-			if ((mode >= '0' && mode <= '9') || (mode >= 'A' && mode <= 'Z'))
+			int letter = DirLetterIndex(mode);
+			if (letter >= 0)
 			{
-				int found = -1;
-				for (int i = iSelectedEntry+1; i < flist_nDirEntries(); i++)
-				{
-					if (toupper(DirItem[i].altname[0]) == mode)
-					{
-						found = i;
-						break;
-					}
-				}
-
-				if (found < 0)
-				{
-					for (int i = 0; i < flist_nDirEntries(); i++)
-					{
-						if (toupper(DirItem[i].altname[0]) == mode)
-						{
-							found = i;
-							break;
-						}
-					}
-				}
+				//next entry starting with the letter, wrap around to the first one
+				const std::vector<int> &pos = DirLetters[letter];
+				auto it = std::upper_bound(pos.begin(), pos.end(), iSelectedEntry);
+				if (it == pos.end()) it = pos.begin();
+				int found = (it == pos.end()) ? -1 : *it;
 
 				if (found >= 0)
 				{
@@ -16,6 +16,9 @@
 #include "menu.h"
 #include "shmem.h"
 #include "offload.h"
+#include "block_cache.h"
+#include "support/vhd/vhddyn.h"
+#include "fpga_sim.h"
 
 #include "fpga_base_addr_ac5.h"
 #include "fpga_manager.h"
@@ -26,8 +29,8 @@
 #define FPGA_REG_BASE 0xFF000000
 #define FPGA_REG_SIZE 0x01000000
 
-#define MAP_ADDR(x) (volatile uint32_t*)(&map_base[(((uint32_t)(x)) & 0xFFFFFF)>>2])
-#define IS_REG(x) (((((uint32_t)(x))-1)>=(FPGA_REG_BASE - 1)) && ((((uint32_t)(x))-1)<(FPGA_REG_BASE + FPGA_REG_SIZE - 1)))
+#define MAP_ADDR(x) (volatile uint32_t*)(&map_base[(((uintptr_t)(x)) & 0xFFFFFF)>>2])
+#define IS_REG(x) (((((uintptr_t)(x))-1)>=(FPGA_REG_BASE - 1)) && ((((uintptr_t)(x))-1)<(FPGA_REG_BASE + FPGA_REG_SIZE - 1)))
 
 #define fatal(x) munmap((void*)map_base, FPGA_REG_SIZE); close(fd); exit(x)
 
@@ -231,14 +234,17 @@ static int fpgamgr_program_init(void)
 /* Write the RBF data to FPGA Manager */
 static void fpgamgr_program_write(const void *rbf_data, size_t rbf_size)
 {
-	uint32_t src = (uint32_t)rbf_data;
-	uint32_t dst = (uint32_t)MAP_ADDR(SOCFPGA_FPGAMGRDATA_ADDRESS);
+	uintptr_t src = (uintptr_t)rbf_data;
+	uintptr_t dst = (uintptr_t)MAP_ADDR(SOCFPGA_FPGAMGRDATA_ADDRESS);
 
 	/* Number of loops for 32-byte long copying. */
 	uint32_t loops32 = rbf_size / 32;
 	/* Number of loops for 4-byte long copying + trailing bytes */
 	uint32_t loops4 = DIV_ROUND_UP(rbf_size % 32, 4);
 
+#ifdef FPGA_SIM
+	(void)src; (void)dst; (void)loops32; (void)loops4;
+#else
 	asm volatile(
 		"   cmp %2, #0\n"
 		"   beq 2f\n"
@@ -256,6 +262,7 @@ static void fpgamgr_program_write(const void *rbf_data, size_t rbf_size)
 		"4: nop\n"
 		: "+r"(src), "+r"(dst), "+r"(loops32), "+r"(loops4) :
 		: "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "cc");
+#endif
 }
 
 /* Ensure the FPGA entering config done */
@@ -348,7 +355,7 @@ static int socfpga_load(const void *rbf_data, size_t rbf_size)
 {
 	unsigned long status;
 
-	if ((uint32_t)rbf_data & 0x3) {
+	if ((uintptr_t)rbf_data & 0x3) {
 		printf("FPGA: Unaligned data, realign to 32bit boundary.\n");
 		return -EINVAL;
 	}
@@ -508,6 +515,21 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 }
 
 static uint32_t gpo_copy = 0;
+
+#ifdef FPGA_SIM
+
+void inline fpga_gpo_write(uint32_t value)
+{
+	gpo_copy = value;
+	fpga_sim_gpo(value);
+}
+
+#define fpga_gpo_writeN(value) fpga_sim_gpo(value)
+#define fpga_gpo_read() gpo_copy
+#define fpga_gpi_read() (int)fpga_sim_gpi()
+
+#else
+
 void inline fpga_gpo_write(uint32_t value)
 {
 	gpo_copy = value;
@@ -518,14 +540,16 @@ void inline fpga_gpo_write(uint32_t value)
 #define fpga_gpo_read() gpo_copy //readl((void*)(SOCFPGA_MGR_ADDRESS + 0x10))
 #define fpga_gpi_read() (int)readl((void*)(SOCFPGA_MGR_ADDRESS + 0x14))
 
+#endif
+
 void fpga_core_write(uint32_t offset, uint32_t value)
 {
-	if (offset <= 0x1FFFFF) writel(value, (void*)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
+	if (offset <= 0x1FFFFF) writel(value, (void*)(uintptr_t)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
 }
 
 uint32_t fpga_core_read(uint32_t offset)
 {
-	if (offset <= 0x1FFFFF) return readl((void*)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
+	if (offset <= 0x1FFFFF) return readl((void*)(uintptr_t)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
 	return 0;
 }
 
@@ -614,6 +638,8 @@ char *getappname()
 
 void app_restart(const char *path, const char *xml, const char *exe)
 {
+	block_cache_flush_all(true);
+	vhd_flush_all();
 	sync();
 	fpga_core_reset(1);
 
@@ -649,8 +675,12 @@ int is_fpga_ready(int quick)
 #define SSPI_STROBE  (1<<17)
 #define SSPI_ACK     SSPI_STROBE
 
+fpga_spi_stats_t fpga_spi_stats = {};
+
 void fpga_spi_en(uint32_t mask, uint32_t en)
 {
+	fpga_spi_stats.cs_toggles++;
+	fpga_spi_stats.gpo_writes++;
 	uint32_t gpo = fpga_gpo_read() | 0x80000000;
 	fpga_gpo_write(en ? gpo | mask : gpo & ~mask);
 }
@@ -676,9 +706,13 @@ uint16_t fpga_spi(uint16_t word)
 	fpga_gpo_write(gpo);
 	fpga_gpo_write(gpo | SSPI_STROBE);
 
+	fpga_spi_stats.words++;
+	fpga_spi_stats.gpo_writes += 3;
+
 	int gpi;
 	do
 	{
+		fpga_spi_stats.gpi_reads++;
 		gpi = fpga_gpi_read();
 		if (gpi < 0)
 		{
@@ -692,6 +726,7 @@ uint16_t fpga_spi(uint16_t word)
 
 	do
 	{
+		fpga_spi_stats.gpi_reads++;
 		gpi = fpga_gpi_read();
 		if (gpi < 0)
 		{
@@ -9,6 +9,17 @@
 
 int fpga_io_init();
 
+// command path only, the block transfers are not counted
+struct fpga_spi_stats_t
+{
+	uint64_t words;
+	uint64_t cs_toggles;
+	uint64_t gpo_writes;
+	uint64_t gpi_reads;
+};
+
+extern fpga_spi_stats_t fpga_spi_stats;
+
 void fpga_spi_en(uint32_t mask, uint32_t en);
 uint16_t fpga_spi(uint16_t word);
 uint16_t fpga_spi_fast(uint16_t word);
@@ -0,0 +1,973 @@
+#ifdef FPGA_SIM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fpga_sim.h"
+#include "fpga_io.h"
+#include "user_io.h"
+#include "ide.h"
+#include "latency.h"
+#include "miniz.h"
+#include "support/psx/psx.h"
+#include "support/arcade/mra_loader.h"
+#include "support/neogeo/neogeo_loader.h"
+#include "shmem.h"
+#include "cfg.h"
+#include "support/snes/msu_stream.h"
+#include "scaler.h"
+#include "cd.h"
+#include "lib/imlib2/Imlib2.h"
+#include <bluetooth.h>
+#include <hci.h>
+#include <hci_lib.h>
+
+#define SIM_STROBE   (1<<17)
+#define SIM_CS_FPGA  (1<<18)
+#define SIM_CS_OSD   (1<<19)
+#define SIM_CS_IO    (1<<20)
+
+#define SIM_CORE_ID  ((0x5CA623 << 8) | CORE_TYPE_8BIT)
+#define SIM_FIO_WIDE 1
+
+enum { CH_NONE = 0, CH_FPGA, CH_OSD, CH_IO, CH_COUNT };
+
+// IDE host side: issues a run of READ/WRITE MULTIPLE commands and checks
+// the sectors coming back against the image file.
+struct sim_ide_t
+{
+	uint32_t lba;
+	uint32_t left;
+	uint32_t per_cmd;
+	uint8_t spb;
+	uint8_t cmd;
+
+	bool active;
+	bool writing;
+	bool drq;
+	bool end;
+	uint16_t req;
+	uint16_t taskfile[6];
+	uint16_t regs[6];
+	uint32_t io_size;
+	uint32_t data_words;
+
+	int verify_fd;
+	uint32_t data_lba;
+	uint32_t sector_pos;
+	uint8_t sector[512];
+
+	uint64_t bytes;
+	uint64_t commands;
+	uint64_t mismatches;
+	uint64_t errors;
+};
+
+static struct
+{
+	uint32_t gpo;
+	uint16_t resp;
+	bool ack;
+
+	int ch;
+	uint32_t widx;
+	uint16_t cmd;
+	uint16_t dma_addr;
+
+	bool download;
+	bool dl_log;
+	uint64_t dl_bytes;
+	uint32_t dl_crc;
+
+	uint64_t words[CH_COUNT];
+	uint64_t windows[CH_COUNT];
+	uint64_t gpo_writes;
+	uint64_t gpi_reads;
+
+	sim_ide_t ide[2];
+	int memfd;
+} sim = {};
+
+int fpga_sim_memfd()
+{
+	if (!sim.memfd)
+	{
+		// whole 32-bit physical space, pages are allocated on first touch
+		sim.memfd = memfd_create("mister_sim", MFD_CLOEXEC);
+		if (sim.memfd < 0 || ftruncate(sim.memfd, 1ULL << 32) < 0)
+		{
+			printf("fpga_sim: cannot create memory backing\n");
+			sim.memfd = -1;
+		}
+	}
+
+	return sim.memfd;
+}
+
+static void ide_issue(sim_ide_t *h)
+{
+	uint32_t cnt = 0;
+	uint32_t lba = h->lba;
+
+	if (h->spb)
+	{
+		h->cmd = 0xC6;
+		cnt = h->spb;
+		h->spb = 0;
+	}
+	else if (h->left)
+	{
+		cnt = (h->left > h->per_cmd) ? h->per_cmd : h->left;
+		h->cmd = h->writing ? 0xC5 : 0xC4;
+		h->data_lba = lba;
+		h->lba += cnt;
+		h->left -= cnt;
+	}
+	else
+	{
+		return;
+	}
+
+	// layout as read by ide_get_regs(), io_fast set, LBA mode
+	h->taskfile[0] = 0x0002;
+	h->taskfile[1] = (cnt & 0xFF) | ((lba & 0xFF) << 8);
+	h->taskfile[2] = (uint16_t)(lba >> 8);
+	h->taskfile[3] = 0;
+	h->taskfile[4] = 0;
+	h->taskfile[5] = ((lba >> 24) & 0xF) | 0x40 | (h->cmd << 8);
+
+	h->active = true;
+	h->drq = false;
+	h->data_words = 0;
+	h->sector_pos = 0;
+	h->req = 4;
+}
+
+static void ide_done(sim_ide_t *h)
+{
+	h->active = false;
+	h->commands++;
+	ide_issue(h);
+}
+
+static void ide_block_check(sim_ide_t *h)
+{
+	uint32_t words = h->io_size * 256;
+	if (!h->drq || h->data_words < words) return;
+
+	h->drq = false;
+	h->data_words -= words;
+	if (h->end) ide_done(h);
+	else h->req = 5;
+}
+
+static void ide_regs_written(sim_ide_t *h)
+{
+	uint8_t status = h->regs[5] >> 8;
+	h->io_size = h->regs[0] & 0xFF;
+
+	if (!h->active) return;
+
+	if (status & ATA_STATUS_ERR)
+	{
+		h->errors++;
+		ide_done(h);
+	}
+	else if (!(status & ATA_STATUS_DRQ))
+	{
+		ide_done(h);
+	}
+	else if (h->writing && h->cmd == 0xC5)
+	{
+		// host has the data ready right away
+		h->data_words = 0;
+		h->req = 5;
+	}
+	else
+	{
+		h->drq = true;
+		h->end = (status & ATA_STATUS_END) != 0;
+		ide_block_check(h);
+	}
+}
+
+static void ide_data_in(sim_ide_t *h, uint16_t w)
+{
+	h->data_words++;
+
+	if (h->cmd == 0xC4)
+	{
+		h->sector[h->sector_pos++] = (uint8_t)w;
+		h->sector[h->sector_pos++] = (uint8_t)(w >> 8);
+		if (h->sector_pos == sizeof(h->sector))
+		{
+			if (h->verify_fd >= 0)
+			{
+				uint8_t ref[512] = {};
+				if (pread(h->verify_fd, ref, sizeof(ref), (off_t)h->data_lba * 512) < 0 || memcmp(ref, h->sector, sizeof(ref))) h->mismatches++;
+			}
+
+			h->data_lba++;
+			h->bytes += sizeof(h->sector);
+			h->sector_pos = 0;
+		}
+	}
+
+	ide_block_check(h);
+}
+
+static uint16_t ide_data_out(sim_ide_t *h)
+{
+	// recognizable pattern: sector number in every word
+	uint16_t w = (uint16_t)(h->data_lba ^ (h->sector_pos >> 1));
+	h->sector_pos += 2;
+	if (h->sector_pos == 512)
+	{
+		h->sector_pos = 0;
+		h->data_lba++;
+		h->bytes += 512;
+	}
+
+	h->data_words++;
+	return w;
+}
+
+static sim_ide_t *ide_port(uint16_t addr)
+{
+	if ((addr & 0xFF00) == 0xF000) return &sim.ide[0];
+	if ((addr & 0xFF00) == 0xF100) return &sim.ide[1];
+	return nullptr;
+}
+
+static void dma_write(uint16_t w)
+{
+	sim_ide_t *h = ide_port(sim.dma_addr);
+	uint8_t reg = sim.dma_addr & 0xFF;
+
+	if (!h) return;
+	if (reg == 255)
+	{
+		ide_data_in(h, w);
+		return;
+	}
+
+	if (reg < 6)
+	{
+		h->regs[reg] = w;
+		if (reg == 5) ide_regs_written(h);
+	}
+	sim.dma_addr++;
+}
+
+static uint16_t dma_read()
+{
+	sim_ide_t *h = ide_port(sim.dma_addr);
+	uint8_t reg = sim.dma_addr & 0xFF;
+
+	if (!h) return 0;
+	if (reg == 255) return ide_data_out(h);
+
+	sim.dma_addr++;
+	return (reg < 6) ? h->taskfile[reg] : 0;
+}
+
+static uint16_t uio_word(uint32_t idx, uint16_t w)
+{
+	switch (sim.cmd)
+	{
+	case UIO_DMA_WRITE:
+	case UIO_DMA_READ:
+		if (idx == 1) sim.dma_addr = w;
+		else if (idx >= 3)
+		{
+			if (sim.cmd == UIO_DMA_READ) return dma_read();
+			dma_write(w);
+		}
+		break;
+
+	case UIO_DMA_SDIO:
+		if (idx == 1)
+		{
+			uint16_t req = sim.ide[0].req | (sim.ide[1].req << 3);
+			sim.ide[0].req = 0;
+			sim.ide[1].req = 0;
+			return req;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static uint16_t fio_word(uint32_t idx, uint16_t w)
+{
+	switch (sim.cmd)
+	{
+	case FIO_FILE_TX:
+		if (idx == 1)
+		{
+			if ((w & 0xFF) == 0xFF)
+			{
+				sim.download = true;
+				sim.dl_bytes = 0;
+				sim.dl_crc = (uint32_t)mz_crc32(0, NULL, 0);
+			}
+			else if (!(w & 0xFF))
+			{
+				if (sim.download && sim.dl_log) printf("sim: download of %llu bytes, crc %08X\n", (unsigned long long)sim.dl_bytes, sim.dl_crc);
+				sim.download = false;
+			}
+		}
+		break;
+
+	case FIO_FILE_TX_DAT:
+		if (idx && sim.download)
+		{
+			uint8_t b[2] = { (uint8_t)w, (uint8_t)(w >> 8) };
+			int n = user_io_get_width() ? 2 : 1;
+			sim.dl_crc = (uint32_t)mz_crc32(sim.dl_crc, b, n);
+			sim.dl_bytes += n;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static uint16_t spi_word(uint16_t w)
+{
+	uint32_t idx = sim.widx++;
+	sim.words[sim.ch]++;
+
+	if (!idx)
+	{
+		sim.cmd = w;
+		sim.windows[sim.ch]++;
+	}
+
+	switch (sim.ch)
+	{
+	case CH_IO:   return uio_word(idx, w);
+	case CH_FPGA: return fio_word(idx, w);
+	}
+
+	return 0;
+}
+
+void fpga_sim_gpo(uint32_t gpo)
+{
+	uint32_t old = sim.gpo;
+	sim.gpo = gpo;
+	sim.gpo_writes++;
+
+	// OSD select may come together with the other lines, see EnableOsd()
+	int ch = (gpo & SIM_CS_OSD) ? CH_OSD : (gpo & SIM_CS_IO) ? CH_IO : (gpo & SIM_CS_FPGA) ? CH_FPGA : CH_NONE;
+	if (ch != sim.ch)
+	{
+		sim.ch = ch;
+		sim.widx = 0;
+	}
+
+	if ((gpo & SIM_STROBE) && !(old & SIM_STROBE))
+	{
+		sim.resp = (ch != CH_NONE) ? spi_word(gpo & 0xFFFF) : 0;
+		sim.ack = true;
+	}
+	else if (!(gpo & SIM_STROBE))
+	{
+		sim.ack = false;
+	}
+}
+
+uint32_t fpga_sim_gpi()
+{
+	sim.gpi_reads++;
+
+	if (!(sim.gpo & 0x80000000)) return SIM_CORE_ID;
+	return (sim.ack ? SIM_STROBE : 0) | (SIM_FIO_WIDE << 16) | sim.resp;
+}
+
+static void reset_counters()
+{
+	memset(sim.words, 0, sizeof(sim.words));
+	memset(sim.windows, 0, sizeof(sim.windows));
+	sim.gpo_writes = 0;
+	sim.gpi_reads = 0;
+}
+
+static void print_counters(uint64_t bytes, uint64_t us)
+{
+	static const char *names[CH_COUNT] = { "none", "fpga", "osd", "io" };
+
+	if (!us) us = 1;
+	printf("  %llu KB in %llu ms, %.2f MB/s\n", (unsigned long long)(bytes / 1024), (unsigned long long)(us / 1000), (double)bytes / us);
+	for (int i = 1; i < CH_COUNT; i++)
+	{
+		if (sim.words[i]) printf("  %-4s: %llu words in %llu transfers\n", names[i], (unsigned long long)sim.words[i], (unsigned long long)sim.windows[i]);
+	}
+
+	double mb = bytes ? (double)bytes / (1024 * 1024) : 1;
+	printf("  mmio: gpo_wr=%llu gpi_rd=%llu (%.0f per MB)\n", (unsigned long long)sim.gpo_writes, (unsigned long long)sim.gpi_reads, (sim.gpo_writes + sim.gpi_reads) / mb);
+}
+
+static int bench_file(const char *path)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0)
+	{
+		printf("bench: cannot stat %s\n", path);
+		return 1;
+	}
+
+	reset_counters();
+	uint64_t start = latency_now_us();
+	if (!user_io_file_tx(path, 1, 0, 1))
+	{
+		printf("bench: transfer of %s failed\n", path);
+		return 1;
+	}
+	uint64_t us = latency_now_us() - start;
+
+	// reference CRC over what the core should have seen, 16 bit transfers pad odd sizes
+	uint32_t crc = (uint32_t)mz_crc32(0, NULL, 0);
+	uint64_t size = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	static uint8_t buf[256 * 1024];
+	ssize_t n;
+	while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		crc = (uint32_t)mz_crc32(crc, buf, n);
+		size += n;
+	}
+	if (fd >= 0) close(fd);
+	if ((size & 1) && user_io_get_width())
+	{
+		uint8_t z = 0;
+		crc = (uint32_t)mz_crc32(crc, &z, 1);
+		size++;
+	}
+
+	printf("file_tx %s (%d bit):\n", path, user_io_get_width() ? 16 : 8);
+	print_counters(sim.dl_bytes, us);
+
+	bool ok = (sim.dl_bytes == size && sim.dl_crc == crc);
+	printf("  %s (received %llu bytes, crc %08X, expected %08X)\n", ok ? "OK" : "MISMATCH", (unsigned long long)sim.dl_bytes, sim.dl_crc, crc);
+	return ok ? 0 : 1;
+}
+
+static int bench_mra(const char *path)
+{
+	sim.dl_log = true;
+	reset_counters();
+	uint64_t start = latency_now_us();
+	arcade_send_rom(path);
+	uint64_t us = latency_now_us() - start;
+	sim.dl_log = false;
+
+	printf("mra %s:\n", path);
+	print_counters(0, us);
+	return 0;
+}
+
+static int bench_neogeo(const char *path, uint32_t cache_mb)
+{
+	cfg.neogeo_cache = cache_mb;
+
+	reset_counters();
+	uint64_t start = latency_now_us();
+	int ok = neogeo_romset_tx((char*)path, 0);
+	uint64_t us = latency_now_us() - start;
+
+	// everything the loader writes lands in 0x30000000-0x3FFFFFFF
+	uint32_t crc = (uint32_t)mz_crc32(0, NULL, 0);
+	uint8_t *mem = (uint8_t*)shmem_map(0x30000000, 0x10000000);
+	if (mem)
+	{
+		crc = (uint32_t)mz_crc32(crc, mem, 0x10000000);
+		shmem_unmap(mem, 0x10000000);
+	}
+
+	printf("neogeo %s: %s\n", path, ok ? "loaded" : "FAILED");
+	print_counters(0, us);
+	printf("  ddr crc %08X\n", crc);
+	return ok ? 0 : 1;
+}
+
+// Same copies through the shmem windows and with a mapping per call (as
+// shmem_put() did before windows).
+static int bench_shmem(uint32_t mb)
+{
+	static uint8_t buf[1024 * 1024];
+	memset(buf, 0x5A, sizeof(buf));
+
+	uint64_t total = (uint64_t)mb * 1024 * 1024;
+	if (total > 0x10000000) total = 0x10000000;
+
+	// memfd pages are allocated on first touch, keep that out of the timing
+	shmem_set(0x30000000, 0, total);
+
+	static const uint32_t chunks[] = { 4096, 64 * 1024, 1024 * 1024 };
+	for (uint32_t chunk : chunks)
+	{
+		uint64_t start = latency_now_us();
+		for (uint64_t off = 0; off < total; off += chunk)
+		{
+			void *mem = mmap(0, chunk, PROT_READ | PROT_WRITE, MAP_SHARED, fpga_sim_memfd(), 0x30000000 + off);
+			if (mem == MAP_FAILED) return 1;
+			memcpy(mem, buf, chunk);
+			munmap(mem, chunk);
+		}
+		uint64_t us_map = latency_now_us() - start;
+
+		shmem_stats_t st0, st1;
+		shmem_get_stats(&st0);
+		start = latency_now_us();
+		for (uint64_t off = 0; off < total; off += chunk)
+		{
+			if (!shmem_put(0x30000000 + off, chunk, buf)) return 1;
+		}
+		uint64_t us_win = latency_now_us() - start;
+		shmem_get_stats(&st1);
+
+		printf("shmem_put %u MB in %u KB chunks:\n", (uint32_t)(total >> 20), chunk / 1024);
+		printf("  per call mapping: %llu us, %.1f MB/s\n", (unsigned long long)us_map, us_map ? total / (double)us_map : 0);
+		printf("  windows:          %llu us, %.1f MB/s (mmaps=%llu hits=%llu)\n", (unsigned long long)us_win, us_win ? total / (double)us_win : 0,
+			(unsigned long long)(st1.mmaps - st0.mmaps), (unsigned long long)(st1.hits - st0.hits));
+	}
+
+	shmem_stats_t st;
+	shmem_get_stats(&st);
+	printf("windows=%u mapped=%u MB\n", st.windows, st.mapped >> 20);
+	return 0;
+}
+
+// Plays an MSU-1 track as the core requests it: 1K sectors, jumps to the
+// loop point at the end and a few random jumps. Every sector is compared
+// against the file.
+static int bench_msu(const char *path, uint32_t loops)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("bench: cannot open %s\n", path);
+		return 1;
+	}
+
+	msu_stream_t *s = msu_stream_open(path);
+	if (!s)
+	{
+		close(fd);
+		return 1;
+	}
+
+	uint32_t size = msu_stream_size(s);
+	uint32_t loop = 0;
+	if (pread(fd, &loop, 4, 4) != 4) loop = 0;
+	uint32_t loop_offset = (8 + (uint64_t)loop * 4 < size) ? (8 + loop * 4) & ~1023 : 0;
+
+	latency_hist_t *hist = latency_hist("msu_wait");
+	hist->count = 0;
+	hist->max = 0;
+
+	static uint8_t buf[1024], ref[1024];
+	uint64_t sectors = 0, mismatches = 0;
+	uint32_t pos = 0;
+	srand(1);
+
+	uint64_t start = latency_now_us();
+	for (uint32_t pass = 0; pass <= loops; pass++)
+	{
+		while (pos < size)
+		{
+			if (!(rand() % 2000))
+			{
+				pos = (rand() % (size / 1024 + 1)) * 1024;
+				msu_stream_seek(s, pos);
+			}
+
+			msu_stream_read(s, buf, sizeof(buf));
+			memset(ref, 0, sizeof(ref));
+			if (pread(fd, ref, sizeof(ref), pos) < 0) memset(ref, 0xFF, sizeof(ref));
+			if (memcmp(buf, ref, sizeof(buf))) mismatches++;
+
+			pos += sizeof(buf);
+			sectors++;
+
+			// the core asks for the next sector every ~6ms
+			for (int i = 0; i < 4; i++) msu_stream_poll(s);
+		}
+
+		pos = loop_offset;
+		msu_stream_seek(s, pos);
+	}
+	uint64_t us = latency_now_us() - start;
+
+	msu_stream_close(s);
+	close(fd);
+
+	printf("msu %s: %llu sectors in %llu us, loop at 0x%X\n", path, (unsigned long long)sectors, (unsigned long long)us, loop_offset);
+	printf("  waits=%u p99=%uus max=%uus mismatches=%llu\n", hist->count, latency_percentile(hist, 99.0), hist->max, (unsigned long long)mismatches);
+	return mismatches ? 1 : 0;
+}
+
+// Fake scaler frame in DDR. Times the readback (against the byte loop it
+// replaced) and a rescaled screenshot: the part on the main thread and
+// until the file is written.
+static int bench_screenshot(uint32_t width, uint32_t height)
+{
+	uint32_t header = 256;
+	uint32_t line = (width * 3 + 255) & ~255;
+	uint32_t out_w = 1920, out_h = 1080;
+	if ((uint64_t)header + line * height > MISTER_SCALER_BUFFERSIZE)
+	{
+		printf("bench: %ux%u doesn't fit the scaler buffer\n", width, height);
+		return 1;
+	}
+
+	uint8_t hdr[16] = { 1, 1, (uint8_t)(header >> 8), (uint8_t)header, 0, 0,
+		(uint8_t)(width >> 8), (uint8_t)width, (uint8_t)(height >> 8), (uint8_t)height,
+		(uint8_t)(line >> 8), (uint8_t)line, (uint8_t)(out_w >> 8), (uint8_t)out_w, (uint8_t)(out_h >> 8), (uint8_t)out_h };
+
+	uint8_t *frame = (uint8_t*)calloc(header + line * height, 1);
+	memcpy(frame, hdr, sizeof(hdr));
+	for (uint32_t y = 0; y < height; y++)
+	{
+		uint8_t *p = frame + header + y * line;
+		for (uint32_t x = 0; x < width; x++)
+		{
+			*p++ = x;
+			*p++ = y;
+			*p++ = ((x >> 4) ^ (y >> 4)) & 1 ? 0xFF : (x + y) >> 1;
+		}
+	}
+	shmem_put(MISTER_SCALER_BASEADDR, header + line * height, frame);
+
+	mister_scaler *ms = mister_scaler_init();
+	if (!ms)
+	{
+		free(frame);
+		return 1;
+	}
+
+	uint8_t *buf = (uint8_t*)malloc(width * height * 4);
+	uint8_t *ref = (uint8_t*)malloc(width * height * 4);
+	const uint8_t *src = (const uint8_t*)ms->map + ms->map_off;
+	const int runs = 20;
+
+	uint64_t start = latency_now_us();
+	for (int i = 0; i < runs; i++)
+	{
+		for (uint32_t y = 0; y < height; y++)
+		{
+			const uint8_t *pix = src + header + y * line;
+			uint8_t *out = ref + y * width * 4;
+			for (uint32_t x = 0; x < width; x++)
+			{
+				out[2] = *pix++;
+				out[1] = *pix++;
+				out[0] = *pix++;
+				out[3] = 0xFF;
+				out += 4;
+			}
+		}
+	}
+	uint64_t us_old = latency_now_us() - start;
+
+	start = latency_now_us();
+	for (int i = 0; i < runs; i++) mister_scaler_read_32(ms, buf);
+	uint64_t us_32 = latency_now_us() - start;
+	bool ok = !memcmp(buf, ref, width * height * 4);
+
+	start = latency_now_us();
+	for (int i = 0; i < runs; i++) mister_scaler_read(ms, buf);
+	uint64_t us_24 = latency_now_us() - start;
+	for (uint32_t y = 0; y < height; y++) ok &= !memcmp(buf + y * width * 3, src + header + y * line, width * 3);
+
+	start = latency_now_us();
+	for (int i = 0; i < runs; i++) mister_scaler_read_yuv(ms, width, buf, width, buf + width * height, width, buf + width * height * 2);
+	uint64_t us_yuv = latency_now_us() - start;
+
+	mister_scaler_free(ms);
+
+	printf("scaler readback %ux%u, per frame:\n", width, height);
+	printf("  byte loop (old): %llu us\n", (unsigned long long)(us_old / runs));
+	printf("  read_32:         %llu us%s\n", (unsigned long long)(us_32 / runs), ok ? "" : " MISMATCH");
+	printf("  read:            %llu us\n", (unsigned long long)(us_24 / runs));
+	printf("  read_yuv:        %llu us\n", (unsigned long long)(us_yuv / runs));
+
+	start = latency_now_us();
+	user_io_screenshot("bench.png", 1);
+	uint64_t us_main = latency_now_us() - start;
+	user_io_screenshot_wait();
+	uint64_t us_total = latency_now_us() - start;
+
+	printf("screenshot %ux%u to %ux%u: main thread %llu us, written after %llu us\n", width, height, out_w, out_h, (unsigned long long)us_main, (unsigned long long)us_total);
+
+	free(buf);
+	free(ref);
+	free(frame);
+	return ok ? 0 : 1;
+}
+
+// The per-sector loops cd.cpp replaced, as they were in the cores.
+static void ref_swab16(uint8_t *buf, int len)
+{
+	for (int swapidx = 0; swapidx < len; swapidx += 2)
+	{
+		uint8_t temp = buf[swapidx];
+		buf[swapidx] = buf[swapidx + 1];
+		buf[swapidx + 1] = temp;
+	}
+}
+
+static void ref_descramble(uint8_t *buffer, const uint8_t *scramble)
+{
+	for (uint32_t i = 12; i < CD_RAW_SECTOR_SIZE; i++)
+	{
+		buffer[i] ^= scramble[i - 12];
+	}
+}
+
+static uint32_t ref_edc(uint8_t *buf, int len)
+{
+	static uint32_t crc_tab[256];
+	for (int i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+
+		for (unsigned j = 0; j < 8; j++)
+			c = (c >> 1) ^ ((c & 0x1) ? 0xD8018001 : 0);
+		crc_tab[i] = c;
+	}
+
+	uint32_t crc = 0;
+	for (int i = 0; i < len; i++)
+	{
+		crc ^= buf[i];
+		crc = (crc >> 8) ^ crc_tab[crc & 0xFF];
+	}
+
+	return crc;
+}
+
+static void ref_interleave_subcode(uint8_t *subc_data, uint16_t *buf)
+{
+	for (int i = 0, n = 0; i < 96; i += 2, n++)
+	{
+		int code = 0;
+		for (int j = 0; j < 8; j++)
+		{
+			int bits = (subc_data[(j * 12) + (i / 8)] >> (6 - (i & 6))) & 3;
+			code |= ((bits & 1) << (15 - j));
+			code |= ((bits >> 1) << (7 - j));
+		}
+		buf[n] = code;
+	}
+}
+
+static void cdk_report(const char *name, uint64_t bytes, uint64_t us_old, uint64_t us_new, bool ok)
+{
+	printf("  %-10s old %8.1f MB/s, new %8.1f MB/s, x%.1f%s\n", name,
+		us_old ? (double)bytes / us_old : 0, us_new ? (double)bytes / us_new : 0,
+		us_new ? (double)us_old / us_new : 0, ok ? "" : " MISMATCH");
+}
+
+static int bench_cdkernels(uint32_t sectors)
+{
+	const int runs = 10;
+	const uint32_t len = sectors * CD_RAW_SECTOR_SIZE;
+	uint8_t *src = (uint8_t*)malloc(len);
+	uint8_t *a = (uint8_t*)malloc(len);
+	uint8_t *b = (uint8_t*)malloc(len);
+	uint16_t *sa = (uint16_t*)malloc(sectors * 48 * sizeof(uint16_t));
+	uint16_t *sb = (uint16_t*)malloc(sectors * 48 * sizeof(uint16_t));
+	static uint8_t scramble[CD_RAW_SECTOR_SIZE - 12];
+
+	srand(1);
+	for (uint32_t i = 0; i < len; i++) src[i] = rand();
+	for (uint32_t i = 0; i < sizeof(scramble); i++) scramble[i] = rand();
+
+	printf("cd kernels, %u random sectors x %d:\n", sectors, runs);
+	int fails = 0;
+	uint64_t start, us_old, us_new;
+	bool ok;
+
+	// an even number of passes leaves the data swapped back
+	memcpy(a, src, len);
+	memcpy(b, src, len);
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) ref_swab16(a + i * CD_RAW_SECTOR_SIZE, CD_RAW_SECTOR_SIZE);
+	us_old = latency_now_us() - start;
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) cd_swab16(b + i * CD_RAW_SECTOR_SIZE, CD_RAW_SECTOR_SIZE);
+	us_new = latency_now_us() - start;
+	ref_swab16(a, len);
+	cd_swab16(b, len);
+	ok = !memcmp(a, b, len);
+	cdk_report("swab16", (uint64_t)len * runs, us_old, us_new, ok);
+	fails += !ok;
+
+	memcpy(a, src, len);
+	memcpy(b, src, len);
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) ref_descramble(a + i * CD_RAW_SECTOR_SIZE, scramble);
+	us_old = latency_now_us() - start;
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) cd_xor(b + i * CD_RAW_SECTOR_SIZE + 12, scramble, CD_RAW_SECTOR_SIZE - 12);
+	us_new = latency_now_us() - start;
+	for (uint32_t i = 0; i < sectors; i++)
+	{
+		ref_descramble(a + i * CD_RAW_SECTOR_SIZE, scramble);
+		cd_xor(b + i * CD_RAW_SECTOR_SIZE + 12, scramble, CD_RAW_SECTOR_SIZE - 12);
+	}
+	ok = !memcmp(a, b, len);
+	cdk_report("xor", (uint64_t)sectors * (CD_RAW_SECTOR_SIZE - 12) * runs, us_old, us_new, ok);
+	fails += !ok;
+
+	// mode 1 EDC span, odd lengths exercise the byte tail
+	uint32_t crc_old = 0, crc_new = 0;
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) crc_old += ref_edc(src + i * CD_RAW_SECTOR_SIZE, 2064);
+	us_old = latency_now_us() - start;
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) crc_new += cd_edc(src + i * CD_RAW_SECTOR_SIZE, 2064);
+	us_new = latency_now_us() - start;
+	ok = crc_old == crc_new;
+	for (uint32_t i = 0; i < sectors && ok; i++)
+	{
+		int n = 2064 - (i & 7);
+		ok = ref_edc(src + i * CD_RAW_SECTOR_SIZE, n) == cd_edc(src + i * CD_RAW_SECTOR_SIZE, n);
+	}
+	cdk_report("edc", (uint64_t)sectors * 2064 * runs, us_old, us_new, ok);
+	fails += !ok;
+
+	// 96 bytes of raw subcode per sector
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) ref_interleave_subcode(src + i * 96, sa + i * 48);
+	us_old = latency_now_us() - start;
+	start = latency_now_us();
+	for (int r = 0; r < runs; r++) for (uint32_t i = 0; i < sectors; i++) cd_interleave_subcode(src + i * 96, sb + i * 48);
+	us_new = latency_now_us() - start;
+	ok = !memcmp(sa, sb, sectors * 48 * sizeof(uint16_t));
+	cdk_report("subcode", (uint64_t)sectors * 96 * runs, us_old, us_new, ok);
+	fails += !ok;
+
+	free(src);
+	free(a);
+	free(b);
+	free(sa);
+	free(sb);
+	return fails ? 1 : 0;
+}
+
+static int bench_ide(const char *path, uint32_t mb, bool write)
+{
+	sim_ide_t *h = &sim.ide[0];
+	memset(h, 0, sizeof(*h));
+	h->verify_fd = write ? -1 : open(path, O_RDONLY | O_CLOEXEC);
+
+	if (!ide_open(0, path))
+	{
+		printf("bench: cannot open %s as hard disk\n", path);
+		return 1;
+	}
+
+	struct stat64 st;
+	uint64_t max = (stat64(path, &st) < 0) ? 0 : st.st_size / 512;
+	h->left = mb * 2048;
+	if (h->left > max) h->left = (uint32_t)max;
+	h->per_cmd = 128;
+	h->writing = write;
+	h->spb = 32;
+
+	reset_counters();
+	uint64_t start = latency_now_us();
+
+	ide_issue(h);
+	while (h->active)
+	{
+		uint16_t req = ide_check();
+		ide_io(0, req & 7);
+		ide_io(1, (req >> 3) & 7);
+	}
+	uint64_t us = latency_now_us() - start;
+
+	printf("ide %s %s:\n", write ? "write" : "read", path);
+	print_counters(h->bytes, us);
+	printf("  commands=%llu errors=%llu mismatches=%llu\n", (unsigned long long)h->commands, (unsigned long long)h->errors, (unsigned long long)h->mismatches);
+
+	if (h->verify_fd >= 0) close(h->verify_fd);
+	ide_open(0, "");
+	return (h->errors || h->mismatches) ? 1 : 0;
+}
+
+static int bench_cd(const char *path, uint32_t sectors)
+{
+	static uint8_t buf[2352 * 16];
+
+	psx_mount_cd(0, 1, path);
+
+	reset_counters();
+	uint64_t start = latency_now_us();
+	for (uint32_t lba = 0; lba < sectors; lba += 16) psx_read_cd(buf, lba, 16);
+	uint64_t us = latency_now_us() - start;
+
+	printf("psx_read_cd %s:\n", path);
+	print_counters((uint64_t)sectors * 2352, us);
+
+	psx_mount_cd(0, 1, "");
+	return 0;
+}
+
+int fpga_sim_bench(int argc, char *argv[])
+{
+	if (argc >= 2 && !strcmp(argv[0], "file")) return bench_file(argv[1]);
+	if (argc >= 2 && !strcmp(argv[0], "ide")) return bench_ide(argv[1], (argc > 2) ? strtoul(argv[2], 0, 0) : 64, argc > 3 && !strcmp(argv[3], "write"));
+	if (argc >= 2 && !strcmp(argv[0], "mra")) return bench_mra(argv[1]);
+	if (argc >= 2 && !strcmp(argv[0], "cd")) return bench_cd(argv[1], (argc > 2) ? strtoul(argv[2], 0, 0) : 20000);
+	if (argc >= 2 && !strcmp(argv[0], "msu")) return bench_msu(argv[1], (argc > 2) ? strtoul(argv[2], 0, 0) : 3);
+	if (argc >= 1 && !strcmp(argv[0], "shmem")) return bench_shmem((argc > 1) ? strtoul(argv[1], 0, 0) : 64);
+	if (argc >= 1 && !strcmp(argv[0], "screenshot")) return bench_screenshot((argc > 1) ? strtoul(argv[1], 0, 0) : 640, (argc > 2) ? strtoul(argv[2], 0, 0) : 480);
+	if (argc >= 1 && !strcmp(argv[0], "cdkernels")) return bench_cdkernels((argc > 1) ? strtoul(argv[1], 0, 0) : 2000);
+	if (argc >= 2 && !strcmp(argv[0], "neogeo")) return bench_neogeo(argv[1], (argc > 2) ? strtoul(argv[2], 0, 0) : 0);
+
+	printf("Usage: MiSTer --bench file <rom>\n");
+	printf("       MiSTer --bench ide <image> [MB] [write]\n");
+	printf("       MiSTer --bench cd <cue|chd> [sectors]\n");
+	printf("       MiSTer --bench mra <mra>\n");
+	printf("       MiSTer --bench neogeo <romset> [cache MB]\n");
+	printf("       MiSTer --bench shmem [MB]\n");
+	printf("       MiSTer --bench msu <track.pcm> [loops]\n");
+	printf("       MiSTer --bench screenshot [width] [height]\n");
+	printf("       MiSTer --bench cdkernels [sectors]\n");
+	printf("The ide write benchmark overwrites the image.\n");
+	return 1;
+}
+
+// lib/imlib2 and lib/bluetooth are ARM-only, so the host link gets these
+// instead: no images load and no adapter is found.
+Imlib_Image imlib_load_image_with_error_return(const char *, Imlib_Load_Error *error_return)
+{
+	if (error_return) *error_return = IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST;
+	return NULL;
+}
+// an image is just its pixel buffer, so menu code can still fill one
+static Imlib_Image sim_imlib_ctx;
+Imlib_Image imlib_create_image(int width, int height) { return calloc(width * height, sizeof(DATA32)); }
+Imlib_Image imlib_create_image_using_data(int, int, DATA32 *data) { return data; }
+void imlib_context_set_image(Imlib_Image image) { sim_imlib_ctx = image; }
+void imlib_image_orientate(int) {}
+void imlib_image_set_has_alpha(char) {}
+DATA32 *imlib_image_get_data(void) { return (DATA32*)sim_imlib_ctx; }
+int imlib_image_get_width(void) { return 0; }
+int imlib_image_get_height(void) { return 0; }
+void imlib_blend_image_onto_image(Imlib_Image, char, int, int, int, int, int, int, int, int) {}
+
+int hci_get_route(bdaddr_t *) { return -1; }
+
+#endif
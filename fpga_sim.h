@@ -0,0 +1,23 @@
+#ifndef FPGA_SIM_H
+#define FPGA_SIM_H
+
+#include <inttypes.h>
+
+// Host build (make SIM=1) only. Software model of the FPGA side: takes the
+// place of the GPO/GPI register pair and answers like a minimal core with
+// hps_io, so file transfers, IDE and CD paths run unchanged on a PC.
+// Physical memory (shmem_map) is backed by a sparse memfd.
+
+#ifdef FPGA_SIM
+
+void fpga_sim_gpo(uint32_t gpo);
+uint32_t fpga_sim_gpi();
+
+int fpga_sim_memfd();
+
+// MiSTer --bench file|ide|cd|mra|neogeo|shmem|msu|screenshot ..., see usage in fpga_sim.cpp.
+int fpga_sim_bench(int argc, char *argv[]);
+
+#endif
+
+#endif
@@ -14,12 +14,17 @@
 
 #include "support/x86/x86.h"
 #include "support/vhd/vhdcfg.h"
+#include "support/vhd/vhddyn.h"
 #include "support/minimig/minimig_hdd.h"
 #include "support/minimig/minimig_config.h"
 #include "spi.h"
 #include "user_io.h"
 #include "file_io.h"
 #include "hardware.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "disk_overlay.h"
+#include "cfg.h"
 #include "ide.h"
 
 #if 0
@@ -90,6 +95,140 @@ uint16_t ide_check()
 	return res;
 }
 
+// Data reads of plain image files go through two windows of ide_io_max_size
+// sectors per port. While one block is sent to the core the next one is
+// read in the background, and sequential streams are read ahead across
+// commands. Zipped images and the fake RDB use the old synchronous path.
+#define IDE_SPIN_CHECKS 64 // then let other tasks run while the core takes the data
+
+struct ide_window_t
+{
+	drive_t *drive;
+	uint32_t gen;
+	uint32_t lba;
+	int len; // bytes read, <= 0 on error
+	uint32_t used;
+	offload_handle_t h;
+	uint8_t buf[ide_io_max_size * 512];
+};
+
+struct ide_pipe_t
+{
+	ide_window_t win[2];
+	uint32_t clock;
+	drive_t *last_drive;
+	uint32_t last_lba; // end of the previous read, for stream detection
+};
+
+static ide_pipe_t ide_pipe[2] = {};
+
+static void ide_win_drop(ide_config *ide)
+{
+	ide_pipe_t *p = &ide_pipe[ide - ide_inst];
+	for (auto &w : p->win)
+	{
+		offload_wait(w.h);
+		w.drive = 0;
+	}
+	p->last_drive = 0;
+}
+
+static inline uint32_t ide_win_gen(drive_t *drive)
+{
+	return drive->ovl ? disk_overlay_generation(drive->ovl) : 0;
+}
+
+static ide_window_t *ide_win_find(ide_pipe_t *p, drive_t *drive, uint32_t lba, uint32_t cnt)
+{
+	for (auto &w : p->win)
+	{
+		if (w.drive == drive && w.gen == ide_win_gen(drive) && lba >= w.lba && lba + cnt <= w.lba + ide_io_max_size) return &w;
+	}
+	return 0;
+}
+
+static void ide_win_fill(ide_pipe_t *p, ide_window_t *w, drive_t *drive, uint32_t lba, bool async)
+{
+	offload_wait(w->h);
+	w->drive = drive;
+	w->gen = ide_win_gen(drive);
+	w->lba = lba;
+	w->len = 0;
+	w->used = ++p->clock;
+
+	int fd = fileno(drive->f->filp);
+	disk_overlay_t *ovl = drive->ovl;
+	vhd_t *vhd = drive->vhd;
+	__off64_t pos = (__off64_t)(lba - drive->offset) << 9;
+	auto work = [w, fd, ovl, vhd, pos]
+	{
+		ssize_t ret = vhd ? vhd_read(vhd, pos, w->buf, sizeof(w->buf)) :
+			ovl ? disk_overlay_read(ovl, pos, w->buf, sizeof(w->buf)) :
+			pread(fd, w->buf, sizeof(w->buf), pos);
+		if (ret > 0 && ret < (ssize_t)sizeof(w->buf)) memset(w->buf + ret, 0, sizeof(w->buf) - ret);
+		w->len = ret;
+	};
+
+	if (async) w->h = offload_add_work(work, OFFLOAD_HIGH);
+	else
+	{
+		w->h = offload_handle_t();
+		work();
+	}
+}
+
+static uint8_t *ide_win_read(ide_config *ide, drive_t *drive, uint32_t lba, uint32_t cnt)
+{
+	ide_pipe_t *p = &ide_pipe[ide - ide_inst];
+	ide_window_t *w = ide_win_find(p, drive, lba, cnt);
+	if (w)
+	{
+		offload_wait(w->h);
+		w->used = ++p->clock;
+	}
+	else
+	{
+		w = &p->win[(p->win[0].used > p->win[1].used) ? 1 : 0];
+		ide_win_fill(p, w, drive, lba, false);
+	}
+
+	uint32_t ofs = (lba - w->lba) * 512;
+	return (w->len > (int)ofs) ? w->buf + ofs : 0;
+}
+
+// Starts reading the block at lba into the window not holding cur.
+static void ide_win_prefetch(ide_config *ide, drive_t *drive, const uint8_t *cur, uint32_t lba, uint32_t cnt)
+{
+	if (lba < drive->offset || !drive->f || !drive->f->filp) return;
+	if (((__off64_t)(lba - drive->offset) << 9) >= drive->f->size) return;
+
+	ide_pipe_t *p = &ide_pipe[ide - ide_inst];
+	if (ide_win_find(p, drive, lba, cnt)) return;
+
+	ide_window_t *w = &p->win[(cur >= p->win[0].buf && cur < p->win[0].buf + sizeof(p->win[0].buf)) ? 1 : 0];
+	ide_win_fill(p, w, drive, lba, true);
+}
+
+// Set while a command is suspended in ide_wait_req() and other tasks run.
+static int ide_yielded = 0;
+
+static uint16_t ide_wait_req(ide_config *ide)
+{
+	uint16_t req;
+	for (int i = 0; !(req = (ide_check() >> ide->bitoff) & 7); i++)
+	{
+#ifdef USE_SCHEDULER
+		if (i >= IDE_SPIN_CHECKS && scheduler_in_task())
+		{
+			ide_yielded++;
+			scheduler_yield();
+			ide_yielded--;
+		}
+#endif
+	}
+	return req;
+}
+
 int ide_img_mount(fileTYPE *f, const char *name, int rw)
 {
 	FileClose(f);
@@ -417,9 +556,15 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 
 	drive_t *drive = &ide_inst[port].drive[drv];
 
+	ide_win_drop(&ide_inst[port]);
 	ide_inst[port].base = port ? IDE1_BASE : IDE0_BASE;
 	ide_inst[port].drive[drv].drvnum = drvnum;
 
+	disk_overlay_close(drive->ovl);
+	drive->ovl = 0;
+	vhd_close(drive->vhd);
+	drive->vhd = 0;
+
 	if (drive->f && (f != drive->f) && drive->f->opened())
 	{
 		FileClose(drive->f);
@@ -456,6 +601,18 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 	ide_reg_set(&ide_inst[port], 6, ((drive->present || drive->placeholder) ? 9 : 8) << (drv * 4));
 	ide_reg_set(&ide_inst[port], 6, 0x200);
 
+	// dynamic VHDs are translated, other hard disks run on top of a
+	// copy-on-write overlay if there is one
+	if (drive->present && !drive->cd && drive->f->filp)
+	{
+		const char *path = getFullPath(drive->f->path);
+		int len = strlen(path);
+		if (len > 4 && !strcasecmp(path + len - 4, ".vhd")) drive->vhd = vhd_open(path, (drive->f->mode & O_ACCMODE) == O_RDWR);
+
+		if (drive->vhd) drive->f->size = vhd_size(drive->vhd);
+		else drive->ovl = disk_overlay_open(path, cfg.disk_overlay);
+	}
+
 	if(drive->f)
 	{
 		if (!drive->chd_f) drive->total_sectors = (drive->f->size / 512);
@@ -471,7 +628,21 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 		{
 			if (!drive->chd_f) 
 			{
-				if (parse_vhd_config(drive)) ide_set_geometry(drive, sectors, heads);
+				if (parse_vhd_config(drive))
+				{
+					uint16_t c;
+					uint8_t h, s;
+					if (drive->vhd)
+					{
+						vhd_geometry(drive->vhd, &c, &h, &s);
+						if (h && s)
+						{
+							heads = h;
+							sectors = s;
+						}
+					}
+					ide_set_geometry(drive, sectors, heads);
+				}
 				else ide_set_geometry(drive, drive->spt, drive->heads);
 			}
 			else ide_set_geometry(drive, sectors, heads);
@@ -765,17 +936,41 @@ inline int readhdd(drive_t *drive, uint32_t lba, int cnt)
 	}
 }
 
+// Returns the block data, zeros once a read has failed.
+static uint8_t *ide_read_block(ide_config *ide, drive_t *drive, uint32_t lba, uint32_t cnt)
+{
+	if (!ide->null)
+	{
+		if (lba < drive->offset || !drive->f->filp)
+		{
+			ide->null = (readhdd(drive, lba, cnt) <= 0);
+			if (!ide->null) return ide_buf;
+		}
+		else
+		{
+			uint8_t *buf = ide_win_read(ide, drive, lba, cnt);
+			if (buf) return buf;
+			ide->null = 1;
+		}
+	}
+
+	memset(ide_buf, 0, cnt * 512);
+	return ide_buf;
+}
+
 static void process_read(ide_config *ide, int multi)
 {
 	uint32_t lba = get_lba(ide);
 	uint16_t ide_req = 0;
+	drive_t *drive = &ide->drive[ide->regs.drv];
+	ide_pipe_t *p = &ide_pipe[ide - ide_inst];
+	bool stream = (p->last_drive == drive && p->last_lba == lba);
 
 	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
 
 	uint32_t cnt = multi ? get_cnt(ide) : 1;
-	ide->null = !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset));
-	if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-	if (ide->null) memset(ide_buf, 0, cnt * 512);
+	ide->null = drive->f->filp ? 0 : !FileSeekLBA(drive->f, (lba <= drive->offset) ? 0 : (lba - drive->offset));
+	uint8_t *buf = ide_read_block(ide, drive, lba, cnt);
 
 	while (1)
 	{
@@ -783,6 +978,10 @@ static void process_read(ide_config *ide, int multi)
 		ide->regs.sector_count -= cnt;
 		put_lba(ide, lba);
 
+		// next block (or the next command of a stream) is read while this one is sent
+		if (ide->regs.sector_count) ide_win_prefetch(ide, drive, buf, lba, multi ? get_cnt(ide) : 1);
+		else if (stream) ide_win_prefetch(ide, drive, buf, lba, multi ? drive->spb : 1);
+
 		ide->regs.io_size = cnt;
 		ide->regs.status = ATA_STATUS_RDP | ATA_STATUS_RDY | ATA_STATUS_DRQ | ATA_STATUS_IRQ;
 		if (!ide->regs.sector_count) ide->regs.status |= ATA_STATUS_END;
@@ -790,11 +989,11 @@ static void process_read(ide_config *ide, int multi)
 		if (ide->regs.io_fast)
 		{
 			ide_set_regs(ide);
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(buf, cnt * 256);
 		}
 		else
 		{
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(buf, cnt * 256);
 			ide->regs.status &= ~ATA_STATUS_RDP;
 			ide_set_regs(ide);
 		}
@@ -806,20 +1005,24 @@ static void process_read(ide_config *ide, int multi)
 			break;
 		}
 
-		cnt = multi ? get_cnt(ide) : 1;
-		if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-		if (ide->null) memset(ide_buf, 0, cnt * 512);
+		ide_req = ide_wait_req(ide);
 
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+		// image was changed while other tasks were running
+		if (ide->state == IDE_STATE_RESET) break;
 
 		if (ide_req != 5)
 		{
 			ide->state = IDE_STATE_IDLE;
 			break;
 		}
+
+		cnt = multi ? get_cnt(ide) : 1;
+		buf = ide_read_block(ide, drive, lba, cnt);
 	}
 
+	p->last_drive = drive;
+	p->last_lba = lba;
+
 	dbg2_printf("  finish\n");
 }
 
@@ -829,6 +1032,7 @@ static void process_write(ide_config *ide, int multi)
 	uint32_t cnt = 1;
 	uint16_t ide_req;
 
+	ide_win_drop(ide);
 	ide->null = (ide->regs.cmd != 0xFA) ? !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset)) : 1;
 	uint8_t irq = 0;
 
@@ -841,8 +1045,8 @@ static void process_write(ide_config *ide, int multi)
 		ide->regs.io_size = cnt;
 		ide_set_regs(ide);
 
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+		ide_req = ide_wait_req(ide);
+		if (ide->state == IDE_STATE_RESET) break;
 
 		if (ide_req != 5)
 		{
@@ -864,7 +1068,13 @@ static void process_write(ide_config *ide, int multi)
 		}
 		else
 		{
-			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAdv(ide->drive[ide->regs.drv].f, ide_buf, cnt * 512, -1) <= 0);
+			drive_t *drive = &ide->drive[ide->regs.drv];
+			if (!ide->null && lba >= drive->offset)
+			{
+				if (drive->vhd) ide->null = (vhd_write(drive->vhd, (__off64_t)(lba - drive->offset) << 9, ide_buf, cnt * 512) <= 0);
+				else if (drive->ovl) ide->null = (disk_overlay_write(drive->ovl, (__off64_t)(lba - drive->offset) << 9, ide_buf, cnt * 512) <= 0);
+				else ide->null = (FileWriteAdv(drive->f, ide_buf, cnt * 512, -1) <= 0);
+			}
 			lba += cnt;
 			ide->regs.sector_count -= cnt;
 			put_lba(ide, lba);
@@ -963,6 +1173,10 @@ static int handle_hdd(ide_config *ide)
 
 void ide_io(int num, int req)
 {
+	// Another task polling the core while a command is suspended, the
+	// request is still pending when the command's task gets back to it.
+	if (ide_yielded) return;
+
 	ide_config *ide = &ide_inst[num];
 
 	//printf("req: %d, disk: %d\n", req, num);
@@ -1100,9 +1314,9 @@ int ide_open(uint8_t unit, const char* filename)
 		{
 			printf("file: \"%s\": ", hdd_file[unit].name);
 			guess_geometry(&hdd_file[unit], &chs, is_minimig() && !strcasecmp(".hdf", filename + strlen(filename) - 4));
-			printf("size: %llu (%llu MB)\n", hdd_file[unit].size, hdd_file[unit].size >> 20);
+			printf("size: %llu (%llu MB)\n", (unsigned long long)hdd_file[unit].size, (unsigned long long)(hdd_file[unit].size >> 20));
 			printf("CHS: %u/%u/%u", chs.cylinders, chs.heads, chs.sectors);
-			printf(" (%llu MB), ", ((((uint64_t)chs.cylinders) * chs.heads * chs.sectors) >> 11));
+			printf(" (%llu MB), ", (unsigned long long)((((uint64_t)chs.cylinders) * chs.heads * chs.sectors) >> 11));
 			printf("Offset: %d\n", chs.offset);
 
 			int present = 0;
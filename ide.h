@@ -69,9 +69,14 @@ struct track_t
 	int      chd_offset;
 };
 
+struct disk_overlay_t;
+struct vhd_t;
+
 struct drive_t
 {
 	fileTYPE *f;
+	disk_overlay_t *ovl;
+	vhd_t *vhd;
 
 	uint8_t  present;
 	uint8_t  drvnum;
@@ -106,8 +111,6 @@ struct drive_t
 	uint8_t  atapi_ascq_code;
 
 	chd_file *chd_f;
-	int      chd_hunknum;
-	uint8_t	 *chd_hunkbuf;
 	uint32_t  chd_total_size;
 	uint32_t  chd_last_partial_lba;
 
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/sysinfo.h>
 #include <dirent.h>
 #include <errno.h>
@@ -30,8 +32,15 @@
 #include "joymapping.h"
 #include "support.h"
 #include "profiling.h"
+#include "latency.h"
+#include "input_latency.h"
 #include "gamecontroller_db.h"
 #include "str_util.h"
+#include "offload.h"
+#include "block_cache.h"
+#include "disk_overlay.h"
+#include "spi.h"
+#include "scheduler.h"
 
 #define NUMDEV 30
 #define NUMPLAYERS 6
@@ -39,7 +48,96 @@
 
 char joy_bnames[NUMBUTTONS][32] = {};
 int  joy_bcount = 0;
-static struct pollfd pool[NUMDEV + 3];
+static struct pollfd pool[NUMDEV + 4];
+
+#define POOL_WATCH  (NUMDEV)
+#define POOL_CMD    (NUMDEV + 1)
+#define POOL_LED    (NUMDEV + 2)
+#define POOL_TIMER  (NUMDEV + 3)
+#define POOL_SIZE   (NUMDEV + 4)
+
+#define RUMBLE_POLL 10
+
+// All fds of pool are in one epoll set. Devices are edge triggered and
+// non-blocking: a device stays in pool_ready until a read comes back
+// empty, so events are still taken one per device and round.
+static int epfd = -1;
+static uint64_t pool_ready = 0;
+static unsigned long timer_armed = 0;
+
+static void pool_add(int idx, uint32_t events)
+{
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.u32 = idx;
+	if (pool[idx].fd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, pool[idx].fd, &ev) < 0) printf("ERR: epoll_ctl(%d)\n", idx);
+}
+
+static int pool_read(int idx, void *buf, size_t len)
+{
+	int ret = read(pool[idx].fd, buf, len);
+	if (ret <= 0) pool_ready &= ~(1ULL << idx);
+	return ret;
+}
+
+// Wakes the input loop at the given GetTimer() deadline (autofire, mouse
+// emulation, touch release, rumble). The timers themselves are still
+// checked with CheckTimer().
+static void input_timer_arm(unsigned long deadline)
+{
+	if (pool[POOL_TIMER].fd < 0 || !deadline) return;
+	if (timer_armed && (long)(deadline - timer_armed) >= 0) return;
+
+	long ms = (long)(deadline - GetTimer(0));
+	struct itimerspec its = {};
+	its.it_value.tv_sec = (ms > 0) ? ms / 1000 : 0;
+	its.it_value.tv_nsec = (ms > 0) ? (ms % 1000) * 1000000 : 1;
+	timerfd_settime(pool[POOL_TIMER].fd, 0, &its, NULL);
+	timer_armed = deadline;
+}
+
+// Returns 0 if nothing but the timer happened within timeout.
+static int pool_wait(int timeout)
+{
+	struct epoll_event evs[POOL_SIZE];
+	int n = epoll_wait(epfd, evs, POOL_SIZE, pool_ready ? 0 : timeout);
+	if (n < 0) return -1;
+
+	int ret = 0;
+	for (int i = 0; i < POOL_SIZE; i++) pool[i].revents = 0;
+	for (int i = 0; i < n; i++)
+	{
+		uint32_t idx = evs[i].data.u32;
+		if (idx < NUMDEV)
+		{
+			pool_ready |= 1ULL << idx;
+		}
+		else if (idx == POOL_TIMER)
+		{
+			uint64_t exp;
+			read(pool[POOL_TIMER].fd, &exp, sizeof(exp));
+			timer_armed = 0;
+		}
+		else
+		{
+			// EPOLLIN/EPOLLPRI match POLLIN/POLLPRI
+			pool[idx].revents = evs[i].events;
+			ret = 1;
+		}
+	}
+
+	for (int i = 0; i < NUMDEV; i++) if (pool_ready & (1ULL << i)) pool[i].revents = POLLIN;
+	return (ret || pool_ready) ? 1 : 0;
+}
+
+int input_pending()
+{
+	if (pool_ready) return 1;
+	if (epfd < 0) return 0;
+
+	struct pollfd pfd = { epfd, POLLIN, 0 };
+	return poll(&pfd, 1, 0) > 0;
+}
 
 static int ev2amiga[] =
 {
@@ -1219,6 +1317,93 @@ static devInput player_pdsp[NUMPLAYERS] = {};
 
 #define BTN_NUM (sizeof(devInput::map) / sizeof(devInput::map[0]))
 
+// Compiled from map[]/mmap[] of a device on first use after connect or
+// remap, so input_cb() resolves a code with one lookup instead of scanning
+// map[] per event. Event codes never exceed the emulated axis keys.
+#define MAP_LUT_CODES (KEY_EMU + 0x200)
+#define MAP_LUT_SLOTS (BTN_NUM * 2 + 1)
+
+typedef struct
+{
+	uint8_t  valid;
+	uint8_t  idx[MAP_LUT_CODES];  // slot of the code, 0 if unmapped
+	uint64_t mask[MAP_LUT_SLOTS]; // bit i: map[i] low half, bit i+32: high half
+	uint8_t  stick[ABS_CNT];      // 1 + stick * 2 + axis, 0 if none
+} map_lut_t;
+
+static map_lut_t map_lut[NUMDEV] = {};
+
+static void map_lut_build(int dev)
+{
+	map_lut_t *lut = &map_lut[dev];
+	memset(lut->idx, 0, sizeof(lut->idx));
+	memset(lut->stick, 0, sizeof(lut->stick));
+
+	int slots = 1;
+	for (uint i = 0; i < BTN_NUM; i++)
+	{
+		for (int hi = 0; hi < 2; hi++)
+		{
+			uint16_t code = hi ? (input[dev].map[i] >> 16) : (input[dev].map[i] & 0xFFFF);
+			if (!code || code >= MAP_LUT_CODES) continue;
+
+			if (!lut->idx[code])
+			{
+				lut->idx[code] = slots;
+				lut->mask[slots++] = 0;
+			}
+			lut->mask[lut->idx[code]] |= (uint64_t)1 << (i + hi * 32);
+		}
+	}
+
+	// low half wins if both halves of an entry hold the code
+	for (int i = 1; i < slots; i++) lut->mask[i] &= ~((lut->mask[i] & 0xFFFFFFFF) << 32);
+
+	// reverse order, so left stick X wins as in the old compare chain
+	int axis[4] = { input[dev].stick_l[0], input[dev].stick_l[1], input[dev].stick_r[0], input[dev].stick_r[1] };
+	for (int n = 3; n >= 0; n--)
+	{
+		uint16_t code = (uint16_t)input[dev].mmap[axis[n]];
+		if (axis[n] && code < ABS_CNT) lut->stick[code] = n + 1;
+	}
+
+	lut->valid = 1;
+}
+
+static inline uint64_t map_lut_mask(int dev, uint16_t code)
+{
+	if (!map_lut[dev].valid) map_lut_build(dev);
+	return (code < MAP_LUT_CODES) ? map_lut[dev].mask[map_lut[dev].idx[code]] : 0;
+}
+
+static void map_lut_invalidate()
+{
+	for (int i = 0; i < NUMDEV; i++) map_lut[i].valid = 0;
+}
+
+// Axis ranges don't change while a device is open, EVIOCGABS is issued
+// once per axis instead of once per event.
+static struct
+{
+	uint64_t valid;
+	input_absinfo info[ABS_CNT];
+} absinfo_cache[NUMDEV] = {};
+
+static int absinfo_get(int dev, int fd, uint16_t code, input_absinfo *absinfo)
+{
+	if (code >= ABS_CNT) return ioctl(fd, EVIOCGABS(code), absinfo);
+
+	uint64_t bit = (uint64_t)1 << code;
+	if (!(absinfo_cache[dev].valid & bit))
+	{
+		if (ioctl(fd, EVIOCGABS(code), &absinfo_cache[dev].info[code]) < 0) return -1;
+		absinfo_cache[dev].valid |= bit;
+	}
+
+	*absinfo = absinfo_cache[dev].info[code];
+	return 0;
+}
+
 int mfd = -1;
 int mwd = -1;
 
@@ -1726,6 +1911,7 @@ static void uinp_send_key(uint16_t key, int press)
 		if (!uinp_ev.value && press)
 		{
 			uinp_repeat = GetTimer(REPEATDELAY);
+			input_timer_arm(uinp_repeat);
 		}
 
 		memset(&uinp_ev, 0, sizeof(uinp_ev));
@@ -1753,6 +1939,7 @@ static void uinp_check_key()
 			if (uinp_ev.value && CheckTimer(uinp_repeat))
 			{
 				uinp_repeat = GetTimer(REPEATRATE);
+				input_timer_arm(uinp_repeat);
 				uinp_send_key(uinp_ev.code, 2);
 			}
 		}
@@ -1792,11 +1979,6 @@ static inline void joy_clamp(int* value, const int min, const int max)
 	}
 }
 
-static inline float boxradf(const float angle)
-{
-	return 1.0f / fmaxf(fabsf(sinf(angle)), fabsf(cosf(angle)));
-}
-
 static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int stick) {
 	// Don't be fancy with such a small deadzone.
 	if (dev->deadzone <= 2) 
@@ -1813,8 +1995,11 @@ static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int st
 		return;
 	}
 
-	const float angle = atan2f(*y, *x);
-	const float box_radius = boxradf(angle);
+	// Direction and box radius (1 / max(|cos|, |sin|)) come straight
+	// from the coordinates, no trigonometry per event.
+	const float dir_x = *x / radius;
+	const float dir_y = *y / radius;
+	const float box_radius = radius / (float)((abs(*x) > abs(*y)) ? abs(*x) : abs(*y));
 
 	/* A measure of how "cardinal" the angle is,
 	   i.e closeness to [0, 90, 180, 270] degrees (0.0 - 1.0). */
@@ -1832,8 +2017,8 @@ static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int st
 	   The whole point of this function is to subtract some magnitude, not add. */
 	if (adjusted_radius > radius) return;
 
-	*x = nearbyintf(adjusted_radius * cosf(angle));
-	*y = nearbyintf(adjusted_radius * sinf(angle));
+	*x = nearbyintf(adjusted_radius * dir_x);
+	*y = nearbyintf(adjusted_radius * dir_y);
 
 	// Just to be sure.
 	const int min_range = is_psx() ? -128 : -127;
@@ -2408,7 +2593,7 @@ static void setup_deadzone(struct input_event* ev, int dev)
 	char cfg_format[32];
 	char cfg_uid[sizeof(*cfg.controller_deadzone)];
 
-	snprintf(cfg_format, sizeof(cfg_format), "%%%u[^ \t,]%%*[ \t,]%%u%%n", (size_t)(sizeof(cfg_uid) - 1));
+	snprintf(cfg_format, sizeof(cfg_format), "%%%u[^ \t,]%%*[ \t,]%%u%%n", (unsigned)(sizeof(cfg_uid) - 1));
 
 	const char* dev_uid = get_unique_mapping(dev, 1);
 
@@ -2418,26 +2603,26 @@ static void setup_deadzone(struct input_event* ev, int dev)
 		if (!cfg_line || !strlen(cfg_line)) break;
 
 		uint32_t cfg_vidpid, cfg_deadzone;
-		size_t scan_pos;
-		char vp;
+		int scan_pos;
+		char vp[2];
 
 		if ((sscanf(cfg_line, cfg_format, cfg_uid, &cfg_deadzone, &scan_pos) < 2) ||
-			(scan_pos != strlen(cfg_line))) continue;
+			((size_t)scan_pos != strlen(cfg_line))) continue;
 
 		if ((
 			sscanf(cfg_uid, "0%*[Xx]%08x%n", &cfg_vidpid, &scan_pos) ||
 			sscanf(cfg_uid, "%08x%n", &cfg_vidpid, &scan_pos)) &&
-			(scan_pos == strlen(cfg_uid)))
+			((size_t)scan_pos == strlen(cfg_uid)))
 		{
 			const uint32_t vidpid = (input[dev].vid << 16) | input[dev].pid;
 			if (vidpid != cfg_vidpid) continue;
 		}
 		else if ((
-			(sscanf(cfg_uid, "%[VvPp]%*[Ii]%*[Dd]:0%*[Xx]%04x%n", &vp, &cfg_vidpid, &scan_pos) == 2) ||
-			(sscanf(cfg_uid, "%[VvPp]%*[Ii]%*[Dd]:%04x%n", &vp, &cfg_vidpid, &scan_pos) == 2)) &&
-			(scan_pos == strlen(cfg_uid)))
+			(sscanf(cfg_uid, "%1[VvPp]%*[Ii]%*[Dd]:0%*[Xx]%04x%n", vp, &cfg_vidpid, &scan_pos) == 2) ||
+			(sscanf(cfg_uid, "%1[VvPp]%*[Ii]%*[Dd]:%04x%n", vp, &cfg_vidpid, &scan_pos) == 2)) &&
+			((size_t)scan_pos == strlen(cfg_uid)))
 		{
-			if (vp == 'V' || vp == 'v')
+			if (vp[0] == 'V' || vp[0] == 'v')
 			{
 				if (input[dev].vid != cfg_vidpid) continue;
 			}
@@ -2612,6 +2797,7 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 			}
 		}
 		input[dev].has_mmap++;
+		map_lut[dev].valid = 0;
 	}
 
 	if (!input[dev].has_map)
@@ -2639,6 +2825,7 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 			input[dev].has_map++;
 		}
 		input[dev].has_map++;
+		map_lut[dev].valid = 0;
 	}
 
 	if (!input[dev].has_jkmap)
@@ -2802,6 +2989,9 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 		int idx = 0;
 		osdbtn = 0;
 
+		// any of the maps may change below
+		map_lut_invalidate();
+
 		if (is_menu())
 		{
 			spi_uio_cmd(UIO_KEYBOARD); //ping the Menu core to wakeup
@@ -3299,16 +3489,17 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 						input[dev].has_map = 1;
 					}
 					
-					for (uint i = 0; i < BTN_NUM; i++)
+					uint64_t btns = map_lut_mask(dev, ev->code);
+					uint32_t entries = (uint32_t)btns | (uint32_t)(btns >> 32);
+					while (entries)
 					{
-						uint64_t mask = 0;
-						if (ev->code == (input[dev].map[i] & 0xFFFF)) mask = (uint64_t)1 << i;
-						else if (ev->code == (input[dev].map[i] >> 16)) mask = (uint64_t)1 << (i + 32); // 1 is uint32_t. i spent hours realizing this.
-						if (mask) {
-							if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
-							if (ev->value <=1) joy_digital(input[dev].num, mask, origcode, ev->value, i, (ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 1] || ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 2]));
-							// support 2 simultaneous functions for 1 button if defined in 2 sets. No return.
-						}
+						uint i = __builtin_ctz(entries);
+						entries &= entries - 1;
+
+						uint64_t mask = (btns & ((uint64_t)1 << i)) ? (uint64_t)1 << i : (uint64_t)1 << (i + 32); // 1 is uint32_t. i spent hours realizing this.
+						if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
+						if (ev->value <=1) joy_digital(input[dev].num, mask, origcode, ev->value, i, (ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 1] || ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 2]));
+						// support 2 simultaneous functions for 1 button if defined in 2 sets. No return.
 					}
 
 					if (ev->code == input[dev].mmap[SYS_MS_BTN_EMU] && (ev->value <= 1) && ((!(mouse_emu & 1)) ^ (!ev->value)))
@@ -3353,17 +3544,13 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 
 				if(!user_io_osd_is_visible() && ((user_io_get_kbdemu() == EMU_JOY0) || (user_io_get_kbdemu() == EMU_JOY1)) && !video_fb_state())
 				{
-					if (!kbd_toggle)
+					uint32_t btns = (uint32_t)map_lut_mask(dev, ev->code);
+					if (!kbd_toggle && btns)
 					{
-						for (uint i = 0; i < BTN_NUM; i++)
-						{
-							if (ev->code == (uint16_t)input[dev].map[i])
-							{
-								if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
-								if (ev->value <= 1) joy_digital((user_io_get_kbdemu() == EMU_JOY0) ? 1 : 2, 1 << i, origcode, ev->value, i);
-								return;
-							}
-						}
+						uint i = __builtin_ctz(btns);
+						if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
+						if (ev->value <= 1) joy_digital((user_io_get_kbdemu() == EMU_JOY0) ? 1 : 2, 1 << i, origcode, ev->value, i);
+						return;
 					}
 
 					if (ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL])
@@ -3541,22 +3728,10 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 					else
 					{
 						int offset = (value < -1 || value > 1) ? value : 0;
-						if (input[dev].stick_l[0] && ev->code == (uint16_t)input[dev].mmap[input[dev].stick_l[0]])
-						{
-							joy_analog(dev, 0, offset, 0);
-						}
-						else if (input[dev].stick_l[1] && ev->code == (uint16_t)input[dev].mmap[input[dev].stick_l[1]])
-						{
-							joy_analog(dev, 1, offset, 0);
-						}
-						else if (input[dev].stick_r[0] && ev->code == (uint16_t)input[dev].mmap[input[dev].stick_r[0]])
-						{
-							joy_analog(dev, 0, offset, 1);
-						}
-						else if (input[dev].stick_r[1] && ev->code == (uint16_t)input[dev].mmap[input[dev].stick_r[1]])
-						{
-							joy_analog(dev, 1, offset, 1);
-						}
+						if (!map_lut[dev].valid) map_lut_build(dev);
+
+						int stick = (ev->code < ABS_CNT) ? map_lut[dev].stick[ev->code] : 0;
+						if (stick--) joy_analog(dev, stick & 1, offset, stick >> 1);
 					}
 				}
 			}
@@ -3963,6 +4138,7 @@ static void touchscreen_proc(int dev, input_event *ev)
 				{
 					mice_btn |= 1;
 					touch_rel = GetTimer(100);
+					input_timer_arm(touch_rel);
 				}
 			}
 
@@ -4673,18 +4849,29 @@ int input_test(int getchar)
 		input_uinp_setup();
 		memset(pool, -1, sizeof(pool));
 
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0) printf("ERR: epoll_create\n");
+
 		signal(SIGINT, INThandler);
-		pool[NUMDEV].fd = set_watch();
-		pool[NUMDEV].events = POLLIN;
+		pool[POOL_WATCH].fd = set_watch();
+		pool[POOL_WATCH].events = POLLIN;
+		pool_add(POOL_WATCH, EPOLLIN);
 
 		unlink(CMD_FIFO);
 		mkfifo(CMD_FIFO, 0666);
 
-		pool[NUMDEV+1].fd = open(CMD_FIFO, O_RDWR | O_NONBLOCK | O_CLOEXEC);
-		pool[NUMDEV+1].events = POLLIN;
+		pool[POOL_CMD].fd = open(CMD_FIFO, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		pool[POOL_CMD].events = POLLIN;
+		pool_add(POOL_CMD, EPOLLIN);
 
-		pool[NUMDEV + 2].fd = open(LED_MONITOR, O_RDONLY | O_CLOEXEC);
-		pool[NUMDEV + 2].events = POLLPRI;
+		pool[POOL_LED].fd = open(LED_MONITOR, O_RDONLY | O_CLOEXEC);
+		pool[POOL_LED].events = POLLPRI;
+		pool_add(POOL_LED, EPOLLPRI);
+
+		// same clock as GetTimer()
+		pool[POOL_TIMER].fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+		pool[POOL_TIMER].events = POLLIN;
+		pool_add(POOL_TIMER, EPOLLIN);
 
 		state++;
 	}
@@ -4698,8 +4885,11 @@ int input_test(int getchar)
 			pool[i].fd = -1;
 			pool[i].events = 0;
 		}
+		pool_ready = 0;
 
 		memset(input, 0, sizeof(input));
+		memset(map_lut, 0, sizeof(map_lut));
+		memset(absinfo_cache, 0, sizeof(absinfo_cache));
 
 		int n = 0;
 		DIR *d = opendir("/dev/input");
@@ -5060,6 +5250,19 @@ int input_test(int getchar)
 			}
 			closedir(d);
 
+			// closed fds leave the epoll set by themselves
+			for (int i = 0; i < NUMDEV; i++)
+			{
+				if (pool[i].fd < 0) continue;
+				fcntl(pool[i].fd, F_SETFL, fcntl(pool[i].fd, F_GETFL) | O_NONBLOCK);
+				pool_add(i, EPOLLIN | EPOLLET);
+
+				// event timestamps in the clock input_latency measures with
+				int clk = CLOCK_MONOTONIC;
+				ioctl(pool[i].fd, EVIOCSCLOCKID, &clk);
+				input_latency_device(i, input[i].vid, input[i].pid);
+			}
+
 			mergedevs();
 			check_joycon();
 			openfire_signal();
@@ -5111,8 +5314,11 @@ int input_test(int getchar)
 
 		while (1)
 		{
-			if (cfg.rumble && !is_menu())
+			static unsigned long rumble_timer = 0;
+			if (cfg.rumble && !is_menu() && (!rumble_timer || CheckTimer(rumble_timer)))
 			{
+				rumble_timer = GetTimer(RUMBLE_POLL);
+				input_timer_arm(rumble_timer);
 				for (int i = 0; i < NUMDEV; i++)
 				{
 					if (!input[i].has_rumble) continue;
@@ -5125,16 +5331,17 @@ int input_test(int getchar)
 				}
 			}
 
-			int return_value = poll(pool, NUMDEV + 3, timeout);
+			int return_value = pool_wait(timeout);
 			if (!return_value) break;
 
 			if (return_value < 0)
 			{
-				printf("ERR: poll\n");
+				if (errno == EINTR) break;
+				printf("ERR: epoll_wait\n");
 				break;
 			}
 
-			if ((pool[NUMDEV].revents & POLLIN) && check_devs())
+			if ((pool[POOL_WATCH].revents & POLLIN) && check_devs())
 			{
 				printf("Close all devices.\n");
 				for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
@@ -5157,8 +5364,9 @@ int input_test(int getchar)
 					{
 
 						memset(&ev, 0, sizeof(ev));
-						if (read(pool[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+						if (pool_read(i, &ev, sizeof(ev)) == sizeof(ev))
 						{
+							input_latency_event(i, &ev);
 							if (getchar)
 							{
 								if (ev.type == EV_KEY && ev.value >= 1)
@@ -5225,7 +5433,7 @@ int input_test(int getchar)
 										continue;
 									}
 
-									if (ioctl(pool[i].fd, EVIOCGABS(ev.code), &absinfo) < 0) memset(&absinfo, 0, sizeof(absinfo));
+									if (absinfo_get(i, pool[i].fd, ev.code, &absinfo) < 0) memset(&absinfo, 0, sizeof(absinfo));
 									else
 									{
 										//DS4 specific: touchpad as lightgun
@@ -5571,7 +5779,11 @@ int input_test(int getchar)
 									dev = i;
 								}
 
-								if (!noabs) input_cb(&ev, &absinfo, i);
+								if (!noabs)
+								{
+									input_latency_trace(i, &ev, (ev.type == EV_ABS) ? &absinfo : 0);
+									input_cb(&ev, &absinfo, i);
+								}
 
 								// simulate digital directions from analog
 								if (ev.type == EV_ABS && !(mapping && mapping_type <= 1 && mapping_button < -4) && !(ev.code <= 1 && input[dev].lightgun) && input[dev].quirk != QUIRK_PDSP && input[dev].quirk != QUIRK_MSSP)
@@ -5634,8 +5846,10 @@ int input_test(int getchar)
 					else
 					{
 						uint8_t data[4] = {};
-						if (read(pool[i].fd, data, sizeof(data)))
+						if (pool_read(i, data, sizeof(data)) > 0)
 						{
+							// no timestamps on mouse devices
+							input_latency_clear();
 							int edev = i;
 							int dev = i;
 							if (input[i].bind >= 0) edev = input[i].bind; // mouse to event
@@ -5716,11 +5930,12 @@ int input_test(int getchar)
 					}
 				}
 			}
+			input_latency_clear();
 
-			if ((pool[NUMDEV + 1].fd >= 0) && (pool[NUMDEV + 1].revents & POLLIN))
+			if ((pool[POOL_CMD].fd >= 0) && (pool[POOL_CMD].revents & POLLIN))
 			{
 				static char cmd[1024];
-				int len = read(pool[NUMDEV + 1].fd, cmd, sizeof(cmd) - 1);
+				int len = read(pool[POOL_CMD].fd, cmd, sizeof(cmd) - 1);
 				if (len)
 				{
 					if (cmd[len - 1] == '\n') cmd[len - 1] = 0;
@@ -5736,6 +5951,38 @@ int input_test(int getchar)
 					{
 						user_io_screenshot_cmd(cmd);
 					}
+					else if (!strcmp(cmd, "offload_stats"))
+					{
+						offload_print_stats();
+					}
+					else if (!strcmp(cmd, "spi_stats"))
+					{
+						spi_print_stats();
+					}
+					else if (!strcmp(cmd, "block_cache_stats"))
+					{
+						block_cache_print_stats();
+					}
+					else if (!strncmp(cmd, "overlay ", 8))
+					{
+						disk_overlay_cmd(cmd + 8);
+					}
+					else if (!strncmp(cmd, "trace ", 6))
+					{
+						profiling_trace_cmd(cmd + 6);
+					}
+					else if (!strncmp(cmd, "latency ", 8))
+					{
+						latency_cmd(cmd + 8);
+					}
+					else if (!strncmp(cmd, "input_latency ", 14))
+					{
+						input_latency_cmd(cmd + 14);
+					}
+					else if (!strcmp(cmd, "scheduler_stats"))
+					{
+						scheduler_print_stats();
+					}
 					else if (!strncmp(cmd, "volume ", 7))
 					{
 						if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
@@ -5745,14 +5992,14 @@ int input_test(int getchar)
 				}
 			}
 
-			if ((pool[NUMDEV + 2].fd >= 0) && (pool[NUMDEV + 2].revents & POLLPRI))
+			if ((pool[POOL_LED].fd >= 0) && (pool[POOL_LED].revents & POLLPRI))
 			{
 				static char status[16];
-				if (read(pool[NUMDEV + 2].fd, status, sizeof(status) - 1) && status[0] != '0')
+				if (read(pool[POOL_LED].fd, status, sizeof(status) - 1) && status[0] != '0')
 				{
 					if (sysled_is_enabled || video_fb_state()) DISKLED_ON;
 				}
-				lseek(pool[NUMDEV + 2].fd, 0, SEEK_SET);
+				lseek(pool[POOL_LED].fd, 0, SEEK_SET);
 			}
 		}
 
@@ -5784,9 +6031,24 @@ int input_test(int getchar)
 	return 0;
 }
 
+int input_inject(uint16_t vid, uint16_t pid, struct input_event *ev, struct input_absinfo *absinfo)
+{
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (pool[i].fd >= 0 && input[i].vid == vid && input[i].pid == pid)
+		{
+			input_cb(ev, absinfo, i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int input_poll(int getchar)
 {
 	PROFILE_FUNCTION();
+	LATENCY_FUNCTION();
 
 	static int af[NUMPLAYERS] = {};
 	static uint32_t time[NUMPLAYERS] = {};
@@ -5805,6 +6067,7 @@ int input_poll(int getchar)
 		if((prev_dx || mouse_emu_x || prev_dy || mouse_emu_y) && (!mouse_timer || CheckTimer(mouse_timer)))
 		{
 			mouse_timer = GetTimer(20);
+			input_timer_arm(mouse_timer);
 
 			int dx = mouse_emu_x;
 			int dy = mouse_emu_y;
@@ -5846,6 +6109,7 @@ int input_poll(int getchar)
 					af[i] = !af[i];
 					send = 1;
 				}
+				input_timer_arm(time[i]);
 			}
 
 			int newdir = ((((uint32_t)(joy[i]) | (uint32_t)(joy[i] >> 32)) & 0xF) != (((uint32_t)(joy_prev[i]) | (uint32_t)(joy_prev[i] >> 32)) & 0xF));
@@ -78,6 +78,10 @@ void sysled_enable(int en);
 
 void input_notify_mode();
 int input_poll(int getchar);
+int input_pending();
+
+// Passes ev to input_cb() of the first device with vid:pid, 0 if none.
+int input_inject(uint16_t vid, uint16_t pid, struct input_event *ev, struct input_absinfo *absinfo);
 int is_key_pressed(int key);
 
 void start_map_setting(int cnt, int set = 0);
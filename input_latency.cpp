@@ -0,0 +1,257 @@
+#include "input_latency.h"
+#include "input.h"
+#include "spi.h"
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_DEVS 32
+
+struct trace_rec_t
+{
+	uint64_t time_us;
+	uint16_t vid;
+	uint16_t pid;
+	uint16_t type;
+	uint16_t code;
+	int32_t  value;
+	int32_t  has_abs;
+	int32_t  abs_min;
+	int32_t  abs_max;
+	int32_t  abs_fuzz;
+	int32_t  abs_flat;
+};
+
+static const uint32_t trace_magic = 0x3154494d; // "MIT1"
+
+static uint16_t dev_vid[MAX_DEVS] = {};
+static uint16_t dev_pid[MAX_DEVS] = {};
+static latency_hist_t *dev_hist[MAX_DEVS] = {};
+static uint64_t dev_pending[MAX_DEVS] = {};
+static uint32_t pending_mask = 0;
+
+static int cur_dev = -1;
+static uint64_t cur_ev_us = 0;
+static uint64_t cur_read_us = 0;
+static bool cur_sent = false;
+
+static FILE *trace_fp = 0;
+static uint32_t trace_count = 0;
+
+// evdev timestamps use CLOCK_MONOTONIC after EVIOCSCLOCKID
+static uint64_t mono_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void input_latency_device(int dev, uint16_t vid, uint16_t pid)
+{
+	if (dev < 0 || dev >= MAX_DEVS) return;
+
+	dev_vid[dev] = vid;
+	dev_pid[dev] = pid;
+	dev_pending[dev] = 0;
+	pending_mask &= ~(1 << dev);
+
+	// same device type shares the histogram
+	char name[32];
+	snprintf(name, sizeof(name), "ev2spi %04x:%04x", vid, pid);
+	char *str = strdup(name);
+	dev_hist[dev] = latency_hist(str);
+	if (dev_hist[dev]->name != str) free(str);
+}
+
+void input_latency_event(int dev, const struct input_event *ev)
+{
+	if (dev < 0 || dev >= MAX_DEVS || !dev_hist[dev])
+	{
+		input_latency_clear();
+		return;
+	}
+
+	static latency_hist_t *hist_read = latency_hist("input_read");
+
+	cur_dev = dev;
+	cur_ev_us = (uint64_t)ev->time.tv_sec * 1000000ULL + ev->time.tv_usec;
+	cur_read_us = mono_us();
+	cur_sent = false;
+
+	// events queued before the clock switch carry realtime stamps
+	if (cur_ev_us > cur_read_us) cur_ev_us = cur_read_us;
+	latency_record(hist_read, (uint32_t)(cur_read_us - cur_ev_us));
+}
+
+void input_latency_clear()
+{
+	cur_dev = -1;
+}
+
+void input_latency_send()
+{
+	if (cur_dev < 0) return;
+
+	if (!cur_sent)
+	{
+		static latency_hist_t *hist_proc = latency_hist("input_proc");
+		latency_record(hist_proc, (uint32_t)(mono_us() - cur_read_us));
+		cur_sent = true;
+	}
+
+	// oldest event wins if several end up in the same flush
+	if (!(pending_mask & (1 << cur_dev)) || cur_ev_us < dev_pending[cur_dev]) dev_pending[cur_dev] = cur_ev_us;
+	pending_mask |= 1 << cur_dev;
+}
+
+void input_latency_flush()
+{
+	input_latency_clear();
+	if (!pending_mask) return;
+
+	uint64_t now = mono_us();
+	for (int i = 0; i < MAX_DEVS; i++)
+	{
+		if (!(pending_mask & (1 << i))) continue;
+		latency_record(dev_hist[i], (uint32_t)(now - dev_pending[i]));
+	}
+	pending_mask = 0;
+}
+
+void input_latency_trace(int dev, const struct input_event *ev, const struct input_absinfo *absinfo)
+{
+	if (!trace_fp || dev < 0 || dev >= MAX_DEVS) return;
+
+	trace_rec_t rec = {};
+	rec.time_us = (uint64_t)ev->time.tv_sec * 1000000ULL + ev->time.tv_usec;
+	rec.vid = dev_vid[dev];
+	rec.pid = dev_pid[dev];
+	rec.type = ev->type;
+	rec.code = ev->code;
+	rec.value = ev->value;
+	if (absinfo)
+	{
+		rec.has_abs = 1;
+		rec.abs_min = absinfo->minimum;
+		rec.abs_max = absinfo->maximum;
+		rec.abs_fuzz = absinfo->fuzz;
+		rec.abs_flat = absinfo->flat;
+	}
+
+	if (fwrite(&rec, sizeof(rec), 1, trace_fp) == 1) trace_count++;
+}
+
+static void trace_record(const char *path)
+{
+	if (trace_fp) fclose(trace_fp);
+
+	trace_fp = fopen(path, "wb");
+	if (!trace_fp)
+	{
+		printf("input_latency: cannot create %s\n", path);
+		return;
+	}
+
+	fwrite(&trace_magic, sizeof(trace_magic), 1, trace_fp);
+	trace_count = 0;
+	printf("input_latency: recording to %s\n", path);
+}
+
+static void trace_stop()
+{
+	if (!trace_fp) return;
+
+	fclose(trace_fp);
+	trace_fp = 0;
+	printf("input_latency: %u events recorded\n", trace_count);
+}
+
+// Feeds the trace through input_cb() as fast as possible. Events go to the
+// first open device with the recorded vid:pid, others are skipped.
+static void trace_replay(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+	{
+		printf("input_latency: cannot open %s\n", path);
+		return;
+	}
+
+	uint32_t magic = 0;
+	if (fread(&magic, sizeof(magic), 1, fp) != 1 || magic != trace_magic)
+	{
+		printf("input_latency: %s is not an input trace\n", path);
+		fclose(fp);
+		return;
+	}
+
+	latency_hist_t *hist = latency_hist("input_replay");
+	hist->count = 0;
+	hist->max = 0;
+	hist->sum = 0;
+	memset(hist->buckets, 0, sizeof(hist->buckets));
+
+	input_latency_clear();
+
+	uint32_t skipped = 0;
+	uint64_t start = mono_us();
+
+	trace_rec_t rec;
+	while (fread(&rec, sizeof(rec), 1, fp) == 1)
+	{
+		struct input_event ev = {};
+		ev.time.tv_sec = rec.time_us / 1000000;
+		ev.time.tv_usec = rec.time_us % 1000000;
+		ev.type = rec.type;
+		ev.code = rec.code;
+		ev.value = rec.value;
+
+		struct input_absinfo absinfo = {};
+		absinfo.minimum = rec.abs_min;
+		absinfo.maximum = rec.abs_max;
+		absinfo.fuzz = rec.abs_fuzz;
+		absinfo.flat = rec.abs_flat;
+
+		uint64_t t = mono_us();
+		if (!input_inject(rec.vid, rec.pid, &ev, rec.has_abs ? &absinfo : 0))
+		{
+			skipped++;
+			continue;
+		}
+		spi_uio_flush();
+		latency_record(hist, (uint32_t)(mono_us() - t));
+	}
+	fclose(fp);
+
+	uint32_t total = (uint32_t)(mono_us() - start);
+	printf("input_latency: replayed %u events (%u skipped) in %uus\n", hist->count, skipped, total);
+	printf("  per event: avg=%uus p50=%uus p99=%uus max=%uus\n",
+		hist->count ? (uint32_t)(hist->sum / hist->count) : 0,
+		latency_percentile(hist, 50.0), latency_percentile(hist, 99.0), hist->max);
+}
+
+void input_latency_cmd(const char *cmd)
+{
+	while (*cmd == ' ') cmd++;
+
+	if (!strncmp(cmd, "record ", 7))
+	{
+		trace_record(cmd + 7);
+	}
+	else if (!strcmp(cmd, "stop"))
+	{
+		trace_stop();
+	}
+	else if (!strncmp(cmd, "replay ", 7))
+	{
+		trace_stop();
+		trace_replay(cmd + 7);
+	}
+	else
+	{
+		printf("input_latency: unknown command '%s'\n", cmd);
+	}
+}
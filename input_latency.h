@@ -0,0 +1,36 @@
+#ifndef INPUT_LATENCY_H
+#define INPUT_LATENCY_H
+
+#include <inttypes.h>
+#include <linux/input.h>
+
+// End-to-end input latency: kernel event timestamp to the SPI write of the
+// resulting state. Device fds report CLOCK_MONOTONIC timestamps (set on
+// open) so they compare directly against the local clock.
+//
+// Histograms (see latency.h):
+//   input_read         event timestamp to read() in the input loop
+//   input_proc         read() to the first user_io state update
+//   ev2spi vid:pid     event timestamp to SPI flush, per device type
+//   input_replay       input_cb() plus SPI flush per replayed event
+
+void input_latency_device(int dev, uint16_t vid, uint16_t pid);
+
+// Stamps the event just read from dev. Stays current until the next
+// event or input_latency_clear().
+void input_latency_event(int dev, const struct input_event *ev);
+void input_latency_clear();
+
+// Records the event passed to input_cb() while a trace is recorded.
+void input_latency_trace(int dev, const struct input_event *ev, const struct input_absinfo *absinfo);
+
+// user_io state update for the current event.
+void input_latency_send();
+
+// After spi_uio_flush(), closes the pending measurements.
+void input_latency_flush();
+
+// "record <path>", "stop" or "replay <path>"
+void input_latency_cmd(const char *cmd);
+
+#endif
@@ -0,0 +1,181 @@
+#include "latency.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "hardware.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MAX_HISTOGRAMS 64
+#define DUMP_INTERVAL 10000
+
+static const char *default_latency_path = "/tmp/MiSTer_latency.txt";
+
+static latency_hist_t s_hists[MAX_HISTOGRAMS];
+static uint32_t s_hist_count = 0;
+static unsigned long s_dump_timer = 0;
+
+// LOW jobs may run concurrently and out of order, a periodic dump never
+// overwrites a newer one.
+static pthread_mutex_t s_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t s_dump_seq = 0;
+static uint32_t s_dump_written = 0;
+
+static inline uint32_t bucket_index(uint32_t v)
+{
+	if (v < 2 * LATENCY_SUB_COUNT) return v;
+
+	uint32_t e = (31 - __builtin_clz(v)) - LATENCY_SUB_BITS;
+	return (e * LATENCY_SUB_COUNT) + (v >> e);
+}
+
+// highest value that lands in the bucket
+static inline uint32_t bucket_value(uint32_t idx)
+{
+	if (idx < 2 * LATENCY_SUB_COUNT) return idx;
+
+	uint32_t e = (idx / LATENCY_SUB_COUNT) - 1;
+	uint32_t m = (idx % LATENCY_SUB_COUNT) + LATENCY_SUB_COUNT;
+	return (uint32_t)((((uint64_t)m + 1) << e) - 1);
+}
+
+latency_hist_t *latency_hist(const char *name)
+{
+	for (uint32_t i = 0; i < s_hist_count; i++)
+	{
+		if (s_hists[i].name == name || !strcmp(s_hists[i].name, name)) return &s_hists[i];
+	}
+
+	if (s_hist_count >= MAX_HISTOGRAMS)
+	{
+		static latency_hist_t overflow = { "overflow", 0, 0, 0, {} };
+		return &overflow;
+	}
+
+	latency_hist_t *hist = &s_hists[s_hist_count++];
+	hist->name = name;
+	return hist;
+}
+
+void latency_record(latency_hist_t *hist, uint32_t us)
+{
+	hist->buckets[bucket_index(us)]++;
+	hist->count++;
+	hist->sum += us;
+	if (us > hist->max) hist->max = us;
+}
+
+uint32_t latency_percentile(const latency_hist_t *hist, double pct)
+{
+	if (!hist->count) return 0;
+
+	uint64_t target = (uint64_t)(hist->count * pct / 100.0 + 0.5);
+	if (!target) target = 1;
+
+	uint64_t acc = 0;
+	for (uint32_t i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		acc += hist->buckets[i];
+		if (acc >= target)
+		{
+			uint32_t v = bucket_value(i);
+			return (v > hist->max) ? hist->max : v;
+		}
+	}
+
+	return hist->max;
+}
+
+void latency_reset()
+{
+	for (uint32_t i = 0; i < s_hist_count; i++)
+	{
+		latency_hist_t *hist = &s_hists[i];
+		hist->count = 0;
+		hist->max = 0;
+		hist->sum = 0;
+		memset(hist->buckets, 0, sizeof(hist->buckets));
+	}
+	printf("latency: histograms reset\n");
+}
+
+static void write_histograms(const latency_hist_t *hists, uint32_t count, const char *path)
+{
+	FILE *fp = fopen(path, "wt");
+	if (!fp) return;
+
+	fprintf(fp, "%-24s %10s %8s %8s %8s %8s %8s\n", "name", "count", "avg", "p50", "p99", "p99.9", "max");
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const latency_hist_t *hist = &hists[i];
+		fprintf(fp, "%-24s %10u %8u %8u %8u %8u %8u\n", hist->name, hist->count,
+			hist->count ? (uint32_t)(hist->sum / hist->count) : 0,
+			latency_percentile(hist, 50.0),
+			latency_percentile(hist, 99.0),
+			latency_percentile(hist, 99.9),
+			hist->max);
+	}
+	fprintf(fp, "\nAll values in microseconds.\n");
+	fclose(fp);
+}
+
+void latency_dump(const char *path)
+{
+	// Histograms are only updated from the main thread, copy them here
+	// and leave the formatting to a worker.
+	uint32_t count = s_hist_count;
+	latency_hist_t *snap = new latency_hist_t[count];
+	memcpy(snap, s_hists, count * sizeof(latency_hist_t));
+
+	char *dst = strdup(path ? path : default_latency_path);
+	uint32_t seq = path ? 0 : ++s_dump_seq;
+	offload_add_work([snap, count, dst, seq]
+	{
+		pthread_mutex_lock(&s_dump_lock);
+		if (!seq || (int32_t)(seq - s_dump_written) > 0)
+		{
+			write_histograms(snap, count, dst);
+			if (seq) s_dump_written = seq;
+		}
+		pthread_mutex_unlock(&s_dump_lock);
+		delete[] snap;
+		free(dst);
+	});
+}
+
+static void latency_poll()
+{
+	if (CheckTimer(s_dump_timer))
+	{
+		s_dump_timer = GetTimer(DUMP_INTERVAL);
+		latency_dump();
+	}
+}
+
+void latency_init()
+{
+	s_dump_timer = GetTimer(DUMP_INTERVAL);
+	scheduler_add_background(latency_poll);
+}
+
+void latency_cmd(const char *cmd)
+{
+	while (*cmd == ' ') cmd++;
+
+	if (!strcmp(cmd, "reset"))
+	{
+		latency_reset();
+	}
+	else if (!strncmp(cmd, "dump", 4))
+	{
+		cmd += 4;
+		while (*cmd == ' ') cmd++;
+		latency_dump(*cmd ? cmd : 0);
+	}
+	else
+	{
+		printf("latency: unknown command '%s'\n", cmd);
+	}
+}
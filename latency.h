@@ -0,0 +1,64 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <inttypes.h>
+#include <time.h>
+
+// Log-linear (HDR style) latency histograms in microseconds.
+// Values keep ~6% precision from 1us up to over an hour.
+
+#define LATENCY_SUB_BITS    4
+#define LATENCY_SUB_COUNT   (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS     ((33 - LATENCY_SUB_BITS) * LATENCY_SUB_COUNT)
+
+struct latency_hist_t
+{
+	const char *name;
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t buckets[LATENCY_BUCKETS];
+};
+
+// Returns the histogram registered under name, creating it on first use.
+// Names must be string literals (or otherwise outlive the process).
+latency_hist_t *latency_hist(const char *name);
+
+void latency_record(latency_hist_t *hist, uint32_t us);
+uint32_t latency_percentile(const latency_hist_t *hist, double pct);
+
+void latency_init();
+void latency_reset();
+void latency_dump(const char *path = 0);
+
+// "reset" or "dump [path]"
+void latency_cmd(const char *cmd);
+
+static inline uint64_t latency_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+struct LatencyScopedTimer
+{
+	latency_hist_t *hist;
+	uint64_t start;
+
+	LatencyScopedTimer(latency_hist_t *hist)
+		: hist(hist)
+	{
+		start = latency_now_us();
+	}
+
+	~LatencyScopedTimer()
+	{
+		latency_record(hist, (uint32_t)(latency_now_us() - start));
+	}
+};
+
+#define LATENCY_SCOPE(name) static latency_hist_t *__lat_hist = latency_hist(name); LatencyScopedTimer __lat_timer(__lat_hist)
+#define LATENCY_FUNCTION() LATENCY_SCOPE(__FUNCTION__)
+
+#endif
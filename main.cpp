@@ -30,9 +30,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "user_io.h"
 #include "input.h"
 #include "fpga_io.h"
+#include "spi.h"
 #include "scheduler.h"
 #include "osd.h"
 #include "offload.h"
+#include "profiling.h"
+#include "latency.h"
+#include "input_latency.h"
+#include "fpga_sim.h"
 
 const char *version = "$VER:" VDATE;
 
@@ -47,9 +52,15 @@ int main(int argc, char *argv[])
 	sched_setaffinity(0, sizeof(set), &set);
 
 	offload_start();
+	profiling_init();
+	latency_init();
 
 	fpga_io_init();
 
+#ifdef FPGA_SIM
+	if (argc > 1 && !strcmp(argv[1], "--bench")) return fpga_sim_bench(argc - 2, argv + 2);
+#endif
+
 	DISKLED_OFF;
 
 	printf("\nMinimig by Dennis van Weeren");
@@ -84,6 +95,8 @@ int main(int argc, char *argv[])
 
 		user_io_poll();
 		input_poll(0);
+		spi_uio_flush();
+		input_latency_flush();
 		HandleUI();
 		OsdUpdate();
 	}
@@ -64,6 +64,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bootcore.h"
 #include "ide.h"
 #include "profiling.h"
+#include "latency.h"
 
 /*menu states*/
 enum MENU
@@ -631,7 +632,7 @@ static char* getNet(int spec)
 	}
 
 	freeifaddrs(ifaddr);
-	return spec ? (ifa ? host : 0) : (char*)netType;
+	return spec ? (ifa ? host : 0) : (char*)(intptr_t)netType;
 }
 
 static long sysinfo_timer;
@@ -932,6 +933,7 @@ static int page = 0;
 void HandleUI(void)
 {
 	PROFILE_FUNCTION();
+	LATENCY_FUNCTION();
 
 	if (bt_timer >= 0)
 	{
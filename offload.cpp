@@ -1,80 +1,208 @@
 #include "offload.h"
 #include "profiling.h"
 #include <pthread.h>
+#include <semaphore.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <assert.h>
+#include <atomic>
 
-static constexpr uint32_t QUEUE_SIZE = 8;
-
-static pthread_t s_thread_handle;
-static pthread_cond_t s_cond_work, s_cond_available;
-static pthread_mutex_t s_queue_lock;
+static constexpr uint32_t QUEUE_SIZE = 64; // must be pow2
+static constexpr uint32_t QUEUE_MASK = QUEUE_SIZE - 1;
+static constexpr int MAX_WORKERS = 4;
 
 struct Work
 {
+	// Vyukov style sequence: pos = free, pos+1 = queued,
+	// pos+QUEUE_SIZE = executed (slot free for the next lap).
+	std::atomic<uint32_t> seq;
 	std::function<void()> handler;
+	uint64_t submit_ns;
+};
+
+struct WorkQueue
+{
+	Work work[QUEUE_SIZE];
+	std::atomic<uint32_t> head;
+	std::atomic<uint32_t> tail;
+	sem_t sem;
+
+	int workers;
+	int nice;
+
+	// stats
+	std::atomic<uint32_t> submitted;
+	std::atomic<uint32_t> completed;
+	std::atomic<uint32_t> inlined;
+	std::atomic<uint32_t> max_depth;
+	std::atomic<uint64_t> wait_ns;
+	std::atomic<uint64_t> wait_max_ns;
+	std::atomic<uint64_t> run_ns;
 };
 
-static Work s_queue[QUEUE_SIZE];
-static uint32_t s_queue_head, s_queue_tail;
-static bool s_quit;
+static const char *prio_names[OFFLOAD_PRIO_COUNT] = { "high", "low", "stream" };
+static const int prio_workers[OFFLOAD_PRIO_COUNT] = { 1, 2, 1 };
+static const int prio_nice[OFFLOAD_PRIO_COUNT] = { 0, 10, 0 };
+
+static WorkQueue s_queues[OFFLOAD_PRIO_COUNT];
+static pthread_t s_thread_handle[MAX_WORKERS];
+static int s_thread_count = 0;
+static std::atomic<bool> s_quit;
+
+// class of the worker running on this thread, -1 on other threads
+static thread_local int s_worker_prio = -1;
+
+static pthread_mutex_t s_done_lock;
+static pthread_cond_t s_cond_done;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void atomic_max(std::atomic<uint64_t> &var, uint64_t val)
+{
+	uint64_t cur = var.load(std::memory_order_relaxed);
+	while (cur < val && !var.compare_exchange_weak(cur, val, std::memory_order_relaxed));
+}
+
+static void atomic_max(std::atomic<uint32_t> &var, uint32_t val)
+{
+	uint32_t cur = var.load(std::memory_order_relaxed);
+	while (cur < val && !var.compare_exchange_weak(cur, val, std::memory_order_relaxed));
+}
+
+static bool queue_push(WorkQueue *q, std::function<void()> &handler, uint32_t *out_pos)
+{
+	uint32_t pos = q->head.load(std::memory_order_relaxed);
+	Work *work;
+	while (true)
+	{
+		work = &q->work[pos & QUEUE_MASK];
+		int32_t dif = (int32_t)(work->seq.load(std::memory_order_acquire) - pos);
+		if (!dif)
+		{
+			if (q->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		}
+		else if (dif < 0)
+		{
+			// slot of the previous lap still queued or executing
+			return false;
+		}
+		else
+		{
+			pos = q->head.load(std::memory_order_relaxed);
+		}
+	}
+
+	work->handler = std::move(handler);
+	work->submit_ns = now_ns();
+	work->seq.store(pos + 1, std::memory_order_release);
+
+	*out_pos = pos;
+	return true;
+}
+
+static Work *queue_pop(WorkQueue *q, uint32_t *out_pos)
+{
+	uint32_t pos = q->tail.load(std::memory_order_relaxed);
+	Work *work;
+	while (true)
+	{
+		work = &q->work[pos & QUEUE_MASK];
+		int32_t dif = (int32_t)(work->seq.load(std::memory_order_acquire) - (pos + 1));
+		if (!dif)
+		{
+			if (q->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		}
+		else if (dif < 0)
+		{
+			return nullptr;
+		}
+		else
+		{
+			pos = q->tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	*out_pos = pos;
+	return work;
+}
 
-static void *worker_thread(void *)
+static void *worker_thread(void *param)
 {
+	WorkQueue *q = (WorkQueue *)param;
+
+	s_worker_prio = q - s_queues;
+	if (q->nice) setpriority(PRIO_PROCESS, syscall(SYS_gettid), q->nice);
+
+	char name[16];
+	snprintf(name, sizeof(name), "offload %s", prio_names[q - s_queues]);
+	profiling_thread_name(name);
+
 	while (true)
 	{
-		Work *current_work = nullptr;
-		// Wait for work
-		pthread_mutex_lock(&s_queue_lock);
-		if (s_queue_head == s_queue_tail)
+		// Wait for work. Every post matches exactly one queued item,
+		// except the final wake up posted by offload_stop.
+		while (sem_wait(&q->sem) && errno == EINTR);
+
+		uint32_t pos;
+		Work *work;
+		while (!(work = queue_pop(q, &pos)))
 		{
-			// queue empty and quit flag set, exit
-			if (s_quit)
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
-
-			// wait for work signal
-			pthread_cond_wait(&s_cond_work, &s_queue_lock);
-			
-			// quit flag was set and queue still empty, quit
-			if (s_quit && (s_queue_head == s_queue_tail))
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
+			// nothing claimed by producers, this was the stop signal
+			if (q->head.load() == q->tail.load()) break;
+
+			// a producer claimed the slot but did not publish it yet
+			sched_yield();
 		}
 
-		// get work
-		current_work = &s_queue[s_queue_tail % QUEUE_SIZE];
-		pthread_mutex_unlock(&s_queue_lock);
+		if (!work)
+		{
+			if (s_quit) break;
+			continue;
+		}
+
+		uint64_t start = now_ns();
+		uint64_t wait = start - work->submit_ns;
+		q->wait_ns += wait;
+		atomic_max(q->wait_max_ns, wait);
 
 		// execute
-		current_work->handler();
-		current_work->handler = nullptr;
-
-		// lock and move tail forward
-		pthread_mutex_lock(&s_queue_lock);
-		s_queue_tail++;
-		pthread_cond_signal(&s_cond_available);
-		pthread_mutex_unlock(&s_queue_lock);
+		work->handler();
+		work->handler = nullptr;
+
+		q->run_ns += now_ns() - start;
+		q->completed++;
+
+		// release the slot, this also marks the handle as done
+		work->seq.store(pos + QUEUE_SIZE, std::memory_order_release);
+
+		pthread_mutex_lock(&s_done_lock);
+		pthread_cond_broadcast(&s_cond_done);
+		pthread_mutex_unlock(&s_done_lock);
 	}
 	return (void *)0;
 }
 
 void offload_start()
 {
-	pthread_cond_init(&s_cond_available, nullptr);
-	pthread_cond_init(&s_cond_work, nullptr);
-	pthread_mutex_init(&s_queue_lock, nullptr);
+	pthread_mutex_init(&s_done_lock, nullptr);
+	pthread_cond_init(&s_cond_done, nullptr);
 
-	s_queue_head = s_queue_tail = 0;
 	s_quit = false;
+	s_thread_count = 0;
 
 	pthread_attr_t attr;
-
 	pthread_attr_init(&attr);
 
 	// Set affinity to core #0 since main runs on core #1
@@ -83,40 +211,100 @@ void offload_start()
 	CPU_SET(0, &set);
 	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
 
-	pthread_create(&s_thread_handle, &attr, worker_thread, nullptr);
+	for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++)
+	{
+		WorkQueue *q = &s_queues[prio];
+		for (uint32_t i = 0; i < QUEUE_SIZE; i++) q->work[i].seq = i;
+		q->head = q->tail = 0;
+		q->submitted = q->completed = q->inlined = q->max_depth = 0;
+		q->wait_ns = q->wait_max_ns = q->run_ns = 0;
+		q->workers = prio_workers[prio];
+		q->nice = prio_nice[prio];
+		sem_init(&q->sem, 0, 0);
+
+		for (int i = 0; i < q->workers && s_thread_count < MAX_WORKERS; i++)
+		{
+			pthread_create(&s_thread_handle[s_thread_count++], &attr, worker_thread, q);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
 }
 
 void offload_stop()
 {
-	pthread_mutex_lock(&s_queue_lock);
-
 	s_quit = true;
-	pthread_cond_signal(&s_cond_work);
-
-	pthread_mutex_unlock(&s_queue_lock);
+	for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++)
+	{
+		for (int i = 0; i < s_queues[prio].workers; i++) sem_post(&s_queues[prio].sem);
+	}
 
 	printf("Waiting for offloaded work to finish...");
-	pthread_join(s_thread_handle, nullptr);
+	for (int i = 0; i < s_thread_count; i++) pthread_join(s_thread_handle[i], nullptr);
+	s_thread_count = 0;
 	printf("Done\n");
 }
 
-void offload_add_work(std::function<void()> handler)
+offload_handle_t offload_add_work(std::function<void()> handler, offload_prio_t prio)
 {
 	PROFILE_FUNCTION();
 
-	pthread_mutex_lock(&s_queue_lock);
+	offload_handle_t handle;
+	WorkQueue *q = &s_queues[prio];
 
-	if ((s_queue_head - s_queue_tail) == QUEUE_SIZE)
+	uint32_t pos;
+	if (!s_thread_count || !queue_push(q, handler, &pos))
 	{
-		pthread_cond_wait(&s_cond_available, &s_queue_lock);
+		// Queue is full (or workers are gone), don't stall the caller waiting for a slot.
+		q->inlined++;
+		handler();
+		return handle;
 	}
 
-	Work *work = &s_queue[s_queue_head % QUEUE_SIZE];
-	work->handler = handler;
+	q->submitted++;
+	atomic_max(q->max_depth, pos + 1 - q->tail.load(std::memory_order_relaxed));
+	sem_post(&q->sem);
+
+	handle.prio = prio;
+	handle.pos = pos;
+	return handle;
+}
+
+bool offload_done(offload_handle_t handle)
+{
+	if (handle.prio < 0) return true;
+
+	const Work *work = &s_queues[handle.prio].work[handle.pos & QUEUE_MASK];
+	return (int32_t)(work->seq.load(std::memory_order_acquire) - (handle.pos + QUEUE_SIZE)) >= 0;
+}
+
+void offload_wait(offload_handle_t handle)
+{
+	PROFILE_FUNCTION();
+
+	if (offload_done(handle)) return;
 
-	s_queue_head++;
+	// a single worker would be waiting for itself
+	assert(!(s_worker_prio == handle.prio && prio_workers[handle.prio] == 1));
 
-	pthread_cond_signal(&s_cond_work);
+	pthread_mutex_lock(&s_done_lock);
+	while (!offload_done(handle)) pthread_cond_wait(&s_cond_done, &s_done_lock);
+	pthread_mutex_unlock(&s_done_lock);
+}
 
-	pthread_mutex_unlock(&s_queue_lock);
-}
\ No newline at end of file
+void offload_print_stats()
+{
+	printf("Offload queues:\n");
+	for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++)
+	{
+		WorkQueue *q = &s_queues[prio];
+		uint32_t completed = q->completed;
+		uint32_t depth = q->head - q->tail;
+		printf("  %-6s: workers=%d depth=%u max_depth=%u submitted=%u completed=%u inlined=%u wait_avg=%lluus wait_max=%lluus run_avg=%lluus\n",
+			prio_names[prio], q->workers, depth, (uint32_t)q->max_depth,
+			(uint32_t)q->submitted, completed, (uint32_t)q->inlined,
+			(unsigned long long)(completed ? q->wait_ns / completed / 1000 : 0),
+			(unsigned long long)(q->wait_max_ns / 1000),
+			(unsigned long long)(completed ? q->run_ns / completed / 1000 : 0));
+	}
+}
@@ -2,11 +2,51 @@
 #define OFFLOAD_H
 
 #include <stddef.h>
+#include <inttypes.h>
 #include <functional>
 
+// Latency critical work is serviced by its own worker so it never queues
+// behind long running background jobs (hashing, indexing, flushing).
+// STREAM is for short reads feeding a buffer the core drains in real time
+// (MSU audio); it has a worker of its own so a slow disk request on HIGH
+// can't run the buffer dry.
+//
+// Ordering: HIGH and STREAM have a single worker each, queued jobs start
+// in submit order. LOW has two workers, so LOW jobs may run concurrently
+// and finish out of order. A job that runs inline because its queue is
+// full runs before the ones already queued. Jobs that depend on order have
+// to handle it themselves (serialize on a lock, write the latest state
+// rather than a captured one).
+//
+// A HIGH or STREAM job must never wait for a job of its own class, the
+// single worker would wait for itself.
+enum offload_prio_t
+{
+	OFFLOAD_HIGH = 0,
+	OFFLOAD_LOW,
+	OFFLOAD_STREAM,
+
+	OFFLOAD_PRIO_COUNT
+};
+
+// Completion handle. Default constructed handle is always done.
+struct offload_handle_t
+{
+	int8_t prio = -1;
+	uint32_t pos = 0;
+};
+
 void offload_start();
 void offload_stop();
 
-void offload_add_work(std::function<void()> work);
+// Never blocks. If the queue of the given class is full the work is
+// executed immediately on the calling thread.
+offload_handle_t offload_add_work(std::function<void()> work, offload_prio_t prio = OFFLOAD_LOW);
+
+// Non-blocking check, safe to call from cooperative tasks every iteration.
+bool offload_done(offload_handle_t handle);
+void offload_wait(offload_handle_t handle);
+
+void offload_print_stats();
 
-#endif
\ No newline at end of file
+#endif
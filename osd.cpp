@@ -46,6 +46,7 @@ as rotated copies of the first 128 entries.  -- AMR
 #include "user_io.h"
 #include "hardware.h"
 #include "profiling.h"
+#include "latency.h"
 
 #include "support.h"
 
@@ -663,6 +664,7 @@ char* OsdCoreNameGet()
 void OsdUpdate()
 {
 	PROFILE_FUNCTION();
+	LATENCY_FUNCTION();
 	int n = is_menu() ? 19 : osd_size;
 	for (int i = 0; i < n; i++)
 	{
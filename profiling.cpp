@@ -1,68 +1,128 @@
-#ifdef PROFILING
-
 #include "profiling.h"
 
 #include "str_util.h"
+#include "offload.h"
+#include "scheduler.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#ifdef PROFILING
+std::atomic<bool> profiling_active(true);
+#else
+std::atomic<bool> profiling_active(false);
+#endif
+
+enum
+{
+	EVENT_BEGIN = 0,
+	EVENT_END,
+	EVENT_COUNTER
+};
 
 struct Event
 {
 	const char *name;
-	uint32_t begin_idx;
-	struct timespec ts;
+	uint64_t ts;
+	int64_t value; // begin index for begin/end, value for counters
+	uint32_t type;
 };
 
-static constexpr int MAX_EVENTS = 512; // must be pow2
-static Event s_events[MAX_EVENTS]; // circular buffer
-static uint32_t s_event_tail = 0;
+static constexpr uint32_t MAX_EVENTS = 4096; // must be pow2
+static constexpr uint32_t MAX_THREADS = 16;
+static constexpr uint32_t DUMP_MARGIN = 64; // events near the write head may be torn during a dump
 
-static constexpr Event *get_event(uint32_t idx)
+// Per thread circular buffer. Only the owning thread writes, readers copy
+// and discard whatever got overwritten in the meantime.
+struct Ring
 {
-	return &s_events[idx % MAX_EVENTS];
-}
+	Event events[MAX_EVENTS];
+	std::atomic<uint32_t> tail;
+	pid_t tid;
+	char name[16];
+};
 
-uint32_t profiling_event_begin(const char *name)
+static Ring s_rings[MAX_THREADS];
+static std::atomic<uint32_t> s_ring_count(0);
+static thread_local Ring *t_ring = nullptr;
+
+static volatile sig_atomic_t s_signal_dump = 0;
+static const char *default_trace_path = "/tmp/MiSTer_trace.json";
+
+static Ring *get_ring()
 {
-	Event *newEvent = get_event(s_event_tail);
-	newEvent->begin_idx = s_event_tail;
-	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+	if (t_ring) return t_ring;
+
+	static Ring overflow_ring;
+	uint32_t idx = s_ring_count++;
+	if (idx >= MAX_THREADS)
+	{
+		// too many threads, not dumped but keeps spike bookkeeping working
+		s_ring_count = MAX_THREADS;
+		t_ring = &overflow_ring;
+		return t_ring;
+	}
 
-	uint32_t r = s_event_tail;
-	s_event_tail++;
-	return r;
+	Ring *ring = &s_rings[idx];
+	ring->tid = syscall(SYS_gettid);
+	if (!ring->name[0]) snprintf(ring->name, sizeof(ring->name), ring->tid == getpid() ? "main" : "thread %d", ring->tid);
+	t_ring = ring;
+	return ring;
 }
 
-void profiling_event_end(uint32_t begin_idx, const char *name)
+static inline Event *get_event(Ring *ring, uint32_t idx)
 {
-	Event *newEvent = get_event(s_event_tail);
-	newEvent->begin_idx = begin_idx;
-	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
-	s_event_tail++;
+	return &ring->events[idx % MAX_EVENTS];
 }
 
-// result_ns = a - b
-static uint64_t delta_ns(const struct timespec *a, const struct timespec *b)
+static inline uint64_t timestamp_ns()
 {
 	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	ts.tv_sec = a->tv_sec - b->tv_sec;
-	ts.tv_nsec = a->tv_nsec - b->tv_nsec;
-	if (ts.tv_nsec < 0)
-	{
-		ts.tv_nsec += 1000000000;
-		ts.tv_sec -= 1;
-	}
+static inline uint32_t push_event(Ring *ring, const char *name, uint32_t type, int64_t value)
+{
+	uint32_t idx = ring->tail.load(std::memory_order_relaxed);
+	Event *event = get_event(ring, idx);
+	event->name = name;
+	event->type = type;
+	event->value = value;
+	event->ts = timestamp_ns();
+	ring->tail.store(idx + 1, std::memory_order_release);
+	return idx;
+}
 
-	uint64_t delta = ts.tv_sec * 1000000000ULL;
-	delta += ts.tv_nsec;
-	return delta;
+void profiling_thread_name(const char *name)
+{
+	strcpyz(get_ring()->name, name);
 }
 
+uint32_t profiling_event_begin(const char *name)
+{
+	Ring *ring = get_ring();
+	uint32_t idx = ring->tail.load(std::memory_order_relaxed);
+	return push_event(ring, name, EVENT_BEGIN, idx);
+}
+
+void profiling_event_end(uint32_t begin_idx, const char *name)
+{
+	push_event(get_ring(), name, EVENT_END, begin_idx);
+}
+
+void profiling_counter(const char *name, int64_t value)
+{
+	push_event(get_ring(), name, EVENT_COUNTER, value);
+}
+
+#ifdef PROFILING
 
 // Bookkeeping data for spike report
 static uint64_t inclusive_times[MAX_EVENTS];
@@ -72,31 +132,36 @@ static uint32_t pair_stack[MAX_EVENTS / 2];
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 {
 	int stack_pos = 0;
+	Ring *ring = get_ring();
+	const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+
+	// bookkeeping arrays are shared, only report spikes of the main thread
+	if (ring->tid != getpid()) return;
 
-	if ((s_event_tail - begin_idx) < 2) return; // not enough events
-	if ((s_event_tail - begin_idx) > MAX_EVENTS) return; // too many events
+	if ((tail - begin_idx) < 2) return; // not enough events
+	if ((tail - begin_idx) > MAX_EVENTS) return; // too many events
 
-	const uint64_t total_ns = delta_ns(&get_event(s_event_tail - 1)->ts, &get_event(begin_idx)->ts);
+	const uint64_t total_ns = get_event(ring, tail - 1)->ts - get_event(ring, begin_idx)->ts;
 
 	if (total_ns < (spike_us * 1000ULL)) return; // below threshold
 
-	for (uint32_t idx = begin_idx; idx != s_event_tail; idx++)
+	for (uint32_t idx = begin_idx; idx != tail; idx++)
 	{
 		const uint32_t cyc_idx = idx % MAX_EVENTS;
-		Event *event = get_event(idx);
+		Event *event = get_event(ring, idx);
 
-		if (event->begin_idx == idx)
+		if (event->type == EVENT_BEGIN)
 		{
 			pair_stack[stack_pos] = cyc_idx;
 			inclusive_times[cyc_idx] = 0;
 			other_times[cyc_idx] = 0;
 			stack_pos++;
 		}
-		else
+		else if (event->type == EVENT_END)
 		{
 			stack_pos--;
 			uint32_t span_idx = pair_stack[stack_pos];
-			const uint64_t inclusive_ns = delta_ns(&event->ts, &get_event(span_idx)->ts);
+			const uint64_t inclusive_ns = event->ts - ring->events[span_idx].ts;
 			inclusive_times[span_idx] = inclusive_ns;
 			if (stack_pos > 0) other_times[pair_stack[stack_pos-1]] += inclusive_ns;
 		}
@@ -106,19 +171,19 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 	int indent = 0;
 	printf("\n%lluus spike over %uus limit.\n", total_ns / 1000ULL, spike_us);
 	printf("+----- Name -----------------------------------------+ Inc(us) + Exc(us) +\n");
-	for (uint32_t idx = begin_idx; idx != s_event_tail; idx++)
+	for (uint32_t idx = begin_idx; idx != tail; idx++)
 	{
 		const uint32_t cyc_idx = idx % MAX_EVENTS;
-		Event *event = get_event(idx);
+		Event *event = get_event(ring, idx);
 
-		if (event->begin_idx == idx)
+		if (event->type == EVENT_BEGIN)
 		{
 			memset(label, ' ', indent);
 			strcpyz(label + indent, sizeof(label) - indent, event->name);
 			printf("| %-50s | %7llu | %7llu |\n", label, inclusive_times[cyc_idx] / 1000ULL, (inclusive_times[cyc_idx] - other_times[cyc_idx]) / 1000ULL);
 			indent += 2;
 		}
-		else
+		else if (event->type == EVENT_END)
 		{
 			indent -= 2;
 		}
@@ -127,4 +192,162 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 	fflush(stdout);
 }
 
-#endif // PROFILING
\ No newline at end of file
+#else // PROFILING
+
+void profiling_spike_report(uint32_t, uint32_t)
+{
+}
+
+#endif // PROFILING
+
+struct TraceSnapshot
+{
+	pid_t tid;
+	char name[16];
+	uint32_t first;
+	uint32_t count;
+	Event *events;
+};
+
+static void write_trace(TraceSnapshot *snaps, uint32_t snap_count, const char *path)
+{
+	FILE *fp = fopen(path, "wt");
+	if (!fp)
+	{
+		printf("profiling: cannot create %s\n", path);
+		return;
+	}
+
+	pid_t pid = getpid();
+	uint32_t total = 0;
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"MiSTer\"}}", pid);
+	for (uint32_t i = 0; i < snap_count; i++)
+	{
+		TraceSnapshot *snap = &snaps[i];
+		fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, snap->tid, snap->name);
+
+		for (uint32_t n = 0; n < snap->count; n++)
+		{
+			const Event *event = &snap->events[n];
+			const unsigned long long us = event->ts / 1000;
+			const unsigned frac = event->ts % 1000;
+			switch (event->type)
+			{
+			case EVENT_BEGIN:
+				fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d}", event->name, us, frac, pid, snap->tid);
+				break;
+
+			case EVENT_END:
+				// begin was overwritten before the snapshot
+				if ((int32_t)((uint32_t)event->value - snap->first) < 0) continue;
+				fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"E\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d}", event->name, us, frac, pid, snap->tid);
+				break;
+
+			case EVENT_COUNTER:
+				fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%lld}}", event->name, us, frac, pid, snap->tid, (long long)event->value);
+				break;
+			}
+			total++;
+		}
+		delete[] snap->events;
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	printf("profiling: %u events from %u threads written to %s\n", total, snap_count, path);
+}
+
+static void profiling_dump(const char *path)
+{
+	uint32_t snap_count = s_ring_count.load();
+	if (snap_count > MAX_THREADS) snap_count = MAX_THREADS;
+
+	// Copy the rings here and format on a worker so the main loop only pays for the memcpy.
+	TraceSnapshot *snaps = new TraceSnapshot[snap_count];
+	for (uint32_t i = 0; i < snap_count; i++)
+	{
+		Ring *ring = &s_rings[i];
+		TraceSnapshot *snap = &snaps[i];
+
+		uint32_t tail = ring->tail.load(std::memory_order_acquire);
+		uint32_t first = (tail > MAX_EVENTS - DUMP_MARGIN) ? tail - (MAX_EVENTS - DUMP_MARGIN) : 0;
+
+		snap->tid = ring->tid;
+		strcpyz(snap->name, ring->name);
+		snap->events = new Event[tail - first];
+		for (uint32_t idx = first; idx != tail; idx++) snap->events[idx - first] = *get_event(ring, idx);
+
+		// drop whatever the owner overwrote while copying
+		uint32_t new_tail = ring->tail.load(std::memory_order_acquire);
+		if (new_tail - first > MAX_EVENTS - DUMP_MARGIN)
+		{
+			uint32_t skip = new_tail - first - (MAX_EVENTS - DUMP_MARGIN);
+			if (skip > tail - first) skip = tail - first;
+			memmove(snap->events, snap->events + skip, (tail - first - skip) * sizeof(Event));
+			first += skip;
+		}
+
+		snap->first = first;
+		snap->count = tail - first;
+	}
+
+	// dumps may run on both LOW workers at once, don't interleave them
+	static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+	char *dst = strdup(path);
+	offload_add_work([snaps, snap_count, dst]
+	{
+		pthread_mutex_lock(&dump_lock);
+		write_trace(snaps, snap_count, dst);
+		pthread_mutex_unlock(&dump_lock);
+		delete[] snaps;
+		free(dst);
+	});
+}
+
+static void profiling_signal(int)
+{
+	s_signal_dump = 1;
+}
+
+static void profiling_poll()
+{
+	if (s_signal_dump)
+	{
+		s_signal_dump = 0;
+		profiling_dump(default_trace_path);
+	}
+}
+
+void profiling_init()
+{
+	get_ring();
+	signal(SIGUSR1, profiling_signal);
+	scheduler_add_background(profiling_poll);
+}
+
+void profiling_trace_cmd(const char *cmd)
+{
+	while (*cmd == ' ') cmd++;
+
+	if (!strcmp(cmd, "start"))
+	{
+		profiling_active = true;
+		printf("profiling: tracing started\n");
+	}
+	else if (!strcmp(cmd, "stop"))
+	{
+		profiling_active = false;
+		profiling_dump(default_trace_path);
+	}
+	else if (!strncmp(cmd, "dump", 4))
+	{
+		cmd += 4;
+		while (*cmd == ' ') cmd++;
+		profiling_dump(*cmd ? cmd : default_trace_path);
+	}
+	else
+	{
+		printf("profiling: unknown trace command '%s'\n", cmd);
+	}
+}
@@ -2,13 +2,27 @@
 #define PROFILING_H 1
 
 #include <inttypes.h>
+#include <atomic>
 
-#ifdef PROFILING
+// Events are always compiled in and recorded into per-thread rings while
+// tracing is active. Building with PROFILING=1 starts with tracing active
+// and enables the console spike reports.
+
+#define PROFILING_NO_EVENT 0xFFFFFFFF
+
+extern std::atomic<bool> profiling_active;
+
+void profiling_init();
+void profiling_thread_name(const char *name);
 
 uint32_t profiling_event_begin(const char *name);
 void profiling_event_end(uint32_t begin_idx, const char *name);
+void profiling_counter(const char *name, int64_t value);
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us);
 
+// "start", "stop" or "dump [path]"
+void profiling_trace_cmd(const char *cmd);
+
 struct ProfilingScopedEvent
 {
 	const char *name;
@@ -19,18 +33,19 @@ struct ProfilingScopedEvent
 		: name(name)
 		, spike_us(0)
 	{
-		begin_idx = profiling_event_begin(name);
+		begin_idx = profiling_active.load(std::memory_order_relaxed) ? profiling_event_begin(name) : PROFILING_NO_EVENT;
 	}
 
 	ProfilingScopedEvent(const char *name, uint32_t spike_us)
 		: name(name)
 		, spike_us(spike_us)
 	{
-		begin_idx = profiling_event_begin(name);
+		begin_idx = profiling_active.load(std::memory_order_relaxed) ? profiling_event_begin(name) : PROFILING_NO_EVENT;
 	}
 
 	~ProfilingScopedEvent()
 	{
+		if (begin_idx == PROFILING_NO_EVENT) return;
 		profiling_event_end(begin_idx, name);
 		if (spike_us > 0) profiling_spike_report(begin_idx, spike_us);
 	}
@@ -40,14 +55,6 @@ struct ProfilingScopedEvent
 #define PROFILE_FUNCTION() ProfilingScopedEvent __scope_timer(__FUNCTION__)
 #define SPIKE_SCOPE(name, us) ProfilingScopedEvent __scope_timer(name, us)
 #define SPIKE_FUNCTION(us) ProfilingScopedEvent __scope_timer(__FUNCTION__, us)
-
-#else // PROFILING
-
-#define PROFILE_SCOPE(name) 
-#define PROFILE_FUNCTION()
-#define SPIKE_SCOPE(name, us)
-#define SPIKE_FUNCTION(us)
-
-#endif // PROFILING
+#define PROFILE_COUNTER(name, value) do { if (profiling_active.load(std::memory_order_relaxed)) profiling_counter(name, value); } while (0)
 
 #endif // PROFILING_H
@@ -16,6 +16,10 @@ with help from the MiSTer contributors including Grabulosaure
 #include <sys/types.h>
 #include <err.h>
 
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
 #include "scaler.h"
 #include "shmem.h"
 
@@ -72,36 +76,105 @@ void mister_scaler_free(mister_scaler *ms)
    free(ms);
 }
 
+// BT.601 studio swing, 8 bit fixed point
+#define YUV_Y(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define YUV_U(r, g, b) (((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define YUV_V(r, g, b) (((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+static void row_rgb_to_yuv(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+    int x = 0;
+#ifdef __ARM_NEON__
+    const uint8x8_t c66 = vdup_n_u8(66), c129 = vdup_n_u8(129), c25 = vdup_n_u8(25), c16 = vdup_n_u8(16);
+    const int16x8_t c128 = vdupq_n_s16(128);
+    for (; x + 8 <= width; x += 8)
+    {
+        uint8x8x3_t in = vld3_u8(src);
+        src += 24;
+
+        uint16x8_t ys = vmull_u8(in.val[0], c66);
+        ys = vmlal_u8(ys, in.val[1], c129);
+        ys = vmlal_u8(ys, in.val[2], c25);
+        vst1_u8(y, vadd_u8(vrshrn_n_u16(ys, 8), c16));
+
+        int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(in.val[0]));
+        int16x8_t g = vreinterpretq_s16_u16(vmovl_u8(in.val[1]));
+        int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(in.val[2]));
+
+        int16x8_t us = vmulq_n_s16(b, 112);
+        us = vmlsq_n_s16(us, r, 38);
+        us = vmlsq_n_s16(us, g, 74);
+        vst1_u8(u, vqmovun_s16(vaddq_s16(vrshrq_n_s16(us, 8), c128)));
+
+        int16x8_t vs = vmulq_n_s16(r, 112);
+        vs = vmlsq_n_s16(vs, g, 94);
+        vs = vmlsq_n_s16(vs, b, 18);
+        vst1_u8(v, vqmovun_s16(vaddq_s16(vrshrq_n_s16(vs, 8), c128)));
+
+        y += 8; u += 8; v += 8;
+    }
+#endif
+    for (; x < width; x++)
+    {
+        int R = src[0], G = src[1], B = src[2];
+        src += 3;
+        *y++ = YUV_Y(R, G, B);
+        *u++ = YUV_U(R, G, B);
+        *v++ = YUV_V(R, G, B);
+    }
+}
+
+// RGB24 to 0xAARRGGBB words (little endian BGRA bytes)
+static void row_rgb_to_bgra(const uint8_t *src, uint8_t *dst, int width)
+{
+    int x = 0;
+#ifdef __ARM_NEON__
+    uint8x8x4_t out;
+    out.val[3] = vdup_n_u8(0xFF);
+    for (; x + 8 <= width; x += 8)
+    {
+        uint8x8x3_t in = vld3_u8(src);
+        out.val[0] = in.val[2];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[0];
+        vst4_u8(dst, out);
+        src += 24;
+        dst += 32;
+    }
+#else
+    // 4 pixels from 3 words
+    for (; x + 4 <= width; x += 4)
+    {
+        uint32_t w[3], p[4];
+        memcpy(w, src, sizeof(w));
+        p[0] = 0xFF000000 | ((w[0] & 0xFF) << 16) | (w[0] & 0xFF00) | ((w[0] >> 16) & 0xFF);
+        p[1] = 0xFF000000 | ((w[0] >> 8) & 0xFF0000) | ((w[1] & 0xFF) << 8) | ((w[1] >> 8) & 0xFF);
+        p[2] = 0xFF000000 | (w[1] & 0xFF0000) | ((w[1] >> 16) & 0xFF00) | (w[2] & 0xFF);
+        p[3] = 0xFF000000 | ((w[2] << 8) & 0xFF0000) | ((w[2] >> 8) & 0xFF00) | (w[2] >> 24);
+        memcpy(dst, p, sizeof(p));
+        src += 12;
+        dst += 16;
+    }
+#endif
+    for (; x < width; x++)
+    {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = 0xFF;
+        src += 3;
+        dst += 4;
+    }
+}
+
 int mister_scaler_read_yuv(mister_scaler *ms,int lineY,unsigned char *bufY, int lineU, unsigned char *bufU, int lineV, unsigned char *bufV)
 {
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..
-    unsigned char *pixbuf;
-    unsigned char *outbufy;
-    unsigned char *outbufU;
-    unsigned char *outbufV;
-    for (int  y=0; y< ms->height ; y++)
-	{
-        pixbuf=&buffer[ms->header + y*ms->line];
-        outbufy=&bufY[y*(lineY)];
-        outbufU=&bufU[y*(lineU)];
-        outbufV=&bufV[y*(lineV)];
-        for (int x = 0; x < ms->width ; x++)
-		{
-			int R,G,B;
-			R = *pixbuf++;
-			G = *pixbuf++;
-			B = *pixbuf++;
-			int Y =  (0.257 * R) + (0.504 * G) + (0.098 * B) + 16;
-			int U = -(0.148 * R) - (0.291 * G) + (0.439 * B) + 128;
-			int V =  (0.439 * R) - (0.368 * G) - (0.071 * B) + 128;
-
-			*outbufy++ = Y;
-			*outbufU++ = U;
-			*outbufV++ = V;
-        }
+    for (int y = 0; y < ms->height; y++)
+    {
+        row_rgb_to_yuv(&buffer[ms->header + y*ms->line], &bufY[y*lineY], &bufU[y*lineU], &bufV[y*lineV], ms->width);
     }
 
     return 0;
@@ -112,39 +185,23 @@ int mister_scaler_read(mister_scaler *ms,unsigned char *gbuf)
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
-    for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*3)];
-          for (int x = 0; x < ms->width ; x++) {
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-          }
+    // rows are already RGB24, only the line pitch differs
+    for (int y = 0; y < ms->height; y++)
+    {
+        memcpy(&gbuf[y*(ms->width*3)], &buffer[ms->header + y*ms->line], ms->width*3);
     }
 
     return 0;
 }
 
-int mister_scaler_read_32(mister_scaler *ms, unsigned char *gbuf) {
+int mister_scaler_read_32(mister_scaler *ms, unsigned char *gbuf)
+{
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
-    for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*4)];
-          for (int x = 0; x < ms->width ; x++) {
-            outbuf[2] = *pixbuf++;
-            outbuf[1] = *pixbuf++;
-            outbuf[0] = *pixbuf++;
-            outbuf[3] = 0xFF;
-	    outbuf+=4;
-          }
+    for (int y = 0; y < ms->height; y++)
+    {
+        row_rgb_to_bgra(&buffer[ms->header + y*ms->line], &gbuf[y*(ms->width*4)], ms->width);
     }
 
     return 0;
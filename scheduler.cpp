@@ -1,17 +1,87 @@
 #include "scheduler.h"
 #include <stdio.h>
+#include <time.h>
 #include "libco.h"
 #include "menu.h"
 #include "user_io.h"
 #include "input.h"
 #include "fpga_io.h"
+#include "spi.h"
 #include "osd.h"
 #include "profiling.h"
+#include "latency.h"
+#include "input_latency.h"
+
+// Tasks are scheduled earliest-deadline-first among those whose release
+// time has passed. When nothing is due, the idle flagged tasks (input and
+// core I/O) keep running back to back as before so polling rate is not lost.
+// A task with a pending() hook is released early, with the most urgent
+// deadline, as soon as the hook reports work (input events, timers).
+#define TASK_IDLE 1
+
+struct scheduler_task_t
+{
+	const char *name;
+	const char *overrun_name; // latency histogram of the runs over budget
+	void (*func)(void);
+	uint32_t period_us;
+	uint32_t budget_us;
+	int flags;
+	int (*pending)(void);
+
+	struct
+	{
+		cothread_t co;
+		uint64_t release_us;
+		uint64_t deadline_us;
+
+		bool done;
+		uint32_t runs;
+		uint32_t overruns;
+		uint32_t max_us;
+		latency_hist_t *overrun_hist;
+	} st;
+};
+
+static void scheduler_co_input(void);
+static void scheduler_co_io(void);
+static void scheduler_co_ui(void);
+static void scheduler_co_bg(void);
+
+// Order matters: on equal deadlines the earlier task wins.
+static scheduler_task_t tasks[] =
+{
+	{ "input", "overrun_input", scheduler_co_input, 1000,  500,   TASK_IDLE, input_pending, {} },
+	{ "io",    "overrun_io",    scheduler_co_io,    1000,  1000,  TASK_IDLE, nullptr,       {} },
+	{ "ui",    "overrun_ui",    scheduler_co_ui,    2000,  4000,  0,         nullptr,       {} },
+	{ "bg",    "overrun_bg",    scheduler_co_bg,    10000, 2000,  0,         nullptr,       {} },
+};
+
+#define TASK_COUNT (sizeof(tasks) / sizeof(tasks[0]))
 
 static cothread_t co_scheduler = nullptr;
-static cothread_t co_poll = nullptr;
-static cothread_t co_ui = nullptr;
-static cothread_t co_last = nullptr;
+static scheduler_task_t *task_current = nullptr;
+static uint32_t task_idle_next = 0;
+
+#define MAX_BG_HANDLERS 16
+static void (*bg_handlers[MAX_BG_HANDLERS])(void) = {};
+static uint32_t bg_handler_count = 0;
+
+static uint64_t scheduler_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// End of a task iteration. Plain scheduler_yield() from inside a long
+// operation keeps the task due so it resumes as soon as more urgent
+// tasks are serviced.
+static void scheduler_task_done(void)
+{
+	if (task_current) task_current->st.done = true;
+	co_switch(co_scheduler);
+}
 
 static void scheduler_wait_fpga_ready(void)
 {
@@ -21,7 +91,25 @@ static void scheduler_wait_fpga_ready(void)
 	}
 }
 
-static void scheduler_co_poll(void)
+static void scheduler_co_input(void)
+{
+	for (;;)
+	{
+		scheduler_wait_fpga_ready();
+
+		{
+			SPIKE_SCOPE("co_input", 1000);
+			LATENCY_SCOPE("co_input");
+			input_poll(0);
+			spi_uio_flush();
+			input_latency_flush();
+		}
+
+		scheduler_task_done();
+	}
+}
+
+static void scheduler_co_io(void)
 {
 	for (;;)
 	{
@@ -29,11 +117,11 @@ static void scheduler_co_poll(void)
 
 		{
 			SPIKE_SCOPE("co_poll", 1000);
+			LATENCY_SCOPE("co_poll");
 			user_io_poll();
-			input_poll(0);
 		}
 
-		scheduler_yield();
+		scheduler_task_done();
 	}
 }
 
@@ -43,25 +131,89 @@ static void scheduler_co_ui(void)
 	{
 		{
 			SPIKE_SCOPE("co_ui", 1000);
+			LATENCY_SCOPE("co_ui");
 			HandleUI();
 			OsdUpdate();
 		}
 
-		scheduler_yield();
+		scheduler_task_done();
+	}
+}
+
+static void scheduler_co_bg(void)
+{
+	for (;;)
+	{
+		{
+			SPIKE_SCOPE("co_bg", 1000);
+			LATENCY_SCOPE("co_bg");
+			for (uint32_t i = 0; i < bg_handler_count; i++) bg_handlers[i]();
+		}
+
+		scheduler_task_done();
+	}
+}
+
+static scheduler_task_t *scheduler_pick(uint64_t now)
+{
+	scheduler_task_t *best = nullptr;
+	for (uint32_t i = 0; i < TASK_COUNT; i++)
+	{
+		scheduler_task_t *task = &tasks[i];
+		if (task->st.release_us > now)
+		{
+			if (!task->pending || !task->pending()) continue;
+			task->st.release_us = now;
+			task->st.deadline_us = now;
+		}
+		if (!best || task->st.deadline_us < best->st.deadline_us) best = task;
+	}
+
+	if (!best)
+	{
+		// nothing due, round robin over idle tasks
+		for (uint32_t i = 0; i < TASK_COUNT; i++)
+		{
+			scheduler_task_t *task = &tasks[(task_idle_next + i) % TASK_COUNT];
+			if (task->flags & TASK_IDLE)
+			{
+				task_idle_next = (task - tasks) + 1;
+				best = task;
+				break;
+			}
+		}
 	}
+
+	return best;
 }
 
 static void scheduler_schedule(void)
 {
-	if (co_last == co_poll)
+	uint64_t now = scheduler_time_us();
+	scheduler_task_t *task = scheduler_pick(now);
+	if (!task) return;
+
+	task_current = task;
+	task->st.done = false;
+	co_switch(task->st.co);
+	task_current = nullptr;
+
+	uint64_t end = scheduler_time_us();
+	uint32_t elapsed = (uint32_t)(end - now);
+
+	task->st.runs++;
+	if (elapsed > task->st.max_us) task->st.max_us = elapsed;
+	if (elapsed > task->budget_us)
 	{
-		co_last = co_ui;
-		co_switch(co_ui);
+		task->st.overruns++;
+		latency_record(task->st.overrun_hist, elapsed);
 	}
-	else
+
+	if (task->st.done)
 	{
-		co_last = co_poll;
-		co_switch(co_poll);
+		task->st.release_us += task->period_us;
+		if (task->st.release_us < end) task->st.release_us = end;
+		task->st.deadline_us = task->st.release_us + task->period_us;
 	}
 }
 
@@ -69,8 +221,14 @@ void scheduler_init(void)
 {
 	const unsigned int co_stack_size = 262144 * sizeof(void*);
 
-	co_poll = co_create(co_stack_size, scheduler_co_poll);
-	co_ui = co_create(co_stack_size, scheduler_co_ui);
+	uint64_t now = scheduler_time_us();
+	for (uint32_t i = 0; i < TASK_COUNT; i++)
+	{
+		tasks[i].st.co = co_create(co_stack_size, tasks[i].func);
+		tasks[i].st.release_us = now;
+		tasks[i].st.deadline_us = now + tasks[i].period_us;
+		tasks[i].st.overrun_hist = latency_hist(tasks[i].overrun_name);
+	}
 }
 
 void scheduler_run(void)
@@ -82,12 +240,34 @@ void scheduler_run(void)
 		scheduler_schedule();
 	}
 
-	co_delete(co_ui);
-	co_delete(co_poll);
+	for (uint32_t i = 0; i < TASK_COUNT; i++) co_delete(tasks[i].st.co);
 	co_delete(co_scheduler);
 }
 
+int scheduler_in_task(void)
+{
+	return co_scheduler && task_current;
+}
+
 void scheduler_yield(void)
 {
+	// not running yet, or called from the scheduler itself
+	if (!scheduler_in_task()) return;
 	co_switch(co_scheduler);
 }
+
+void scheduler_print_stats(void)
+{
+	printf("Scheduler tasks:\n");
+	for (uint32_t i = 0; i < TASK_COUNT; i++)
+	{
+		scheduler_task_t *task = &tasks[i];
+		printf("  %-5s: period=%uus budget=%uus runs=%u overruns=%u max=%uus\n",
+			task->name, task->period_us, task->budget_us, task->st.runs, task->st.overruns, task->st.max_us);
+	}
+}
+
+void scheduler_add_background(void (*handler)(void))
+{
+	if (bg_handler_count < MAX_BG_HANDLERS) bg_handlers[bg_handler_count++] = handler;
+}
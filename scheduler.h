@@ -7,4 +7,11 @@ void scheduler_init(void);
 void scheduler_run(void);
 void scheduler_yield(void);
 
+// Non-zero when called from a scheduled task, i.e. scheduler_yield() would switch.
+int scheduler_in_task(void);
+
+// Handler is called periodically from the low priority background task.
+void scheduler_add_background(void (*handler)(void));
+void scheduler_print_stats(void);
+
 #endif
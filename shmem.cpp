@@ -6,20 +6,48 @@
 #include <signal.h>
 #include <ctype.h>
 #include <termios.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include "shmem.h"
+#include "fpga_sim.h"
+
+// FPGA DDR is mapped in aligned windows which stay mapped after the last
+// unmap, so loaders mapping chunk by chunk hit an existing window instead
+// of doing mmap/munmap (and TLB shootdowns) every time.
+#define WIN_START     0x20000000
+#define WIN_END       0x40000000
+#define WIN_SIZE      (32 * 1024 * 1024)
+#define WIN_MAX_SPAN  (128 * 1024 * 1024) // larger requests get their own mapping
+#define WIN_MAX       8
+#define WIN_BUDGET    (256 * 1024 * 1024) // address space kept by unused windows
+
+struct shmem_window_t
+{
+	uint32_t address;
+	uint32_t size;
+	uint8_t *base;
+	int refs;
+};
 
 static int memfd = -1;
+static pthread_mutex_t win_lock = PTHREAD_MUTEX_INITIALIZER;
+static shmem_window_t windows[WIN_MAX];
+static int win_count = 0; // most recent first
+static shmem_stats_t stats = {};
 
-void *shmem_map(uint32_t address, uint32_t size)
+static int shmem_open()
 {
 	if (memfd < 0)
 	{
+#ifdef FPGA_SIM
+		memfd = fpga_sim_memfd();
+#else
 		memfd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+#endif
 		if (memfd == -1)
 		{
 			printf("Error: Unable to open /dev/mem!\n");
@@ -27,6 +55,13 @@ void *shmem_map(uint32_t address, uint32_t size)
 		}
 	}
 
+	return 1;
+}
+
+static void *mmap_raw(uint32_t address, uint32_t size)
+{
+	if (!shmem_open()) return 0;
+
 	void *res = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, address);
 	if (res == (void *)-1)
 	{
@@ -37,11 +72,114 @@ void *shmem_map(uint32_t address, uint32_t size)
 	return res;
 }
 
+static void win_touch(int i)
+{
+	shmem_window_t w = windows[i];
+	memmove(windows + 1, windows, i * sizeof(shmem_window_t));
+	windows[0] = w;
+}
+
+// Drops unused windows from the tail until the rest fits the budget and
+// one slot is free.
+static void win_trim(int need_slot)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < win_count; i++) total += windows[i].size;
+
+	for (int i = win_count - 1; i >= 0; i--)
+	{
+		if (total <= WIN_BUDGET && (!need_slot || win_count < WIN_MAX)) break;
+		if (windows[i].refs) continue;
+
+		munmap(windows[i].base, windows[i].size);
+		stats.munmaps++;
+		total -= windows[i].size;
+		memmove(windows + i, windows + i + 1, (win_count - i - 1) * sizeof(shmem_window_t));
+		win_count--;
+	}
+}
+
+static void *win_get(uint32_t address, uint32_t size)
+{
+	for (int i = 0; i < win_count; i++)
+	{
+		shmem_window_t *w = &windows[i];
+		if (address >= w->address && address + size <= w->address + w->size)
+		{
+			w->refs++;
+			stats.hits++;
+			uint8_t *res = w->base + (address - w->address);
+			win_touch(i);
+			return res;
+		}
+	}
+
+	uint32_t start = address & ~(WIN_SIZE - 1);
+	uint64_t end = ((uint64_t)address + size + WIN_SIZE - 1) & ~(uint64_t)(WIN_SIZE - 1);
+	if (end > WIN_END) end = WIN_END;
+
+	win_trim(1);
+	if (win_count >= WIN_MAX) return 0;
+
+	uint8_t *base = (uint8_t*)mmap_raw(start, (uint32_t)(end - start));
+	if (!base) return 0;
+	stats.mmaps++;
+
+	memmove(windows + 1, windows, win_count * sizeof(shmem_window_t));
+	win_count++;
+	windows[0].address = start;
+	windows[0].size = (uint32_t)(end - start);
+	windows[0].base = base;
+	windows[0].refs = 1;
+	return base + (address - start);
+}
+
+void *shmem_map(uint32_t address, uint32_t size)
+{
+	if (!size) size = 1;
+
+	if (address >= WIN_START && (uint64_t)address + size <= WIN_END && size <= WIN_MAX_SPAN)
+	{
+		if (!shmem_open()) return 0;
+
+		pthread_mutex_lock(&win_lock);
+		void *res = win_get(address, size);
+		pthread_mutex_unlock(&win_lock);
+		if (res) return res;
+	}
+
+	void *res = mmap_raw(address, size);
+	if (res)
+	{
+		pthread_mutex_lock(&win_lock);
+		stats.mmaps++;
+		pthread_mutex_unlock(&win_lock);
+	}
+	return res;
+}
+
 int shmem_unmap(void* map, uint32_t size)
 {
+	pthread_mutex_lock(&win_lock);
+	for (int i = 0; i < win_count; i++)
+	{
+		shmem_window_t *w = &windows[i];
+		if ((uint8_t*)map >= w->base && (uint8_t*)map < w->base + w->size)
+		{
+			if (w->refs > 0) w->refs--;
+			win_trim(0);
+			pthread_mutex_unlock(&win_lock);
+			return 1;
+		}
+	}
+
+	stats.munmaps++;
+	pthread_mutex_unlock(&win_lock);
+
+	if (!size) size = 1;
 	if (munmap(map, size) < 0)
 	{
-		printf("Error: Unable to unmap(0x%X, %d)!\n", (uint32_t)map, size);
+		printf("Error: Unable to unmap(%p, %u)!\n", map, size);
 		return 0;
 	}
 
@@ -71,3 +209,61 @@ int shmem_get(uint32_t address, uint32_t size, void *buf)
 
 	return shmem != 0;
 }
+
+int shmem_set(uint32_t address, uint8_t value, uint32_t size)
+{
+	void *shmem = shmem_map(address, size);
+	if (shmem)
+	{
+		memset(shmem, value, size);
+		shmem_unmap(shmem, size);
+	}
+
+	return shmem != 0;
+}
+
+int shmem_batch(const shmem_op_t *ops, int count)
+{
+	int done = 0;
+	void *shmem = 0;
+	uint32_t start = 0, size = 0;
+
+	// neighbouring ops mostly share one view
+	for (int i = 0; i < count; i++)
+	{
+		const shmem_op_t *op = &ops[i];
+		if (!shmem || op->address < start || (uint64_t)op->address + op->size > (uint64_t)start + size)
+		{
+			if (shmem) shmem_unmap(shmem, size);
+
+			start = op->address;
+			size = op->size;
+			for (int j = i + 1; j < count && ops[j].address >= start && ops[j].address - start < WIN_SIZE; j++)
+			{
+				uint32_t end = ops[j].address + ops[j].size - start;
+				if (end > size && end <= WIN_SIZE) size = end;
+			}
+
+			shmem = shmem_map(start, size);
+			if (!shmem) break;
+		}
+
+		uint8_t *dst = (uint8_t*)shmem + (op->address - start);
+		if (op->src) memcpy(dst, op->src, op->size);
+		else memset(dst, op->fill, op->size);
+		done++;
+	}
+
+	if (shmem) shmem_unmap(shmem, size);
+	return done == count;
+}
+
+void shmem_get_stats(shmem_stats_t *out)
+{
+	pthread_mutex_lock(&win_lock);
+	*out = stats;
+	out->windows = win_count;
+	out->mapped = 0;
+	for (int i = 0; i < win_count; i++) out->mapped += windows[i].size;
+	pthread_mutex_unlock(&win_lock);
+}
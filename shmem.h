@@ -4,10 +4,36 @@
 #ifndef SHMEM_H
 #define SHMEM_H
 
+// Ranges within the FPGA DDR (0x20000000-0x3FFFFFFF) are views into
+// long-lived windows, map/unmap of those only counts references. Other
+// ranges are mapped and unmapped on every call as before.
 void *shmem_map(uint32_t address, uint32_t size);
 int shmem_unmap(void* map, uint32_t size);
 int shmem_put(uint32_t address, uint32_t size, void *buf);
 int shmem_get(uint32_t address, uint32_t size, void *buf);
+int shmem_set(uint32_t address, uint8_t value, uint32_t size);
+
+// Copy (src set) or fill of one range, applied in order by shmem_batch().
+struct shmem_op_t
+{
+	uint32_t address;
+	uint32_t size;
+	const void *src;
+	uint8_t fill;
+};
+
+int shmem_batch(const shmem_op_t *ops, int count);
+
+struct shmem_stats_t
+{
+	uint64_t mmaps;
+	uint64_t munmaps;
+	uint64_t hits;
+	uint32_t windows;
+	uint32_t mapped;
+};
+
+void shmem_get_stats(shmem_stats_t *stats);
 
 #define fpga_mem(x) (0x20000000 | ((x) & 0x1FFFFFFF))
 #endif
@@ -1,6 +1,10 @@
+#include <stdio.h>
+#include <string.h>
+
 #include "spi.h"
 #include "hardware.h"
 #include "fpga_io.h"
+#include "latency.h"
 
 #define SSPI_FPGA_EN (1<<18)
 #define SSPI_OSD_EN  (1<<19)
@@ -42,8 +46,13 @@ void DisableOsd()
 	fpga_spi_en(SSPI_OSD_EN | SSPI_IO_EN | SSPI_FPGA_EN, 0);
 }
 
+static int uio_queue_len = 0;
+static void uio_send_queue();
+
 void EnableIO()
 {
+	// keep the order of queued and direct commands
+	if (uio_queue_len) uio_send_queue();
 	fpga_spi_en(SSPI_IO_EN, 1);
 }
 
@@ -203,3 +212,104 @@ void spi_block_write(const uint8_t *addr, int wide, int sz)
 	if (wide) fpga_spi_fast_block_write((const uint16_t*)addr, sz/2);
 	else fpga_spi_fast_block_write_8(addr, sz);
 }
+
+#define UIO_QUEUE_SIZE  32
+#define UIO_QUEUE_WORDS 6
+
+struct uio_queued_t
+{
+	uint32_t key;
+	int cnt;
+	uint16_t words[UIO_QUEUE_WORDS];
+};
+
+static uio_queued_t uio_queue[UIO_QUEUE_SIZE];
+
+static struct
+{
+	uint64_t polls;
+	uint64_t queued;
+	uint64_t coalesced;
+	uint64_t sent;
+	uint32_t flush_max_us;
+	fpga_spi_stats_t base;
+} uio_stats = {};
+
+void spi_uio_queue(uint32_t key, const uint16_t *words, int cnt)
+{
+	if (cnt <= 0) return;
+	if (cnt > UIO_QUEUE_WORDS)
+	{
+		EnableIO();
+		while (cnt--) spi_w(*words++);
+		DisableIO();
+		return;
+	}
+
+	uio_stats.queued++;
+
+	if (key)
+	{
+		for (int i = 0; i < uio_queue_len; i++)
+		{
+			if (uio_queue[i].key != key) continue;
+
+			// older state is obsolete, the new one goes to the end
+			memmove(&uio_queue[i], &uio_queue[i + 1], (uio_queue_len - i - 1) * sizeof(uio_queued_t));
+			uio_queue_len--;
+			uio_stats.coalesced++;
+			break;
+		}
+	}
+
+	if (uio_queue_len >= UIO_QUEUE_SIZE) uio_send_queue();
+
+	uio_queued_t *q = &uio_queue[uio_queue_len++];
+	q->key = key;
+	q->cnt = cnt;
+	memcpy(q->words, words, cnt * sizeof(uint16_t));
+}
+
+static void uio_send_queue()
+{
+	uint64_t start = latency_now_us();
+
+	// every command needs its own CS window, the core decodes the first word as command
+	for (int i = 0; i < uio_queue_len; i++)
+	{
+		fpga_spi_en(SSPI_IO_EN, 1);
+		for (int n = 0; n < uio_queue[i].cnt; n++) fpga_spi(uio_queue[i].words[n]);
+		fpga_spi_en(SSPI_IO_EN, 0);
+	}
+
+	uio_stats.sent += uio_queue_len;
+	uio_queue_len = 0;
+
+	uint32_t us = (uint32_t)(latency_now_us() - start);
+	if (us > uio_stats.flush_max_us) uio_stats.flush_max_us = us;
+}
+
+void spi_uio_flush()
+{
+	uio_stats.polls++;
+	if (uio_queue_len) uio_send_queue();
+}
+
+void spi_print_stats()
+{
+	fpga_spi_stats_t *b = &uio_stats.base;
+	uint64_t polls = uio_stats.polls ? uio_stats.polls : 1;
+	uint64_t words = fpga_spi_stats.words - b->words;
+	uint64_t cs = fpga_spi_stats.cs_toggles - b->cs_toggles;
+	uint64_t wr = fpga_spi_stats.gpo_writes - b->gpo_writes;
+	uint64_t rd = fpga_spi_stats.gpi_reads - b->gpi_reads;
+
+	printf("SPI: %llu polls since last report\n", (unsigned long long)uio_stats.polls);
+	printf("  per poll: words=%.2f cs=%.2f gpo_wr=%.2f gpi_rd=%.2f mmio=%.2f\n",
+		(double)words / polls, (double)cs / polls, (double)wr / polls, (double)rd / polls, (double)(wr + rd) / polls);
+	printf("  uio queue: queued=%llu coalesced=%llu sent=%llu flush_max=%uus\n",
+		(unsigned long long)uio_stats.queued, (unsigned long long)uio_stats.coalesced, (unsigned long long)uio_stats.sent, uio_stats.flush_max_us);
+
+	memset(&uio_stats, 0, sizeof(uio_stats));
+	uio_stats.base = fpga_spi_stats;
+}
@@ -60,4 +60,14 @@ uint16_t spi_uio_cmd16(uint8_t cmd, uint16_t parm);
 void spi_uio_cmd32(uint8_t cmd, uint32_t parm, int wide);
 void spi_uio_cmd32_cont(uint8_t cmd, uint32_t parm);
 
+/* Deferred user_io commands. Write only commands from the input path are
+   collected and sent once per poll cycle by spi_uio_flush(). A non-zero key
+   replaces the queued command with the same key, so only the latest state
+   of a joystick goes out. Any direct user_io access flushes the queue first. */
+#define UIO_QUEUE_KEY(cmd, sub) (0x10000 | (((uint32_t)(cmd) & 0xFF) << 8) | ((sub) & 0xFF))
+
+void spi_uio_queue(uint32_t key, const uint16_t *words, int cnt);
+void spi_uio_flush();
+void spi_print_stats();
+
 #endif // SPI_H
@@ -17,6 +17,7 @@
 #include "../../cheats.h"
 
 #include "buffer.h"
+#include "romstage.h"
 #include "mra_loader.h"
 
 #define kBigTextSize 1024
@@ -404,7 +405,7 @@ unsigned char* hexstr_to_char(const char* hexstr, size_t *out_len)
 	size_t len = strlen(hexstr);
 	unsigned char* chrs = (unsigned char*)malloc(len + 1);
 	if (!chrs)
-		printf("hexstr_to_char: malloc failed len+1=%d\n",len+1);
+		printf("hexstr_to_char: malloc failed len+1=%d\n", (int)(len + 1));
 	int dest = 0;
 	// point to the beginning of the array
 	const char *ptr = hexstr;
@@ -890,6 +891,31 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 				char *zipptr = zipnames_list;
 				const char *root = get_arcade_root(0);
 				int result = 0;
+
+				uint32_t staged_size = 0;
+				const char *staged_zip = 0;
+				const uint8_t *staged = romstage_get(zipnames_list, arc_info->partname, crc32, &staged_size, &staged_zip);
+				if (staged)
+				{
+					snprintf(fname, sizeof(fname), "%s/%s", staged_zip, arc_info->partname);
+					if(unitlen>1) printf("file: %s, start=%d, len=%d, map(%d)=%X\n", fname, start, length, unitlen, arc_info->imap);
+					else printf("file: %s, start=%d, len=%d\n", fname, start, length);
+
+					uint32_t len = ((uint32_t)start < staged_size) ? staged_size - start : 0;
+					if (length > 0 && (uint32_t)length < len) len = length;
+
+					result = 1;
+					for (int i = 0; i < repeat && result; i++)
+					{
+						for (uint32_t pos = 0; pos < len && result; pos += BLKL)
+						{
+							result = rom_data(staged + start + pos, (len - pos > BLKL) ? BLKL : len - pos, arc_info->imap, &arc_info->context);
+						}
+					}
+					romstage_put(zipnames_list, arc_info->partname, crc32);
+					zipptr = NULL;
+				}
+
 				while ((zipname = strsep(&zipptr, "|")) != NULL)
 				{
 					sprintf(fname, (zipname[0] == '/') ? "%s%s/%s" : "%s/mame/%s/%s", root, zipname, arc_info->partname);
@@ -1003,6 +1029,84 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 	return true;
 }
 
+/*
+ *  xml_stage_parts
+ *
+ *  First pass over the MRA: hands every file part to romstage so the files
+ *  are extracted in the background while xml_send_rom assembles the roms.
+ *  xml_send_rom skips further rom 0 entries once one passes its md5, so
+ *  only rom 0 entries up to the first one with an md5 and all files
+ *  present are staged. If that one fails the md5 check, the next reads
+ *  directly.
+ * */
+static int xml_stage_parts(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	(void)(text);
+	(void)(n);
+	static char zipname[kBigTextSize];
+	static int insiderom = 0;
+	static int romindex = 0;
+	static int found = 0;
+	static int md5 = 0;
+	static int haverom0 = 0;
+
+	switch (evt)
+	{
+	case XML_EVENT_START_DOC:
+		insiderom = 0;
+		haverom0 = 0;
+		break;
+
+	case XML_EVENT_START_NODE:
+		if (!strcasecmp(node->tag, "rom"))
+		{
+			insiderom = 1;
+			romindex = 0;
+			found = 1;
+			md5 = 0;
+			zipname[0] = 0;
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "zip")) strcpyz(zipname, node->attributes[i].value);
+				if (!strcasecmp(node->attributes[i].name, "index")) romindex = atoi(node->attributes[i].value);
+				if (!strcasecmp(node->attributes[i].name, "md5")) md5 = strlen(node->attributes[i].value) && strcasecmp(node->attributes[i].value, "none");
+			}
+
+			if (romindex == 0 && haverom0) insiderom = 0;
+		}
+
+		if (insiderom && !strcasecmp(node->tag, "part"))
+		{
+			const char *zips = zipname;
+			const char *name = "";
+			uint32_t crc = 0;
+
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "zip")) zips = node->attributes[i].value;
+				if (!strcasecmp(node->attributes[i].name, "name")) name = node->attributes[i].value;
+				if (!strcasecmp(node->attributes[i].name, "crc")) crc = strtoul(node->attributes[i].value, NULL, 16);
+			}
+
+			if (strlen(name) && !romstage_add((const char *)sd->user, zips, name, crc)) found = 0;
+		}
+		break;
+
+	case XML_EVENT_END_NODE:
+		if (!strcasecmp(node->tag, "rom"))
+		{
+			if (insiderom && romindex == 0 && found && md5) haverom0 = 1;
+			insiderom = 0;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
 static int xml_scan_rbf(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
 {
 	static int insiderbf = 0;
@@ -1149,6 +1253,12 @@ int arcade_send_rom(const char *xml)
 
 	set_arcade_root(xml);
 
+	// resolve the parts and start extracting them
+	sax.all_event = xml_stage_parts;
+	XMLDoc_parse_file_SAX(xml, &sax, (void *)get_arcade_root(0));
+	romstage_start();
+	sax.all_event = xml_send_rom;
+
 	// create the structure we use for the XML parser
 	struct arc_struct arc_info;
 	arc_info.data = buffer_init(kBigTextSize);
@@ -1160,6 +1270,7 @@ int arcade_send_rom(const char *xml)
 
 	// parse
 	XMLDoc_parse_file_SAX(xml, &sax, &arc_info);
+	romstage_clear();
 	if (arc_info.validrom0 == 0 && strlen(arc_info.error_msg))
 	{
 		strcpy(arcade_error_msg, arc_info.error_msg);
@@ -0,0 +1,217 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "../../file_io.h"
+#include "../../zip_cache.h"
+#include "../../offload.h"
+
+#include "romstage.h"
+
+// Extracted bytes allowed ahead of the assembly. A part that is needed
+// but not started yet is always started, so this only limits prefetch.
+#define STAGE_BUDGET (96 * 1024 * 1024)
+
+struct stage_entry
+{
+	std::string zip_path;
+	int index;
+	uint32_t size;
+
+	int uses;
+	bool started;
+	bool ok;
+	uint8_t *data;
+	offload_handle_t job;
+};
+
+static std::vector<stage_entry*> entries;
+static std::unordered_map<std::string, stage_entry*> by_key;
+static uint32_t next_start = 0;
+static uint64_t resident = 0;
+
+static std::string stage_key(const char *zips, const char *name, uint32_t crc)
+{
+	char crcstr[16];
+	sprintf(crcstr, "|%08X|", crc);
+	return std::string(zips) + crcstr + name;
+}
+
+// Same lookup as rom_file(): first zip of the list that holds the file,
+// by crc first, then by name.
+static stage_entry *stage_resolve(const char *root, const char *zips, const char *name, uint32_t crc)
+{
+	char list[1024];
+	snprintf(list, sizeof(list), "%s", zips);
+
+	char *zipname;
+	char *zipptr = list;
+	while ((zipname = strsep(&zipptr, "|")) != NULL)
+	{
+		char fname[2048 + 16];
+		snprintf(fname, sizeof(fname), (zipname[0] == '/') ? "%s%s/%s" : "%s/mame/%s/%s", root, zipname, name);
+
+		char *z = strcasestr(fname, ".zip");
+		if (!z || (z[4] && z[4] != '/')) continue;
+
+		// same absolute path the direct read opens, so zip_cache keys match
+		*z = 0;
+		std::string zip_path = std::string(getFullPath(fname)) + ".zip";
+		*z = '.';
+
+		auto idx = zip_index_get(zip_path.c_str());
+		if (!idx) continue;
+
+		int index = crc ? idx->find_crc(crc) : -1;
+		if (index < 0 && z[4]) index = idx->locate(z + 5);
+		if (index < 0) continue;
+
+		if (idx->entries[index].size >= 0x80000000ULL) return NULL;
+
+		stage_entry *e = new stage_entry();
+		e->zip_path = zip_path;
+		e->index = index;
+		e->size = (uint32_t)idx->entries[index].size;
+		return e;
+	}
+
+	return NULL;
+}
+
+static void stage_extract(stage_entry *e)
+{
+	mz_zip_archive *zip = zip_archive_get(e->zip_path.c_str());
+	if (!zip) return;
+
+	e->data = (uint8_t*)malloc(e->size ? e->size : 1);
+	if (e->data && mz_zip_reader_extract_to_mem(zip, e->index, e->data, e->size, 0)) e->ok = true;
+	zip_archive_put(zip);
+}
+
+static void stage_start(stage_entry *e)
+{
+	e->started = true;
+	resident += e->size;
+	e->job = offload_add_work([e] { stage_extract(e); });
+}
+
+static void stage_fill()
+{
+	while (next_start < entries.size())
+	{
+		stage_entry *e = entries[next_start];
+		if (!e->started)
+		{
+			if (resident && resident + e->size > STAGE_BUDGET) break;
+			stage_start(e);
+		}
+		next_start++;
+	}
+}
+
+static void stage_free(stage_entry *e)
+{
+	if (e->started)
+	{
+		offload_wait(e->job);
+		resident -= e->size;
+	}
+
+	free(e->data);
+	e->data = 0;
+	e->ok = false;
+}
+
+bool romstage_add(const char *root, const char *zips, const char *name, uint32_t crc)
+{
+	std::string key = stage_key(zips, name, crc);
+	auto it = by_key.find(key);
+	if (it != by_key.end())
+	{
+		if (it->second) it->second->uses++;
+		return it->second != NULL;
+	}
+
+	stage_entry *e = stage_resolve(root, zips, name, crc);
+	by_key[key] = e;
+	if (!e) return false;
+
+	// several parts of one file can also be listed under different zips
+	for (auto old : entries)
+	{
+		if (old->zip_path == e->zip_path && old->index == e->index)
+		{
+			by_key[key] = old;
+			old->uses++;
+			delete e;
+			return true;
+		}
+	}
+
+	e->uses = 1;
+	entries.push_back(e);
+	return true;
+}
+
+void romstage_start()
+{
+	uint64_t total = 0;
+	for (auto e : entries) total += e->size;
+	printf("romstage: %u files, %llu KB to extract\n", (uint32_t)entries.size(), (unsigned long long)(total / 1024));
+
+	stage_fill();
+}
+
+const uint8_t *romstage_get(const char *zips, const char *name, uint32_t crc, uint32_t *size, const char **zip_path)
+{
+	auto it = by_key.find(stage_key(zips, name, crc));
+	if (it == by_key.end() || !it->second) return NULL;
+
+	stage_entry *e = it->second;
+	if (!e->uses) return NULL;
+
+	if (!e->started) stage_start(e);
+	offload_wait(e->job);
+	if (!e->ok)
+	{
+		// the caller reads it directly and won't put it, give back the budget
+		e->uses = 0;
+		stage_free(e);
+		stage_fill();
+		return NULL;
+	}
+
+	*size = e->size;
+	*zip_path = e->zip_path.c_str();
+	return e->data;
+}
+
+void romstage_put(const char *zips, const char *name, uint32_t crc)
+{
+	auto it = by_key.find(stage_key(zips, name, crc));
+	if (it == by_key.end() || !it->second) return;
+
+	stage_entry *e = it->second;
+	if (e->uses && !--e->uses)
+	{
+		stage_free(e);
+		stage_fill();
+	}
+}
+
+void romstage_clear()
+{
+	for (auto e : entries)
+	{
+		stage_free(e);
+		delete e;
+	}
+
+	entries.clear();
+	by_key.clear();
+	next_start = 0;
+	resident = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef ROMSTAGE_H_
+#define ROMSTAGE_H_
+
+#include <inttypes.h>
+
+// Files referenced by MRA parts are resolved up front and extracted on
+// offload workers, ahead of the serial ROM assembly. Parts naming the same
+// file (interleaves, repeats, merged sets) share one extraction.
+//
+// zips is the "|" separated list of the part, name and crc as in the MRA.
+// All calls are from the main thread.
+
+// Returns false if the file isn't found in any of the zips.
+bool romstage_add(const char *root, const char *zips, const char *name, uint32_t crc);
+void romstage_start();
+
+// Waits for the extraction. Returns null if the file couldn't be staged,
+// the caller then falls back to reading it directly and doesn't put it.
+// zip_path is the archive the file was found in.
+const uint8_t *romstage_get(const char *zips, const char *name, uint32_t crc, uint32_t *size, const char **zip_path);
+
+// Part is assembled, buffer is freed after its last user.
+void romstage_put(const char *zips, const char *name, uint32_t crc);
+
+void romstage_clear();
+
+#endif
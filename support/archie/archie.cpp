@@ -11,6 +11,7 @@
 #include "../../support.h"
 #include "../../ide.h"
 #include "archie.h"
+#include "../../latency.h"
 
 #define CONFIG_FILENAME  "ARCHIE.CFG"
 
@@ -469,6 +470,7 @@ static void check_reset()
 
 void archie_poll(void)
 {
+	LATENCY_FUNCTION();
 	EnableFpga();
 	uint16_t status = spi_w(0);
 	DisableFpga();
@@ -14,6 +14,7 @@
 #include "cdi.h"
 #include "../../cd.h"
 #include "../chd/mister_chd.h"
+#include "../../latency.h"
 #include <libchdr/chd.h>
 #include <arpa/inet.h>
 
@@ -56,52 +57,14 @@ struct toc_entry
 static std::array<struct toc_entry, 200> toc_buffer;
 uint32_t toc_entry_count = 0;
 
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
-
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if (*instr == 10)
-			instr++;
-		*in = instr;
-	} while (!*out && **in);
-
-	return *out;
-}
 
 static void unload_chd(toc_t *table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf)
-		free(chd_hunkbuf);
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 }
 
 static void unload_cue(toc_t *table)
@@ -135,9 +98,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end += 150;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -165,7 +125,7 @@ static int load_cue(const char *filename, toc_t *table)
 	int index1 = 0;
 
 	char *buf = toc;
-	while (sgets(line, sizeof(line), &buf))
+	while (cd_sgets(line, sizeof(line), &buf))
 	{
 		lptr = line;
 		while (*lptr == 0x20)
@@ -592,10 +552,7 @@ const uint8_t s_sector_scramble[] =
 
 void descramble_sector(uint8_t *buffer)
 {
-	for (uint32_t i = 12; i < CD_SECTOR_LEN; i++)
-	{
-		buffer[i] ^= s_sector_scramble[i - 12];
-	}
+	cd_xor(buffer + 12, s_sector_scramble, CD_SECTOR_LEN - 12);
 }
 
 static inline uint32_t unBCD(uint32_t val)
@@ -747,82 +704,47 @@ void cdi_read_cd(uint8_t *buffer, int lba, int cnt)
 	printf("req lba=%d, cnt=%d   %02d:%02d:%02d   %d %d\n", lba, cnt, am, as, af,
 		   toc.tracks[0].start, toc.tracks[0].pregap);
 
+	const int stride = CD_SECTOR_LEN + sizeof(struct subcode);
+
 	while (cnt > 0)
 	{
+		int run = 1;
 		if (lba < 0 || !toc.last)
 		{
 			memset(buffer, 0, CD_SECTOR_LEN);
 		}
 		else
 		{
-			memset(buffer, 0xAA, CD_SECTOR_LEN);
+			int i = 0;
+			while (i < toc.last && !(lba >= (toc.tracks[i].start - toc.tracks[i].pregap) && lba <= toc.tracks[i].end)) i++;
 
-			for (int i = 0; i < toc.last; i++)
+			if (i >= toc.last)
 			{
-				if (lba >= (toc.tracks[i].start - toc.tracks[i].pregap) && lba <= toc.tracks[i].end)
+				memset(buffer, 0xAA, CD_SECTOR_LEN);
+			}
+			else
+			{
+				run = toc.tracks[i].end - lba + 1;
+				if (run > cnt) run = cnt;
+
+				// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
+				int pos = toc.chd_f ? (lba - 150 + toc.tracks[i].offset) : (lba - toc.tracks[i].start + toc.tracks[i].pregap);
+				if (cd_read_sectors(&toc, i, pos, run, buffer, stride) != run)
+				{
+					printf("\x1b[32mCDI: read error: %d\n\x1b[0m", lba);
+				}
+
+				for (int n = 0; n < run; n++)
 				{
-					if (!toc.chd_f)
-					{
-						if (toc.tracks[i].offset)
-						{
-							FileSeek(&toc.tracks[0].f, toc.tracks[i].offset + ((lba - toc.tracks[i].start + toc.tracks[i].pregap) * CD_SECTOR_LEN), SEEK_SET);
-						}
-						else
-						{
-							FileSeek(&toc.tracks[i].f, (lba - toc.tracks[i].start + toc.tracks[i].pregap) * CD_SECTOR_LEN, SEEK_SET);
-						}
-					}
-
-					while (cnt)
-					{
-						if (toc.chd_f)
-						{
-							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
-							int read_lba = lba - 150;
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
-							{
-								if (!toc.tracks[i].type) // CHD requires byteswap of audio data
-								{
-									for (int swapidx = 0; swapidx < CD_SECTOR_LEN; swapidx += 2)
-									{
-										uint8_t temp = buffer[swapidx];
-										buffer[swapidx] = buffer[swapidx + 1];
-										buffer[swapidx + 1] = temp;
-									}
-								}
-							}
-							else
-							{
-								printf("\x1b[32mCDI: CHD read error: %d\n\x1b[0m", lba);
-							}
-						}
-						else
-						{
-							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CD_SECTOR_LEN);
-							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CD_SECTOR_LEN);
-						}
-						if ((lba + 1) > toc.tracks[i].end)
-							break;
-
-						check_scramble(lba, buffer);
-						buffer += CD_SECTOR_LEN;
-						subcode_data(lba, *reinterpret_cast<struct subcode *>(buffer));
-						buffer += sizeof(struct subcode);
-						cnt--;
-						lba++;
-					}
-					break;
+					if (lba + n < toc.tracks[i].end) check_scramble(lba + n, buffer + n * stride);
 				}
 			}
 		}
 
-		buffer += CD_SECTOR_LEN;
-		subcode_data(lba, *reinterpret_cast<struct subcode *>(buffer));
-		buffer += sizeof(struct subcode);
-		cnt--;
-		lba++;
+		for (int n = 0; n < run; n++) subcode_data(lba + n, *reinterpret_cast<struct subcode *>(buffer + n * stride + CD_SECTOR_LEN));
+		buffer += run * stride;
+		cnt -= run;
+		lba += run;
 	}
 }
 
@@ -888,4 +810,5 @@ void cdi_mount_cd(int s_index, const char *filename)
 
 void cdi_poll()
 {
+	LATENCY_FUNCTION();
 }
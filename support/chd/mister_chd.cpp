@@ -5,10 +5,15 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "../../file_io.h"
 #include "../../cd.h"
+#include "../../offload.h"
 #include "mister_chd.h"
 
+static void reader_create(chd_file *chd_f);
+
 void lba_to_hunkinfo(chd_file *chd_f, int lba, int *hunknumber, int *hunkoffset)
 {
 	const chd_header *chd_header = chd_get_header(chd_f);
@@ -157,30 +162,294 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 		mister_chd_log("Track %d: Type: %s PreGap: %d PreGapType: %s Frames: %d start: %d end %d\n", cd_toc->last, track_type, pregap, pgtype, frames, cd_toc->tracks[cd_toc->last].start, cd_toc->tracks[cd_toc->last].end);
 
 	}
+
+	reader_create(cd_toc->chd_f);
 	return CHDERR_NONE;
 }
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum)
+// Shared hunk cache, one per open CHD. Hunks are kept in a small LRU and
+// sequential access triggers decompression of the following hunks on a
+// background worker, so the core's poll loop normally only does a memcpy.
+
+#define CHD_CACHE_HUNKS    8
+#define CHD_READAHEAD      2
+#define CHD_MAX_READERS    8
+
+struct chd_slot_t
 {
+	int hunk;
+	uint32_t stamp;
+	bool prefetched;
+	uint8_t *buf;
+};
 
-	int tmphnum = 0;
-	int hunkofs = 0;
+struct chd_reader_t
+{
+	chd_file *chd_f;
+	uint32_t hunkbytes;
+	uint32_t sectors_per_hunk;
+	uint32_t hunkcount;
 
-	lba_to_hunkinfo(chd_f, lba, &tmphnum, &hunkofs);
+	pthread_mutex_t cache_lock; // slots
+	pthread_mutex_t io_lock;    // chd_read() is not reentrant
 
+	chd_slot_t slots[CHD_CACHE_HUNKS];
+	uint32_t clock;
+	int last_hunk;
 
-	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
-	if (tmphnum != *hunknum)
+	uint8_t *rd_buf; // main thread scratch
+	uint8_t *ra_buf; // read-ahead scratch
+	offload_handle_t ra_handle;
+
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t ra_done;
+	uint32_t ra_hits;
+};
+
+static chd_reader_t *readers[CHD_MAX_READERS] = {};
+
+// used when all readers are taken
+static uint8_t *hunkbuf = NULL;
+static uint32_t hunkbuf_size = 0;
+static chd_file *hunk_chd = NULL;
+static int hunk_last = -1;
+
+static chd_reader_t *find_reader(chd_file *chd_f)
+{
+	for (int i = 0; i < CHD_MAX_READERS; i++)
+	{
+		if (readers[i] && readers[i]->chd_f == chd_f) return readers[i];
+	}
+	return NULL;
+}
+
+static void reader_create(chd_file *chd_f)
+{
+	const chd_header *chd_header = chd_get_header(chd_f);
+
+	int idx = 0;
+	while (idx < CHD_MAX_READERS && readers[idx]) idx++;
+	if (idx >= CHD_MAX_READERS)
+	{
+		mister_chd_log("No free CHD reader, cache disabled.\n");
+		return;
+	}
+
+	chd_reader_t *r = new chd_reader_t();
+	r->chd_f = chd_f;
+	r->hunkbytes = chd_header->hunkbytes;
+	r->sectors_per_hunk = chd_header->hunkbytes / chd_header->unitbytes;
+	r->hunkcount = chd_header->totalhunks;
+	r->last_hunk = -1;
+	pthread_mutex_init(&r->cache_lock, NULL);
+	pthread_mutex_init(&r->io_lock, NULL);
+
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++)
+	{
+		r->slots[i].hunk = -1;
+		r->slots[i].buf = (uint8_t *)malloc(r->hunkbytes);
+	}
+	r->rd_buf = (uint8_t *)malloc(r->hunkbytes);
+	r->ra_buf = (uint8_t *)malloc(r->hunkbytes);
+
+	readers[idx] = r;
+}
+
+static void reader_destroy(chd_reader_t *r)
+{
+	offload_wait(r->ra_handle);
+
+	mister_chd_log("CHD cache: hits %u, misses %u, read-ahead %u (%u used)\n", r->hits, r->misses, r->ra_done, r->ra_hits);
+
+	for (int i = 0; i < CHD_MAX_READERS; i++)
+	{
+		if (readers[i] == r) readers[i] = NULL;
+	}
+
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++) free(r->slots[i].buf);
+	free(r->rd_buf);
+	free(r->ra_buf);
+	pthread_mutex_destroy(&r->cache_lock);
+	pthread_mutex_destroy(&r->io_lock);
+	delete r;
+}
+
+// cache_lock must be held
+static chd_slot_t *cache_find(chd_reader_t *r, int hunk)
+{
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++)
+	{
+		if (r->slots[i].hunk == hunk) return &r->slots[i];
+	}
+	return NULL;
+}
+
+// cache_lock must be held. Swaps the freshly decompressed buffer into the
+// least recently used slot and hands the evicted buffer back as scratch.
+static chd_slot_t *cache_insert(chd_reader_t *r, int hunk, uint8_t **scratch, bool prefetched)
+{
+	chd_slot_t *victim = &r->slots[0];
+	for (int i = 1; i < CHD_CACHE_HUNKS; i++)
+	{
+		if (r->slots[i].hunk < 0) { victim = &r->slots[i]; break; }
+		if (r->slots[i].stamp < victim->stamp) victim = &r->slots[i];
+	}
+
+	uint8_t *buf = victim->buf;
+	victim->buf = *scratch;
+	*scratch = buf;
+
+	victim->hunk = hunk;
+	victim->prefetched = prefetched;
+	victim->stamp = ++r->clock;
+	return victim;
+}
+
+static void reader_prefetch(chd_reader_t *r, int first, int count)
+{
+	for (int hunk = first; hunk < first + count && hunk < (int)r->hunkcount; hunk++)
+	{
+		pthread_mutex_lock(&r->cache_lock);
+		bool cached = cache_find(r, hunk) != NULL;
+		pthread_mutex_unlock(&r->cache_lock);
+		if (cached) continue;
+
+		pthread_mutex_lock(&r->io_lock);
+		chd_error err = chd_read(r->chd_f, hunk, r->ra_buf);
+		pthread_mutex_unlock(&r->io_lock);
+		if (err != CHDERR_NONE) break;
+
+		pthread_mutex_lock(&r->cache_lock);
+		if (!cache_find(r, hunk))
+		{
+			// insert as older than the current hunk so it doesn't evict the working set
+			chd_slot_t *slot = cache_insert(r, hunk, &r->ra_buf, true);
+			slot->stamp = r->clock - 1;
+			r->ra_done++;
+		}
+		pthread_mutex_unlock(&r->cache_lock);
+	}
+}
+
+static chd_error reader_read(chd_reader_t *r, int hunk, uint32_t offset, int length, uint8_t *dest)
+{
+	pthread_mutex_lock(&r->cache_lock);
+	chd_slot_t *slot = cache_find(r, hunk);
+	bool hit = slot != NULL;
+	if (!slot)
 	{
-		chd_error err = chd_read(chd_f, tmphnum, hunkbuf);
-		if (err != CHDERR_NONE)
+		pthread_mutex_unlock(&r->cache_lock);
+
+		// waits for a read-ahead in progress, which is likely this very hunk
+		pthread_mutex_lock(&r->io_lock);
+		pthread_mutex_lock(&r->cache_lock);
+		slot = cache_find(r, hunk);
+		if (!slot)
+		{
+			pthread_mutex_unlock(&r->cache_lock);
+			chd_error err = chd_read(r->chd_f, hunk, r->rd_buf);
+			pthread_mutex_lock(&r->cache_lock);
+			if (err != CHDERR_NONE)
+			{
+				pthread_mutex_unlock(&r->cache_lock);
+				pthread_mutex_unlock(&r->io_lock);
+				return err;
+			}
+
+			slot = cache_insert(r, hunk, &r->rd_buf, false);
+			r->misses++;
+		}
+		else
+		{
+			hit = true;
+		}
+		pthread_mutex_unlock(&r->io_lock);
+	}
+
+	if (hit)
+	{
+		r->hits++;
+		if (slot->prefetched) r->ra_hits++;
+		slot->prefetched = false;
+		slot->stamp = ++r->clock;
+	}
+
+	memcpy(dest, slot->buf + offset, length);
+	pthread_mutex_unlock(&r->cache_lock);
+
+	// sequential access, decompress the following hunks in the background
+	if ((hunk == r->last_hunk || hunk == r->last_hunk + 1) && offload_done(r->ra_handle))
+	{
+		pthread_mutex_lock(&r->cache_lock);
+		int first = -1;
+		for (int i = 1; i <= CHD_READAHEAD && first < 0; i++)
+		{
+			if (!cache_find(r, hunk + i)) first = hunk + i;
+		}
+		pthread_mutex_unlock(&r->cache_lock);
+
+		if (first >= 0 && first < (int)r->hunkcount)
 		{
-			mister_chd_log("ERROR %s\n", chd_error_string(err));
-			return err;
+			int count = hunk + CHD_READAHEAD + 1 - first;
+			r->ra_handle = offload_add_work([r, first, count] { reader_prefetch(r, first, count); });
 		}
-		*hunknum = tmphnum;
 	}
-	int sector_offset = hunkofs * CD_FRAME_SIZE;
-	memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
+	r->last_hunk = hunk;
+
 	return CHDERR_NONE;
 }
+
+void mister_chd_close(chd_file *chd_f)
+{
+	if (!chd_f) return;
+
+	chd_reader_t *r = find_reader(chd_f);
+	if (r) reader_destroy(r);
+	if (hunk_chd == chd_f) hunk_chd = NULL;
+	chd_close(chd_f);
+}
+
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf)
+{
+	int hunknum = 0;
+	int hunkofs = 0;
+
+	lba_to_hunkinfo(chd_f, lba, &hunknum, &hunkofs);
+
+	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
+	uint32_t sector_offset = hunkofs * CD_FRAME_SIZE;
+
+	chd_reader_t *r = find_reader(chd_f);
+	if (!r)
+	{
+		// no cache for this file, keep the last hunk only
+		uint32_t hunkbytes = chd_get_header(chd_f)->hunkbytes;
+		if (hunkbuf_size < hunkbytes)
+		{
+			hunkbuf = (uint8_t *)realloc(hunkbuf, hunkbytes);
+			hunkbuf_size = hunkbytes;
+			hunk_chd = NULL;
+		}
+
+		if (hunk_chd != chd_f || hunk_last != hunknum)
+		{
+			chd_error err = chd_read(chd_f, hunknum, hunkbuf);
+			if (err != CHDERR_NONE)
+			{
+				hunk_chd = NULL;
+				mister_chd_log("ERROR %s\n", chd_error_string(err));
+				return err;
+			}
+			hunk_chd = chd_f;
+			hunk_last = hunknum;
+		}
+
+		memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
+		return CHDERR_NONE;
+	}
+
+	chd_error err = reader_read(r, hunknum, sector_offset + s_offset, length, destbuf + d_offset);
+	if (err != CHDERR_NONE) mister_chd_log("ERROR %s\n", chd_error_string(err));
+	return err;
+}
@@ -11,6 +11,7 @@
 #include "../../menu.h"
 #include "../../cheats.h"
 #include "megacd.h"
+#include "../../latency.h"
 
 #define SAVE_IO_INDEX 5 // fake download to trigger save loading
 
@@ -22,6 +23,7 @@ static uint8_t has_command = 0;
 
 void mcd_poll()
 {
+	LATENCY_FUNCTION();
 	static uint32_t poll_timer = 0;
 	static uint8_t last_req = 255;
 	static uint8_t adj = 0;
@@ -18,6 +18,7 @@
 #include "../../cfg.h"
 #include "../../shmem.h"
 #include "miminig_fs_messages.h"
+#include "../../latency.h"
 
 #define SHMEM_ADDR      0x27FF4000
 #define SHMEM_SIZE      0x2000
@@ -898,6 +899,7 @@ static int process_request(void *reqres_buffer)
 
 void minimig_share_poll()
 {
+	LATENCY_FUNCTION();
 	if (!shmem)
 	{
 		shmem = (uint8_t *)shmem_map(SHMEM_ADDR, SHMEM_SIZE);
@@ -12,6 +12,7 @@
 #include "miniz.h"
 #include "n64.h"
 #include "n64_cpak_header.h"
+#include "../../latency.h"
 
 #pragma push_macro("NONE")
 #pragma push_macro("BIG_ENDIAN")
@@ -1427,6 +1428,7 @@ void n64_reset() {
 }
 
 void n64_poll() {
+	LATENCY_FUNCTION();
 	static uint8_t adj = 0;
 
 	if (!poll_timer || CheckTimer(poll_timer)) {
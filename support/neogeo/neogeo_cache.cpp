@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "../../file_io.h"
+#include "../../cfg.h"
+#include "../../menu.h"
+#include "../../zip_cache.h"
+#include "neogeo_cache.h"
+
+#define CACHE_MAGIC   0x434E454D // "MENC"
+#define CACHE_VERSION 1
+#define CACHE_HEADER  4096       // data stays page aligned
+#define CACHE_CHUNK   (4 * 1024 * 1024)
+#define CACHE_DIR     CONFIG_DIR "/neogeo_cache"
+
+struct cache_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t key_len;
+	char     key[CACHE_HEADER - 16];
+};
+
+struct cache_file_t
+{
+	std::string name;
+	uint64_t size;
+	time_t mtime;
+};
+
+int neocache_enabled()
+{
+	return cfg.neogeo_cache != 0;
+}
+
+int neocache_source(const char *name, std::string &id, uint64_t *size)
+{
+	char path[2048];
+	snprintf(path, sizeof(path), "%s", getFullPath(name));
+
+	char buf[64];
+	char *z = strcasestr(path, ".zip/");
+	if (z)
+	{
+		z[4] = 0;
+		auto idx = zip_index_get(path);
+		if (!idx) return 0;
+
+		int index = idx->locate(z + 5);
+		if (index < 0 || idx->entries[index].is_dir) return 0;
+
+		*size = idx->entries[index].size;
+		snprintf(buf, sizeof(buf), "%08X:%llu", idx->entries[index].crc32, (unsigned long long)*size);
+		id = buf;
+		return 2;
+	}
+
+	struct stat64 st;
+	if (stat64(path, &st) || !S_ISREG(st.st_mode)) return 0;
+
+	*size = st.st_size;
+	snprintf(buf, sizeof(buf), "%llu:%lld", (unsigned long long)st.st_size, (long long)st.st_mtime);
+	id = buf;
+	return 1;
+}
+
+static void cache_dir(char *out, size_t len)
+{
+	snprintf(out, len, "%s/" CACHE_DIR, getRootDir());
+}
+
+static void cache_file_name(const std::string &key, char *out, size_t len)
+{
+	// FNV-1a, the real key is stored inside and checked on load
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (char c : key)
+	{
+		hash ^= (uint8_t)c;
+		hash *= 0x100000001b3ULL;
+	}
+
+	char dir[1024];
+	cache_dir(dir, sizeof(dir));
+	snprintf(out, len, "%s/%016llx.bin", dir, (unsigned long long)hash);
+}
+
+bool neocache_load(const std::string &key, void *dst, uint32_t size, const char *dispname)
+{
+	if (!cfg.neogeo_cache) return false;
+
+	char name[1024];
+	cache_file_name(key, name, sizeof(name));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	static cache_header_t hdr;
+	bool ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == CACHE_MAGIC && hdr.version == CACHE_VERSION &&
+		hdr.size == size && hdr.key_len == key.size() && !memcmp(hdr.key, key.data(), key.size());
+
+	if (ok)
+	{
+		printf("neocache: loading %s from %s\n", dispname, name);
+
+		uint32_t done = 0;
+		while (ok && done < size)
+		{
+			uint32_t len = size - done;
+			if (len > CACHE_CHUNK) len = CACHE_CHUNK;
+
+			ok = read(fd, (uint8_t*)dst + done, len) == (ssize_t)len;
+			done += len;
+			ProgressMessage("Loading", dispname, done, size);
+		}
+
+		if (!ok)
+		{
+			printf("neocache: %s is truncated\n", name);
+			unlink(name);
+		}
+	}
+
+	close(fd);
+
+	// mtime is the last use for eviction
+	if (ok) utimensat(AT_FDCWD, name, NULL, 0);
+	return ok;
+}
+
+// Removes the least recently used files until need more bytes fit.
+static void cache_evict(uint64_t limit, uint64_t need)
+{
+	char dir[1024];
+	cache_dir(dir, sizeof(dir));
+
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	std::vector<cache_file_t> files;
+	uint64_t total = 0;
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_name[0] == '.') continue;
+
+		std::string path = std::string(dir) + "/" + de->d_name;
+		struct stat64 st;
+		if (stat64(path.c_str(), &st) || !S_ISREG(st.st_mode)) continue;
+
+		// left over from an interrupted store
+		if (strstr(de->d_name, ".tmp"))
+		{
+			unlink(path.c_str());
+			continue;
+		}
+
+		files.push_back({ path, (uint64_t)st.st_size, st.st_mtime });
+		total += st.st_size;
+	}
+	closedir(d);
+
+	std::sort(files.begin(), files.end(), [](const cache_file_t &a, const cache_file_t &b) { return a.mtime < b.mtime; });
+
+	for (auto &f : files)
+	{
+		if (total + need <= limit) break;
+		printf("neocache: removing %s\n", f.name.c_str());
+		unlink(f.name.c_str());
+		total -= f.size;
+	}
+}
+
+void neocache_store(const std::string &key, const void *src, uint32_t size, const char *dispname)
+{
+	if (!cfg.neogeo_cache) return;
+
+	uint64_t limit = (uint64_t)cfg.neogeo_cache * 1024 * 1024;
+	uint64_t need = (uint64_t)size + CACHE_HEADER;
+	if (need > limit || key.size() > sizeof(cache_header_t::key)) return;
+
+	char name[1024];
+	cache_file_name(key, name, sizeof(name));
+	unlink(name);
+
+	char dir[1024];
+	cache_dir(dir, sizeof(dir));
+	mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO);
+
+	cache_evict(limit, need);
+
+	static cache_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.size = size;
+	hdr.key_len = key.size();
+	memcpy(hdr.key, key.data(), key.size());
+
+	std::string tmp = std::string(name) + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0)
+	{
+		printf("neocache: cannot create %s\n", tmp.c_str());
+		return;
+	}
+
+	printf("neocache: storing %s to %s\n", dispname, name);
+
+	bool ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+	uint32_t done = 0;
+	while (ok && done < size)
+	{
+		uint32_t len = size - done;
+		if (len > CACHE_CHUNK) len = CACHE_CHUNK;
+
+		ok = write(fd, (const uint8_t*)src + done, len) == (ssize_t)len;
+		done += len;
+		ProgressMessage("Caching", dispname, done, size);
+	}
+
+	ok = !fsync(fd) && ok;
+	close(fd);
+	if (!ok || rename(tmp.c_str(), name))
+	{
+		printf("neocache: failed to store %s\n", name);
+		unlink(tmp.c_str());
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef NEOGEO_CACHE_H
+#define NEOGEO_CACHE_H
+
+#include <inttypes.h>
+#include <string>
+
+// Cache of ROM regions exactly as they end up in DDR (unzipped, converted,
+// interleaved) in config/neogeo_cache. The key describes everything the
+// region is made of: source paths, zip crcs (size and mtime of plain
+// files) and the load parameters. A hit is read straight into the mapped
+// region. Total size is limited by neogeo_cache in MiSTer.ini (MB), least
+// recently used files are removed first.
+
+int neocache_enabled();
+
+// Identity of a source file for the key. Returns 0 if it doesn't exist,
+// 1 for a plain file, 2 for a file in a zip.
+int neocache_source(const char *name, std::string &id, uint64_t *size);
+
+// dispname is shown in the progress message.
+bool neocache_load(const std::string &key, void *dst, uint32_t size, const char *dispname);
+void neocache_store(const std::string &key, const void *src, uint32_t size, const char *dispname);
+
+#endif
@@ -5,6 +5,13 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>   // clock_gettime, CLOCK_REALTIME
+#include <string>
+#include <vector>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
 #include "neogeo_loader.h"
 #include "neogeocd.h"
 #include "../../sxmlc.h"
@@ -13,6 +20,8 @@
 #include "../../osd.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../offload.h"
+#include "neogeo_cache.h"
 
 struct NeoFile
 {
@@ -52,7 +61,29 @@ static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t siz
 	Out: FEDCBA9876 15432 0
 	*/
 
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+	uint32_t i = 0;
+
+	// per 32 word block: out[2k] = in[16+k], out[2k+1] = in[k]
+#ifdef __ARM_NEON__
+	for (; i + 32 <= size; i += 32, buf_in += 32, buf_out += 32)
+	{
+		uint16x8x2_t lo = { { vld1q_u16(buf_in + 16), vld1q_u16(buf_in + 0) } };
+		uint16x8x2_t hi = { { vld1q_u16(buf_in + 24), vld1q_u16(buf_in + 8) } };
+		vst2q_u16(buf_out, lo);
+		vst2q_u16(buf_out + 16, hi);
+	}
+#else
+	for (; i + 32 <= size; i += 32, buf_in += 32, buf_out += 32)
+	{
+		for (int k = 0; k < 16; k++)
+		{
+			buf_out[k * 2] = buf_in[16 + k];
+			buf_out[k * 2 + 1] = buf_in[k];
+		}
+	}
+#endif
+
+	for (uint32_t j = 0; i < size; i++, j++) buf_out[j] = buf_in[(j & ~0x1F) | ((j >> 1) & 0xF) | (((j & 1) ^ 1) << 4)];
 
 	/*
 	0 <- 20
@@ -73,14 +104,83 @@ static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t siz
 	*/
 }
 
+// Same order as spr_convert into every other word, the words in between
+// belong to the paired C ROM and must not be touched.
 static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+	uint32_t i = 0;
+
+	for (; i + 32 <= size; i += 32, buf_in += 32, buf_out += 64)
+	{
+		for (int k = 0; k < 16; k++)
+		{
+			buf_out[k * 4] = buf_in[16 + k];
+			buf_out[k * 4 + 2] = buf_in[k];
+		}
+	}
+
+	for (uint32_t j = 0; i < size; i++, j++) buf_out[j << 1] = buf_in[(j & ~0x1F) | ((j >> 1) & 0xF) | (((j & 1) ^ 1) << 4)];
 }
 
-static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+// Swaps the middle bytes of every 32 bit word
+static inline void spr_bswap(uint32_t* buf, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+	uint32_t i = 0;
+
+#ifdef __ARM_NEON__
+	static const uint8_t tbl[8] = { 0, 2, 1, 3, 4, 6, 5, 7 };
+	uint8x8_t idx = vld1_u8(tbl);
+	for (; i + 4 <= size; i += 4)
+	{
+		uint8x16_t v = vld1q_u8((uint8_t*)(buf + i));
+		vst1q_u8((uint8_t*)(buf + i), vcombine_u8(vtbl1_u8(vget_low_u8(v), idx), vtbl1_u8(vget_high_u8(v), idx)));
+	}
+#endif
+
+	for (; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+}
+
+// per 64 word block, as 32 bit words with halves swapped:
+// out[2m] = in[16+m], out[2m+1] = in[m]
+// swap applies spr_bswap to the input first.
+static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size, int swap = 0)
+{
+	uint32_t i = 0;
+
+#ifdef __ARM_NEON__
+	// bswap and the half swap are one byte shuffle
+	static const uint8_t tbl[2][8] = { { 2, 3, 0, 1, 6, 7, 4, 5 }, { 1, 3, 0, 2, 5, 7, 4, 6 } };
+	uint8x8_t idx = vld1_u8(tbl[swap ? 1 : 0]);
+	for (; i + 64 <= size; i += 64, buf_in += 64, buf_out += 64)
+	{
+		const uint8_t *in = (const uint8_t*)buf_in;
+		for (int k = 0; k < 64; k += 16)
+		{
+			uint8x16_t a = vld1q_u8(in + 64 + k);
+			uint8x16_t b = vld1q_u8(in + k);
+			uint32x4x2_t v = { {
+				vreinterpretq_u32_u8(vcombine_u8(vtbl1_u8(vget_low_u8(a), idx), vtbl1_u8(vget_high_u8(a), idx))),
+				vreinterpretq_u32_u8(vcombine_u8(vtbl1_u8(vget_low_u8(b), idx), vtbl1_u8(vget_high_u8(b), idx)))
+			} };
+			vst2q_u32((uint32_t*)(buf_out + k), v);
+		}
+	}
+#else
+	for (; i + 64 <= size; i += 64, buf_in += 64, buf_out += 64)
+	{
+		if (swap) spr_bswap((uint32_t*)buf_in, 32);
+		for (int k = 0; k < 32; k += 2)
+		{
+			buf_out[k * 2 + 0] = buf_in[32 + k + 1];
+			buf_out[k * 2 + 1] = buf_in[32 + k];
+			buf_out[k * 2 + 2] = buf_in[k + 1];
+			buf_out[k * 2 + 3] = buf_in[k];
+		}
+	}
+#endif
+
+	if (swap && i < size) spr_bswap((uint32_t*)buf_in, (size - i) / 2);
+	for (uint32_t j = 0; i < size; i++, j++) buf_out[j] = buf_in[(j & ~0x3F) | ((j ^ 1) & 1) | ((j >> 1) & 0x1E) | (((j & 2) ^ 2) << 4)];
 }
 
 static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
@@ -105,7 +205,31 @@ static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
 	In:  FEDCBA9876543210
 	Out: FEDCBA9876510432
 	*/
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+	uint32_t i = 0;
+
+	// per 32 byte block: out[4m..4m+3] = in[16+m], in[24+m], in[m], in[8+m]
+#ifdef __ARM_NEON__
+	for (; i + 32 <= size; i += 32, buf_in += 32, buf_out += 32)
+	{
+		uint8x16_t a = vld1q_u8(buf_in);
+		uint8x16_t b = vld1q_u8(buf_in + 16);
+		uint8x8x4_t v = { { vget_low_u8(b), vget_high_u8(b), vget_low_u8(a), vget_high_u8(a) } };
+		vst4_u8(buf_out, v);
+	}
+#else
+	for (; i + 32 <= size; i += 32, buf_in += 32, buf_out += 32)
+	{
+		for (int m = 0; m < 8; m++)
+		{
+			buf_out[m * 4 + 0] = buf_in[16 + m];
+			buf_out[m * 4 + 1] = buf_in[24 + m];
+			buf_out[m * 4 + 2] = buf_in[m];
+			buf_out[m * 4 + 3] = buf_in[8 + m];
+		}
+	}
+#endif
+
+	for (uint32_t j = 0; i < size; i++, j++) buf_out[j] = buf_in[(j & ~0x1F) | ((j >> 2) & 7) | ((j & 1) << 3) | (((j & 2) << 3) ^ 0x10)];
 }
 
 static const char *get_name(const char *path, const char *name)
@@ -214,6 +338,74 @@ static void make_path(const char *root, const char *name, char *path)
 }
 
 extern uint8_t loadbuf[];
+
+// Reads chunks of a file one ahead on an offload worker, so the read of the
+// next chunk overlaps with the conversion of the current one. Chunks past
+// the end of the file data are zero filled.
+static uint8_t readbuf[LOADBUF_SZ];
+
+struct chunk_reader
+{
+	fileTYPE *f;
+	uint32_t remain;
+	uint32_t remainf;
+	uint8_t *buf[2];
+	uint32_t len[2];
+	int cur;
+	offload_handle_t job;
+};
+
+static void reader_fill(chunk_reader *rd, int n)
+{
+	uint32_t len = rd->remain;
+	if (len > LOADBUF_SZ) len = LOADBUF_SZ;
+
+	uint32_t lenf = rd->remainf;
+	if (lenf > len) lenf = len;
+
+	rd->remain -= len;
+	rd->remainf -= lenf;
+	rd->len[n] = len;
+	if (!len) return;
+
+	fileTYPE *f = rd->f;
+	uint8_t *buf = rd->buf[n];
+	rd->job = offload_add_work([f, buf, len, lenf]
+	{
+		int ret = lenf ? FileReadAdv(f, buf, lenf) : 0;
+		if (ret < 0) ret = 0;
+		if ((uint32_t)ret < len) memset(buf + ret, 0, len - ret);
+	});
+}
+
+static void reader_start(chunk_reader *rd, fileTYPE *f, uint32_t size, uint32_t sizef)
+{
+	rd->f = f;
+	rd->remain = size;
+	rd->remainf = sizef;
+	rd->buf[0] = loadbuf;
+	rd->buf[1] = readbuf;
+	rd->cur = 0;
+	rd->job = {};
+	reader_fill(rd, 0);
+}
+
+static uint8_t *reader_next(chunk_reader *rd, uint32_t *len)
+{
+	offload_wait(rd->job);
+
+	int n = rd->cur;
+	*len = rd->len[n];
+	rd->cur ^= 1;
+	reader_fill(rd, rd->cur);
+	return rd->buf[n];
+}
+
+static void reader_stop(chunk_reader *rd)
+{
+	offload_wait(rd->job);
+}
+
 static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
 {
 	fileTYPE f = {};
@@ -236,42 +428,38 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 
 	// Put pairs of bitplanes in the correct order for the core
 
-	uint32_t remain = size;
 	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
-
-	ProgressMessage();
-	while (remain)
+	void *base = shmem_map(map_addr, size);
+	if (!base)
 	{
-		uint32_t partsz = remain;
-		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
+		FileClose(&f);
+		return 0;
+	}
 
-		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
-		if (!base)
-		{
-			FileClose(&f);
-			return 0;
-		}
+	uint16_t *dst = ((uint16_t*)base) + ((index ^ 1) & 1);
+	uint32_t done = 0;
 
-		FileReadAdv(&f, loadbuf, partsz/2);
-		spr_convert_skp((uint16_t*)loadbuf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
+	chunk_reader rd;
+	reader_start(&rd, &f, size / 2, size / 2);
 
-		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
+	ProgressMessage();
+	while (done < size)
+	{
+		uint32_t partsz;
+		uint8_t *buf = reader_next(&rd, &partsz);
 
-		shmem_unmap(base, partsz);
-		remain -= partsz;
-		map_addr += partsz;
+		spr_convert_skp((uint16_t*)buf, dst + done / 2, partsz / 2);
+		done += partsz * 2;
+
+		ProgressMessage("Loading", dispname, done, size);
 	}
 
+	reader_stop(&rd);
+	shmem_unmap(base, size);
 	FileClose(&f);
 	ProgressMessage();
 
-	return map_addr - 0x38000000;
-}
-
-static inline void spr_bswap(uint32_t* buf, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+	return map_addr + size - 0x38000000;
 }
 
 static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_file_type, uint8_t index, uint32_t offset, uint32_t size, uint32_t expand, int swap, uint32_t addr)
@@ -288,61 +476,90 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 		return 0;
 	}
 
-	FileSeek(&f, offset, SEEK_SET);
 	printf("ROM %s (offset %u, size %u, exp %u, type %u, addr %u) with index %u\n", name, offset, size, expand, neo_file_type, addr, index);
 	const char *dispname = get_name(path, name);
 
-	uint32_t remainf = size;
+	uint32_t sizef = size;
 
 	if(expand) size = expand;
-	uint32_t remain = size;
 
 	uint32_t map_addr = 0x30000000 + (addr ? (addr + 0x8000000) : ((index >= 16) && (index < 64)) ? (index - 16) * 0x80000 : (index == 9) ? 0x2000000 : 0x8000000);
-
-	ProgressMessage();
-	while (remain)
+	uint8_t *base = (uint8_t*)shmem_map(map_addr, size);
+	if (!base)
 	{
-		uint32_t partsz = remain;
-		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
-
-		uint32_t partszf = remainf;
-		if (partszf > LOADBUF_SZ) partszf = LOADBUF_SZ;
+		FileClose(&f);
+		return 0;
+	}
 
-		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
-		if (!base)
+	// plain raw files are read as fast from the source
+	std::string key, id;
+	uint64_t fsize;
+	if (neocache_enabled())
+	{
+		int src = neocache_source(name_buf, id, &fsize);
+		if (src == 2 || (src && neo_file_type != NEO_FILE_RAW))
 		{
-			FileClose(&f);
-			return 0;
+			char params[128];
+			sprintf(params, " %u %u %u %u %u %u %u ", neo_file_type, index, offset, sizef, size, swap, addr);
+			key = std::string("rom ") + name_buf + params + id;
 		}
+	}
 
-		if (neo_file_type == NEO_FILE_FIX)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			fix_convert(loadbuf, (uint8_t*)base, partsz);
-		}
-		else if (neo_file_type == NEO_FILE_SPR)
+	if (!key.empty() && neocache_load(key, base, size, dispname))
+	{
+		shmem_unmap(base, size);
+		FileClose(&f);
+		ProgressMessage();
+		return size;
+	}
+
+	FileSeek(&f, offset, SEEK_SET);
+
+	ProgressMessage();
+	if (neo_file_type == NEO_FILE_FIX || neo_file_type == NEO_FILE_SPR)
+	{
+		chunk_reader rd;
+		reader_start(&rd, &f, size, sizef);
+
+		uint32_t done = 0;
+		while (done < size)
 		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			if (swap) spr_bswap((uint32_t*)loadbuf, partsz / 4);
-			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)base, partsz / 2);
+			uint32_t partsz;
+			uint8_t *buf = reader_next(&rd, &partsz);
+
+			if (neo_file_type == NEO_FILE_FIX) fix_convert(buf, base + done, partsz);
+			else spr_convert_dbl((uint16_t*)buf, (uint16_t*)(base + done), partsz / 2, swap);
+			done += partsz;
+
+			ProgressMessage("Loading", dispname, done, size);
 		}
-		else
+
+		reader_stop(&rd);
+	}
+	else
+	{
+		// read straight into DDR, nothing to overlap
+		uint32_t done = 0;
+		while (done < size)
 		{
-			memset(base, ((index>=16) && (index<64)) ? 8 : 0, partsz);
-			if (partszf) FileReadAdv(&f, base, partszf);
-		}
+			uint32_t partsz = size - done;
+			if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
+
+			uint32_t partszf = (sizef > done) ? sizef - done : 0;
+			if (partszf > partsz) partszf = partsz;
 
-		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
+			memset(base + done, ((index>=16) && (index<64)) ? 8 : 0, partsz);
+			if (partszf) FileReadAdv(&f, base + done, partszf);
+			done += partsz;
 
-		shmem_unmap(base, partsz);
-		remain -= partsz;
-		map_addr += partsz;
+			ProgressMessage("Loading", dispname, done, size);
+		}
 	}
 
 	FileClose(&f);
+	if (!key.empty()) neocache_store(key, base, size, dispname);
+
+	shmem_unmap(base, size);
 	ProgressMessage();
 
 	return size;
@@ -380,15 +597,90 @@ static void notify_core(uint8_t index, uint32_t size, uint32_t memcp_force = 0)
 
 static uint32_t fill_ram(uint32_t size, uint8_t pattern)
 {
-	void *base = shmem_map(0x38000000, size);
-	if (!base) return 0;
-	memset(base, pattern, size);
-	shmem_unmap(base, size);
+	if (!shmem_set(0x38000000, pattern, size)) return 0;
 
 	notify_core(18, size, 1);
 	return 1;
 }
 
+// With the cache enabled C ROMs are only collected until the region is
+// complete, then it's either read from the cache or loaded part by part.
+struct crom_part
+{
+	std::string path;
+	std::string name;
+	uint8_t index;
+	uint32_t offset;
+	uint32_t size;
+};
+
+static std::vector<crom_part> crom_parts;
+static std::string crom_key;
+static int crom_failed = 0;
+
+static uint32_t crom_add(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
+{
+	static char name_buf[1024];
+	make_path(path, name, name_buf);
+
+	std::string id;
+	uint64_t fsize;
+	if (!neocache_source(name_buf, id, &fsize)) return 0;
+	if (!size && offset < fsize) size = fsize - offset;
+	if (!size) return 0;
+
+	char params[64];
+	sprintf(params, " %u %u %u ", index, offset, size);
+	crom_key += std::string(" | ") + name_buf + params + id;
+	crom_parts.push_back({ path, name, index, offset, size });
+
+	return (((index - 64) >> 1) * 1024 * 1024) + size * 2;
+}
+
+// Returns the size of the loaded region like load_crom_to_mem does, parts
+// that fail to load are counted in crom_failed.
+static uint32_t crom_flush(uint32_t size)
+{
+	if (crom_parts.empty()) return size;
+
+	std::string key = "crom" + crom_key;
+	void *base = shmem_map(0x38000000, size);
+	bool hit = base && neocache_load(key, base, size, "C ROMs");
+	if (base) shmem_unmap(base, size);
+	ProgressMessage();
+
+	if (!hit)
+	{
+		uint32_t loaded = 0;
+		int failed = 0;
+		for (auto &p : crom_parts)
+		{
+			uint32_t sz = load_crom_to_mem(p.path.c_str(), p.name.c_str(), p.index, p.offset, p.size);
+			if (!sz)
+			{
+				printf("CROM %s: failed to load\n", p.name.c_str());
+				failed++;
+			}
+			if (sz > loaded) loaded = sz;
+		}
+
+		base = !failed ? shmem_map(0x38000000, size) : NULL;
+		if (base)
+		{
+			neocache_store(key, base, size, "C ROMs");
+			shmem_unmap(base, size);
+			ProgressMessage();
+		}
+
+		crom_failed += failed;
+		size = loaded;
+	}
+
+	crom_parts.clear();
+	crom_key.clear();
+	return size;
+}
+
 static uint32_t crom_sz = 0;
 static uint32_t neogeo_tx(const char* path, const char* name, uint8_t neo_file_type, int16_t index, uint32_t offset, uint32_t size, uint32_t expand = 0, int swap = 0)
 {
@@ -401,7 +693,7 @@ static uint32_t neogeo_tx(const char* path, const char* name, uint8_t neo_file_t
 
 	if (index >= 64)
 	{
-		sz = load_crom_to_mem(path, name, index, offset, size);
+		sz = neocache_enabled() ? crom_add(path, name, index, offset, size) : load_crom_to_mem(path, name, index, offset, size);
 		if (!sz) return 0;
 		if (sz > crom_sz) crom_sz = sz;
 		return sz;
@@ -409,8 +701,8 @@ static uint32_t neogeo_tx(const char* path, const char* name, uint8_t neo_file_t
 
 	if (crom_sz)
 	{
-		sz = crom_sz;
-		notify_core(15, crom_sz);
+		sz = crom_flush(crom_sz);
+		if (sz) notify_core(15, sz);
 		crom_sz = 0;
 	}
 
@@ -921,6 +1213,11 @@ static int xml_load_files(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, co
 		if (in_correct_romset) {
 			if (!strcasecmp(node->tag, "romset"))
 			{
+				// load pending C ROMs first, parts that failed don't count
+				neogeo_tx(NULL, NULL, 0, -1, 0, 0);
+				file_cnt -= crom_failed;
+				crom_failed = 0;
+
 				if (!file_cnt)
 				{
 					printf("No parts specified or found. Trying to load known files:\n");
@@ -1160,6 +1457,9 @@ int neogeo_romset_tx(char* name, int cd_en)
 	crom_sz_max = 0;
 	crom_start = 0;
 	crom_sz = 0;
+	crom_parts.clear();
+	crom_key.clear();
+	crom_failed = 0;
 	set_config(0, -1);
 
 	const char* home = HomeDir(cd_en ? NEOCD_DIR : NULL);
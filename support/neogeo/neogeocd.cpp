@@ -13,6 +13,7 @@
 #include "../megacd/megacd.h"
 #include "neogeocd.h"
 #include "neogeo_loader.h"
+#include "../../latency.h"
 
 static int need_reset=0;
 static uint8_t has_command = 0;
@@ -27,6 +28,7 @@ static uint8_t cd_speed = 0;
 
 void neocd_poll()
 {
+	LATENCY_FUNCTION();
 	static uint8_t last_req = 255;
 
 	if (!poll_timer || CheckTimer(poll_timer))
@@ -10,6 +10,7 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "pcecd.h"
+#include "../../latency.h"
 
 
 static int need_reset=0;
@@ -17,6 +18,7 @@ static uint8_t has_command = 0;
 
 void pcecd_poll()
 {
+	LATENCY_FUNCTION();
 	static uint32_t poll_timer = 0;
 	static uint8_t last_req = 0;
 	static uint8_t adj = 0;
@@ -13,45 +13,12 @@
 #include "mcdheader.h"
 #include "../../cd.h"
 #include "../chd/mister_chd.h"
+#include "../../latency.h"
 #include <libchdr/chd.h>
 
 static char buf[1024];
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
 static int noreset = 0;
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if (*instr == 10) instr++;
-		*in = instr;
-	} while (!*out && **in);
-
-	return *out;
-}
-
 static uint32_t libCryptSectors[16] =
 {
 	14105,
@@ -107,11 +74,9 @@ static void unload_chd(toc_t *table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf) free(chd_hunkbuf);
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 
 }
 
@@ -155,9 +120,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end = table->tracks[table->last - 1].end + 1;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -184,7 +146,7 @@ static int load_cue(const char* filename, toc_t *table)
 	int pregap = 0;
 
 	char *buf = toc;
-	while (sgets(line, sizeof(line), &buf))
+	while (cd_sgets(line, sizeof(line), &buf))
 	{
 		lptr = line;
 		while (*lptr == 0x20) lptr++;
@@ -477,80 +439,52 @@ void psx_read_cd(uint8_t *buffer, int lba, int cnt)
 
 	while (cnt > 0)
 	{
+		int run = 1;
 		if (lba < toc.tracks[0].start || !toc.last)
 		{
 			memset(buffer, 0, CD_SECTOR_LEN);
 		}
 		else
 		{
-			memset(buffer, 0xAA, CD_SECTOR_LEN);
-			for (int i = 0; i < toc.last; i++)
+			int i = 0;
+			while (i < toc.last && !(lba >= toc.tracks[i].start && lba <= toc.tracks[i].end)) i++;
+
+			if (i >= toc.last)
 			{
-				if (lba >= toc.tracks[i].start && lba <= toc.tracks[i].end)
+				memset(buffer, 0xAA, CD_SECTOR_LEN);
+			}
+			else
+			{
+				run = toc.tracks[i].end - lba + 1;
+				if (run > cnt) run = cnt;
+
+				//The TOC is setup so that pregap sectors are actually part of the
+				//PREVIOUS track. If the pregap field is set the file doesn't contain
+				//this data, so we have to fake it.
+				//Check the next track's pregap and indexes[1] values to determine
+				//if we're reading pregap sectors
+				int pregap_lba = toc.tracks[i + 1].pregap ? (toc.tracks[i + 1].start - toc.tracks[i + 1].indexes[1] + 1) : INT32_MAX;
+				if (lba >= pregap_lba)
 				{
-					if (!toc.chd_f)
-					{
-						if (toc.tracks[i].offset)
-            {
-							FileSeek(&toc.tracks[0].f, toc.tracks[i].offset+((lba-toc.tracks[i].start)*CD_SECTOR_LEN), SEEK_SET);
+					memset(buffer, 0, run * CD_SECTOR_LEN);
+				}
+				else
+				{
+					if (lba + run > pregap_lba) run = pregap_lba - lba;
 
-            }else {
-							FileSeek(&toc.tracks[i].f, (lba - toc.tracks[i].start) * CD_SECTOR_LEN, SEEK_SET);
-            }
-					}
-					while (cnt)
+					// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
+					int pos = toc.chd_f ? (lba - toc.tracks[0].indexes[1] + toc.tracks[i].offset) : (lba - toc.tracks[i].start);
+					if (cd_read_sectors(&toc, i, pos, run, buffer) != run)
 					{
-            if (toc.tracks[i+1].pregap && lba > (toc.tracks[i+1].start-toc.tracks[i+1].indexes[1]))
-            {
-              //The TOC is setup so that pregap sectors are actually part of the
-              //PREVIOUS track. If the pregap field is set the file doesn't contain
-              //this data, so we have to fake it. 
-              //Check the next track's pregap and indexes[1] values to determine
-              //if we're reading pregap sectors
-              
-
-              memset(buffer, 0x0, CD_SECTOR_LEN);
-            }
-            else if (toc.chd_f)
-						{
-
-							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
-							int read_lba = lba - toc.tracks[0].indexes[1];
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
-							{
-								if (!toc.tracks[i].type) //CHD requires byteswap of audio data
-								{
-									for (int swapidx = 0; swapidx < CD_SECTOR_LEN; swapidx += 2)
-									{
-										uint8_t temp = buffer[swapidx];
-										buffer[swapidx] = buffer[swapidx + 1];
-										buffer[swapidx + 1] = temp;
-									}
-								}
-							}
-							else {
-								printf("\x1b[32mPSX: CHD read error: %d\n\x1b[0m", lba);
-							}
-						}
-						else {
-							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CD_SECTOR_LEN);
-							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CD_SECTOR_LEN);
-						}
-						if ((lba + 1) > toc.tracks[i].end) break;
-						buffer += CD_SECTOR_LEN;
-						cnt--;
-						lba++;
+						printf("\x1b[32mPSX: read error: %d\n\x1b[0m", lba);
 					}
-					break;
 				}
 			}
 		}
 
-		buffer += CD_SECTOR_LEN;
-		cnt--;
-		lba++;
+		buffer += run * CD_SECTOR_LEN;
+		cnt -= run;
+		lba += run;
 	}
 }
 
@@ -803,6 +737,7 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 
 void psx_poll()
 {
+	LATENCY_FUNCTION();
 	spi_uio_cmd(UIO_CD_GET);
 }
 
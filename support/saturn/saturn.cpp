@@ -10,6 +10,7 @@
 #include "../../menu.h"
 #include "../../cheats.h"
 #include "saturn.h"
+#include "../../latency.h"
 
 static int need_reset = 0;
 uint32_t saturn_frame_cnt = 0;
@@ -42,6 +43,7 @@ static uint32_t CalcTimerOffset(uint8_t speed) {
 
 void saturn_poll()
 {
+	LATENCY_FUNCTION();
 	static unsigned long poll_timer = 0;
 	static uint8_t last_req = 255;
 
@@ -28,8 +28,6 @@ satcdd_t::satcdd_t() {
 	speed = 0;
 	audioLength = 0;
 	audioFirst = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 
 	stat[0] = SATURN_STAT_OPEN;
@@ -46,38 +44,6 @@ satcdd_t::satcdd_t() {
 	SetChecksum(stat);
 }
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if (*instr == 10) instr++;
-		*in = instr;
-	} while (!*out && **in);
-
-	return *out;
-}
-
 int satcdd_t::LoadCUE(const char* filename) {
 	static char fname[1024 + 10];
 	static char line[128];
@@ -99,7 +65,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 	int idx, mm, ss, bb, pregap = 0;
 
 	char *buf = cue;
-	while (sgets(line, sizeof(line), &buf))
+	while (cd_sgets(line, sizeof(line), &buf))
 	{
 		lptr = line;
 		while (*lptr == 0x20) lptr++;
@@ -334,13 +300,6 @@ int satcdd_t::Load(const char *filename)
 			return -1;
 		}
 
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 		if (this->toc.tracks[0].sector_size)
 		{
 			this->sectorSize = this->toc.tracks[0].sector_size;
@@ -353,7 +312,7 @@ int satcdd_t::Load(const char *filename)
 
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -398,13 +357,7 @@ void satcdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -439,7 +392,7 @@ int satcdd_t::GetBootHeader(uint8_t *buf) {
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf);
 	}
 	else 
 	{
@@ -1137,46 +1090,31 @@ int satcdd_t::SetCommand(uint8_t* data) {
 }
 
 void satcdd_t::MakeSecureRingData(uint8_t *buf) {
-	int i, j;
-	uint16_t lfsr = 1;
-	uint8_t a;
-	for (i = 12; i < 2348; i++)
-	{
-		a = (i & 1) ? 0x59 : 0xa8;
-		for (j = 0; j < 8; j++)
+	// the pattern never changes, generate it once
+	static uint8_t ring[2348];
+	static bool init = false;
+	if (!init) {
+		int i, j;
+		uint16_t lfsr = 1;
+		uint8_t a;
+		for (i = 12; i < 2348; i++)
 		{
-			a ^= (lfsr & 1);
-			a = (a >> 1) | (a << (7));
+			a = (i & 1) ? 0x59 : 0xa8;
+			for (j = 0; j < 8; j++)
+			{
+				a ^= (lfsr & 1);
+				a = (a >> 1) | (a << (7));
 
-			uint16_t x = (lfsr >> 1) ^ lfsr;
-			lfsr |= x << 15;
-			lfsr >>= 1;
+				uint16_t x = (lfsr >> 1) ^ lfsr;
+				lfsr |= x << 15;
+				lfsr >>= 1;
+			}
+			ring[i] = a;
 		}
-		buf[i] = a;
-	}
-}
-
-uint32_t satcdd_t::DataSectorCalcCRC(uint8_t* buf, int len)
-{
-	static uint32_t crc_tab[256];
-	for (int i = 0; i < 256; i++)
-	{
-		uint32_t c = i;
-
-		for (unsigned j = 0; j < 8; j++)
-			c = (c >> 1) ^ ((c & 0x1) ? 0xD8018001 : 0);
-
-		crc_tab[i] = c;
+		init = true;
 	}
 
-	uint32_t crc = 0;
-	for (int i = 0; i < len; i++)
-	{
-		crc ^= buf[i];
-		crc = (crc >> 8) ^ crc_tab[crc & 0xFF];
-	}
-
-	return crc;
+	memcpy(buf + 12, ring + 12, 2348 - 12);
 }
 
 void satcdd_t::ReadData(uint8_t *buf)
@@ -1194,7 +1132,7 @@ void satcdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf);
 		}
 		else {
 			if (this->sectorSize == 2048)
@@ -1226,15 +1164,10 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 	{
 		for (int i = sec_offs; i < 2; i++, dest += 4096)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest);
 
-			//CHD audio requires byteswap. There's probably a better way to do this...
-			for (int swapidx = 0; swapidx < 2352; swapidx += 2)
-			{
-				uint8_t temp = dest[swapidx];
-				dest[swapidx] = dest[swapidx + 1];
-				dest[swapidx + 1] = temp;
-			}
+			//CHD audio requires byteswap
+			cd_swab16(dest, 2352);
 		}
 
 		/*if ((len / 2352) > 1)
@@ -1273,14 +1206,15 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 	}
 	uint8_t sec_mode = data_ptr[15];
 
-	uint32_t crc = DataSectorCalcCRC(data_ptr, (sec_mode == 2 ? 2348 : 2064));
 	if (sec_mode == 0x02) {
-		/*data_ptr[2348] = crc >> 0;
+		/*uint32_t crc = cd_edc(data_ptr, 2348);
+		data_ptr[2348] = crc >> 0;
 		data_ptr[2349] = crc >> 8;
 		data_ptr[2350] = crc >> 16;
 		data_ptr[2351] = crc >> 24;*/
 	}
 	else {
+		uint32_t crc = cd_edc(data_ptr, 2064);
 		data_ptr[2064] = crc >> 0;
 		data_ptr[2065] = crc >> 8;
 		data_ptr[2066] = crc >> 16;
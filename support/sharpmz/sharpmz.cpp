@@ -41,6 +41,7 @@
 #include "../../menu.h"
 #include "../../debug.h"
 #include "../../user_io.h"
+#include "../../latency.h"
 
 // Names of the supported machines.
 //
@@ -359,6 +360,7 @@ void sharpmz_init(void)
 //
 void sharpmz_poll(void)
 {
+    LATENCY_FUNCTION();
     // Locals.
     static unsigned long  time = GetTimer(0);
     unsigned long         timeElapsed;
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+
+#include "../../file_io.h"
+#include "../../offload.h"
+#include "../../latency.h"
+#include "msu_stream.h"
+
+#define MSU_CHUNK   (16 * 1024)
+#define MSU_AHEAD   32          // chunks, about 3 seconds of 44.1kHz stereo
+
+struct msu_chunk_t
+{
+	uint32_t offset;
+	uint32_t len;
+	uint8_t data[MSU_CHUNK];
+};
+
+// Shared with the read in flight, which may outlive the stream.
+struct msu_data_t
+{
+	fileTYPE f = {};
+	msu_chunk_t ring[MSU_AHEAD];
+	msu_chunk_t loop;
+	~msu_data_t() { FileClose(&f); }
+};
+
+struct msu_stream_t
+{
+	std::shared_ptr<msu_data_t> data;
+	uint32_t size;
+	uint32_t pos;
+
+	msu_chunk_t *ring;
+	uint32_t head;      // slot of the oldest chunk
+	uint32_t count;     // contiguous chunks from head
+	uint32_t next;      // file offset of the next chunk to read ahead
+
+	msu_chunk_t *loop;  // chunk at the loop point, kept for the whole track
+	bool loop_valid;
+	bool header;        // first chunk is in, loop point known
+	uint32_t loop_read; // loop chunk still to be read, 0 if none
+
+	bool busy;
+	bool stale;         // result of the read in flight isn't wanted anymore
+	msu_chunk_t *target;
+	offload_handle_t job;
+};
+
+static void chunk_read(fileTYPE *f, msu_chunk_t *c, uint32_t offset, uint32_t size)
+{
+	c->offset = offset;
+	c->len = (offset < size) ? size - offset : 0;
+	if (c->len > MSU_CHUNK) c->len = MSU_CHUNK;
+
+	if (c->len && (!FileSeek(f, offset, SEEK_SET) || FileReadAdv(f, c->data, c->len) != (int)c->len))
+	{
+		printf("MSU: read error at 0x%X\n", offset);
+		memset(c->data, 0, c->len);
+	}
+}
+
+static void stream_start(msu_stream_t *s, msu_chunk_t *c, uint32_t offset)
+{
+	std::shared_ptr<msu_data_t> data = s->data;
+	uint32_t size = s->size;
+
+	s->busy = true;
+	s->stale = false;
+	s->target = c;
+	c->len = 0;
+	s->job = offload_add_work([data, c, offset, size] { chunk_read(&data->f, c, offset, size); }, OFFLOAD_STREAM);
+}
+
+// "MSU1", loop point in samples, the core jumps to the 1K sector holding it
+static void stream_header(msu_stream_t *s, const msu_chunk_t *c)
+{
+	uint32_t loop = 0;
+	if (c->len >= 8 && !memcmp(c->data, "MSU1", 4)) memcpy(&loop, c->data + 4, 4);
+	uint64_t loop_pos = 8 + (uint64_t)loop * 4;
+	uint32_t loop_offset = (loop_pos < s->size) ? (uint32_t)loop_pos & ~1023 : 0;
+
+	if (loop_offset)
+	{
+		s->loop_read = loop_offset;
+	}
+	else
+	{
+		memcpy(s->loop, c, sizeof(msu_chunk_t));
+		s->loop_valid = true;
+	}
+	s->header = true;
+}
+
+static void stream_collect(msu_stream_t *s, bool wait)
+{
+	if (!s->busy) return;
+
+	if (!offload_done(s->job))
+	{
+		if (!wait) return;
+
+		static latency_hist_t *hist = latency_hist("msu_wait");
+		uint64_t start = latency_now_us();
+		offload_wait(s->job);
+		latency_record(hist, (uint32_t)(latency_now_us() - start));
+	}
+
+	s->busy = false;
+
+	// the first read is always chunk 0, even if a seek made it stale
+	if (!s->header) stream_header(s, s->target);
+	if (s->stale) return;
+
+	if (s->target == s->loop)
+	{
+		s->loop_valid = true;
+	}
+	else
+	{
+		s->count++;
+		s->next = s->target->offset + MSU_CHUNK;
+	}
+}
+
+static bool in_chunk(const msu_chunk_t *c, uint32_t pos)
+{
+	return pos >= c->offset && pos < c->offset + c->len;
+}
+
+static void ring_reset(msu_stream_t *s, uint32_t offset)
+{
+	s->head = 0;
+	s->count = 0;
+	s->next = offset;
+	if (s->busy && s->target != s->loop) s->stale = true;
+}
+
+msu_stream_t *msu_stream_open(const char *path)
+{
+	std::shared_ptr<msu_data_t> data = std::make_shared<msu_data_t>();
+	if (!FileOpen(&data->f, path) || !data->f.size) return NULL;
+
+	msu_stream_t *s = new msu_stream_t();
+	s->data = data;
+	s->size = (uint32_t)data->f.size;
+	s->ring = data->ring;
+	s->loop = &data->loop;
+
+	// needed first and holds the loop point, the loop chunk is read next
+	stream_start(s, &s->ring[0], 0);
+	return s;
+}
+
+void msu_stream_close(msu_stream_t *s)
+{
+	// a read in flight holds the buffers and the file until it's done
+	delete s;
+}
+
+uint32_t msu_stream_size(msu_stream_t *s)
+{
+	return s ? s->size : 0;
+}
+
+void msu_stream_seek(msu_stream_t *s, uint32_t offset)
+{
+	if (!s) return;
+
+	stream_collect(s, false);
+	s->pos = offset;
+
+	// drop what's behind, keep the ring if the target is in it
+	while (s->count && !in_chunk(&s->ring[s->head], offset))
+	{
+		s->head = (s->head + 1) % MSU_AHEAD;
+		s->count--;
+	}
+
+	if (!s->count)
+	{
+		bool at_loop = s->loop_valid && in_chunk(s->loop, offset);
+		ring_reset(s, at_loop ? s->loop->offset + s->loop->len : offset);
+	}
+}
+
+void msu_stream_read(msu_stream_t *s, uint8_t *buf, uint32_t len)
+{
+	while (len)
+	{
+		if (!s || s->pos >= s->size)
+		{
+			memset(buf, 0, len);
+			return;
+		}
+
+		stream_collect(s, false);
+
+		const msu_chunk_t *c = NULL;
+		if (s->count && in_chunk(&s->ring[s->head], s->pos)) c = &s->ring[s->head];
+		else if (s->loop_valid && in_chunk(s->loop, s->pos)) c = s->loop;
+
+		if (!c)
+		{
+			// not buffered, read it next and wait for it
+			if (!s->busy || s->stale || s->target == s->loop)
+			{
+				stream_collect(s, true);
+				if (!s->count || !in_chunk(&s->ring[s->head], s->pos)) ring_reset(s, s->pos);
+				if (!s->count) stream_start(s, &s->ring[s->head], s->pos);
+			}
+			stream_collect(s, true);
+			continue;
+		}
+
+		uint32_t n = c->offset + c->len - s->pos;
+		if (n > len) n = len;
+		memcpy(buf, c->data + (s->pos - c->offset), n);
+		buf += n;
+		len -= n;
+		s->pos += n;
+
+		if (c != s->loop && s->pos >= c->offset + c->len)
+		{
+			s->head = (s->head + 1) % MSU_AHEAD;
+			s->count--;
+			if (!s->count && !s->busy) s->next = s->pos;
+		}
+	}
+
+	msu_stream_poll(s);
+}
+
+void msu_stream_poll(msu_stream_t *s)
+{
+	if (!s) return;
+
+	stream_collect(s, false);
+	if (s->busy) return;
+
+	if (s->loop_read)
+	{
+		stream_start(s, s->loop, s->loop_read);
+		s->loop_read = 0;
+		return;
+	}
+
+	if (s->count >= MSU_AHEAD || s->next >= s->size) return;
+
+	stream_start(s, &s->ring[(s->head + s->count) % MSU_AHEAD], s->next);
+}
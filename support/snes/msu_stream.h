@@ -0,0 +1,32 @@
+#ifndef MSU_STREAM_H
+#define MSU_STREAM_H
+
+#include <inttypes.h>
+
+// Read-ahead for MSU-1 audio tracks. A ring of chunks ahead of the play
+// position and the chunk at the loop point are read on an offload worker,
+// so sector requests and loop jumps are served from memory even when the
+// pack is on slow storage (USB, CIFS). Reads run on the OFFLOAD_STREAM
+// worker, so they don't queue behind disk I/O on HIGH. All calls are from
+// the main thread.
+
+struct msu_stream_t;
+
+// Opens the track and starts reading its first chunk. Null if it can't
+// be opened.
+msu_stream_t *msu_stream_open(const char *path);
+
+// Never blocks, a read in flight finishes and closes the file on the worker.
+void msu_stream_close(msu_stream_t *s);
+
+uint32_t msu_stream_size(msu_stream_t *s);
+void msu_stream_seek(msu_stream_t *s, uint32_t offset);
+
+// Copies len bytes at the play position and advances it, zero filled past
+// the end. Waits only if the data isn't buffered yet.
+void msu_stream_read(msu_stream_t *s, uint8_t *buf, uint32_t len);
+
+// Starts the next read ahead if there is room, call it regularly.
+void msu_stream_poll(msu_stream_t *s);
+
+#endif
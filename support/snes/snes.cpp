@@ -9,6 +9,8 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../latency.h"
+#include "msu_stream.h"
 
 static uint8_t hdr[512];
 
@@ -357,7 +359,7 @@ static char snes_romFileName[1024] = {};
 static char SelectedPath[1024] = {};
 static uint8_t buf[1024];
 static char has_cd = 0;
-static fileTYPE f_audio = {};
+static msu_stream_t *msu_audio = NULL;
 
 static void msu_send_command(uint64_t cmd)
 {
@@ -368,12 +370,11 @@ static void msu_send_command(uint64_t cmd)
 	DisableIO();
 }
 
-static int msu_send_data(fileTYPE *f, int idx)
+static int msu_send_data(msu_stream_t *s, int idx)
 {
 	int chunk = sizeof(buf);
 
-	memset(buf, 0, chunk);
-	if (f->size) FileReadAdv(f, buf, chunk);
+	msu_stream_read(s, buf, chunk);
 
 	user_io_set_index(idx);
 	user_io_set_download(1);
@@ -386,7 +387,8 @@ static int msu_send_data(fileTYPE *f, int idx)
 void snes_msu_init(const char* name)
 {
 	static fileTYPE f = {};
-	FileClose(&f_audio);
+	msu_stream_close(msu_audio);
+	msu_audio = NULL;
 
 	memset(snes_romFileName, 0, 1024);
 	int extSize = strlen(strrchr(name, '.'));
@@ -411,6 +413,7 @@ void snes_msu_init(const char* name)
 
 void snes_poll(void)
 {
+	LATENCY_FUNCTION();
 	static uint8_t last_req = 255;
 	if (!has_cd) return;
 
@@ -434,19 +437,20 @@ void snes_poll(void)
 		case 0x35:
 			snprintf(SelectedPath, sizeof(SelectedPath), "%s-%d.pcm", snes_romFileName, data);
 			printf("MSU: New track selected: %s\n", SelectedPath);
-			FileOpen(&f_audio, SelectedPath);
-			printf(f_audio.size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
-			msu_send_command((f_audio.size << 16) | MSU_AUDIO_TRACK_MOUNTED);
+			msu_stream_close(msu_audio);
+			msu_audio = msu_stream_open(SelectedPath);
+			printf(msu_audio ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
+			msu_send_command(((uint64_t)msu_stream_size(msu_audio) << 16) | MSU_AUDIO_TRACK_MOUNTED);
 			break;
 
 		case 0x36:
 			printf("MSU: Jump to offset: 0x%X\n", data * 1024);
-			FileSeek(&f_audio, data * 1024, SEEK_SET);
+			msu_stream_seek(msu_audio, data * 1024);
 			// fallthrough
 
 		case 0x34:
 			// Next sector requested
-			msu_send_data(&f_audio, 2);
+			msu_send_data(msu_audio, 2);
 			break;
 		}
 	}
@@ -454,4 +458,6 @@ void snes_poll(void)
 	{
 		DisableIO();
 	}
+
+	msu_stream_poll(msu_audio);
 }
@@ -9,6 +9,7 @@
 #include "../../user_io.h"
 #include "../../fpga_io.h"
 #include "st_tos.h"
+#include "../../latency.h"
 
 #define ST_WRITE_MEMORY 0x08
 #define ST_READ_MEMORY  0x09
@@ -440,6 +441,7 @@ char tos_cartridge_is_inserted()
 
 void tos_poll()
 {
+	LATENCY_FUNCTION();
 	static unsigned long timer = 0;
 
 	get_dmastate();
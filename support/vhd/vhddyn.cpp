@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <byteswap.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "vhddyn.h"
+#include "../../scheduler.h"
+#include "../../hardware.h"
+
+#define VHD_TYPE_FIXED      2
+#define VHD_TYPE_DYNAMIC    3
+#define VHD_TYPE_DIFF       4
+#define VHD_UNUSED          0xFFFFFFFF
+#define FOOTER_DELAY        1000
+#define FOOTER_BATCH        16  // new blocks before the footer is moved anyway
+#define MAX_VHDS            16
+
+struct vhd_t
+{
+	int fd;
+	bool writable;
+	uint8_t footer[512];
+
+	uint64_t size;
+	uint32_t block_size;
+	uint32_t bitmap_size;       // padded to whole sectors
+	uint64_t bat_offset;
+	std::vector<uint32_t> bat;  // host order, sector of the block bitmap
+	std::vector<uint8_t*> bitmaps;
+	uint64_t end;               // next block or footer position
+
+	uint32_t pending;           // blocks since the footer was written
+	unsigned long footer_timer;
+	pthread_mutex_t lock;
+};
+
+static vhd_t *vhds[MAX_VHDS] = {};
+
+static inline uint32_t be32(const uint8_t *p) { return bswap_32(*(const uint32_t*)p); }
+static inline uint64_t be64(const uint8_t *p) { return bswap_64(*(const uint64_t*)p); }
+
+static bool footer_valid(const uint8_t *f)
+{
+	if (memcmp(f, "conectix", 8)) return false;
+
+	uint32_t sum = 0;
+	for (int i = 0; i < 512; i++) if (i < 64 || i >= 68) sum += f[i];
+	return ~sum == be32(f + 64);
+}
+
+static bool write_footer(vhd_t *vhd)
+{
+	if (pwrite(vhd->fd, vhd->footer, 512, vhd->end) != 512 || ftruncate(vhd->fd, vhd->end + 512)) return false;
+
+	vhd->pending = 0;
+	return true;
+}
+
+static void vhd_poll()
+{
+	for (int i = 0; i < MAX_VHDS; i++)
+	{
+		vhd_t *vhd = vhds[i];
+		if (vhd && vhd->pending && CheckTimer(vhd->footer_timer)) vhd_flush(vhd);
+	}
+}
+
+vhd_t *vhd_open(const char *path, bool writable)
+{
+	static bool poll_added = false;
+	if (!poll_added)
+	{
+		scheduler_add_background(vhd_poll);
+		poll_added = true;
+	}
+
+	int slot = -1;
+	for (int i = 0; i < MAX_VHDS && slot < 0; i++) if (!vhds[i]) slot = i;
+	if (slot < 0) return nullptr;
+
+	int fd = open(path, (writable ? (O_RDWR | O_DSYNC) : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	struct stat64 st;
+	uint8_t footer[512], hdr[1024];
+	if (fstat64(fd, &st) < 0 || st.st_size < 2048 || pread(fd, footer, 512, st.st_size - 512) != 512)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	// the footer is moved in batches, after a power loss only the copy in front is valid
+	bool moved = !footer_valid(footer);
+	if (moved && (pread(fd, footer, 512, 0) != 512 || !footer_valid(footer) || be32(footer + 60) != VHD_TYPE_DYNAMIC))
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	uint32_t type = be32(footer + 60);
+	if (type != VHD_TYPE_DYNAMIC)
+	{
+		if (type == VHD_TYPE_DIFF) printf("VHD: differencing disks are not supported: %s\n", path);
+		close(fd);
+		return nullptr;
+	}
+
+	if (pread(fd, hdr, sizeof(hdr), be64(footer + 16)) != sizeof(hdr) || memcmp(hdr, "cxsparse", 8))
+	{
+		printf("VHD: invalid dynamic header: %s\n", path);
+		close(fd);
+		return nullptr;
+	}
+
+	vhd_t *vhd = new vhd_t();
+	vhd->fd = fd;
+	vhd->writable = writable;
+	memcpy(vhd->footer, footer, 512);
+	vhd->size = be64(footer + 48);
+	vhd->bat_offset = be64(hdr + 16);
+	vhd->block_size = be32(hdr + 32);
+	vhd->bitmap_size = ((vhd->block_size / 512 / 8) + 511) & ~511;
+
+	uint32_t entries = be32(hdr + 28);
+	if (!vhd->block_size || (vhd->block_size & 511) || entries > (1 << 24) || (uint64_t)entries * vhd->block_size < vhd->size)
+	{
+		printf("VHD: invalid block layout: %s\n", path);
+		close(fd);
+		delete vhd;
+		return nullptr;
+	}
+
+	vhd->bat.resize(entries);
+	vhd->bitmaps.resize(entries);
+	ssize_t blen = entries * sizeof(uint32_t);
+	if (pread(fd, vhd->bat.data(), blen, vhd->bat_offset) != blen)
+	{
+		printf("VHD: cannot read BAT: %s\n", path);
+		close(fd);
+		delete vhd;
+		return nullptr;
+	}
+
+	// new blocks go behind the last block, not behind whatever is at the end of the file
+	vhd->end = (vhd->bat_offset + blen + 511) & ~511ULL;
+	for (auto &b : vhd->bat)
+	{
+		b = bswap_32(b);
+		if (b == VHD_UNUSED) continue;
+
+		uint64_t block_end = (uint64_t)b * 512 + vhd->bitmap_size + vhd->block_size;
+		if (block_end > vhd->end) vhd->end = block_end;
+	}
+
+	pthread_mutex_init(&vhd->lock, NULL);
+	if (writable && (moved || (uint64_t)st.st_size != vhd->end + 512)) write_footer(vhd);
+
+	printf("VHD: dynamic disk %llu MB, %u KB blocks\n", (unsigned long long)(vhd->size >> 20), vhd->block_size >> 10);
+	vhds[slot] = vhd;
+	return vhd;
+}
+
+void vhd_close(vhd_t *vhd)
+{
+	if (!vhd) return;
+
+	vhd_flush(vhd);
+	for (int i = 0; i < MAX_VHDS; i++) if (vhds[i] == vhd) vhds[i] = nullptr;
+
+	for (auto bm : vhd->bitmaps) delete[] bm;
+	close(vhd->fd);
+	pthread_mutex_destroy(&vhd->lock);
+	delete vhd;
+}
+
+void vhd_flush(vhd_t *vhd)
+{
+	pthread_mutex_lock(&vhd->lock);
+	if (vhd->pending && !write_footer(vhd)) printf("VHD: cannot write footer\n");
+	pthread_mutex_unlock(&vhd->lock);
+}
+
+void vhd_flush_all()
+{
+	for (int i = 0; i < MAX_VHDS; i++) if (vhds[i]) vhd_flush(vhds[i]);
+}
+
+__off64_t vhd_size(vhd_t *vhd)
+{
+	return vhd->size;
+}
+
+void vhd_geometry(vhd_t *vhd, uint16_t *cylinders, uint8_t *heads, uint8_t *sectors)
+{
+	*cylinders = (vhd->footer[56] << 8) | vhd->footer[57];
+	*heads = vhd->footer[58];
+	*sectors = vhd->footer[59];
+}
+
+static uint8_t *get_bitmap(vhd_t *vhd, uint32_t block)
+{
+	uint8_t *bm = vhd->bitmaps[block];
+	if (!bm)
+	{
+		bm = new uint8_t[vhd->bitmap_size];
+		if (pread(vhd->fd, bm, vhd->bitmap_size, (__off64_t)vhd->bat[block] * 512) != (ssize_t)vhd->bitmap_size)
+		{
+			delete[] bm;
+			return 0;
+		}
+		vhd->bitmaps[block] = bm;
+	}
+	return bm;
+}
+
+static inline bool sector_used(const uint8_t *bm, uint32_t sector)
+{
+	return bm[sector >> 3] & (0x80 >> (sector & 7));
+}
+
+static bool read_block(vhd_t *vhd, uint32_t block, uint32_t ofs, uint8_t *dst, int len)
+{
+	if (vhd->bat[block] == VHD_UNUSED)
+	{
+		memset(dst, 0, len);
+		return true;
+	}
+
+	const uint8_t *bm = get_bitmap(vhd, block);
+	if (!bm) return false;
+
+	__off64_t data = (__off64_t)vhd->bat[block] * 512 + vhd->bitmap_size;
+	while (len > 0)
+	{
+		// run of sectors with the same state
+		uint32_t sector = ofs / 512;
+		bool used = sector_used(bm, sector);
+		uint32_t run_end = (sector + 1) * 512;
+		while (run_end < ofs + len && sector_used(bm, run_end / 512) == used) run_end += 512;
+
+		int cnt = ((run_end < ofs + len) ? run_end : ofs + len) - ofs;
+		if (!used) memset(dst, 0, cnt);
+		else if (pread(vhd->fd, dst, cnt, data + ofs) != cnt) return false;
+
+		dst += cnt;
+		ofs += cnt;
+		len -= cnt;
+	}
+
+	return true;
+}
+
+static bool alloc_block(vhd_t *vhd, uint32_t block)
+{
+	// bitmap and data are a hole until written, the footer follows later.
+	// The first bitmap sector is where the old footer was, so it's cleared.
+	static const uint8_t zero[512] = {};
+	uint64_t pos = vhd->end;
+	if (ftruncate(vhd->fd, pos + vhd->bitmap_size + vhd->block_size) || pwrite(vhd->fd, zero, 512, pos) != 512) return false;
+
+	uint32_t entry = bswap_32((uint32_t)(pos / 512));
+	if (pwrite(vhd->fd, &entry, 4, vhd->bat_offset + block * 4) != 4) return false;
+
+	vhd->bat[block] = pos / 512;
+	vhd->bitmaps[block] = (uint8_t*)memset(new uint8_t[vhd->bitmap_size], 0, vhd->bitmap_size);
+	vhd->end = pos + vhd->bitmap_size + vhd->block_size;
+
+	if (!vhd->pending) vhd->footer_timer = GetTimer(FOOTER_DELAY);
+	if (++vhd->pending >= FOOTER_BATCH) write_footer(vhd);
+	return true;
+}
+
+static bool write_block(vhd_t *vhd, uint32_t block, uint32_t ofs, const uint8_t *src, int len)
+{
+	if (vhd->bat[block] == VHD_UNUSED && !alloc_block(vhd, block)) return false;
+
+	uint8_t *bm = get_bitmap(vhd, block);
+	if (!bm) return false;
+
+	__off64_t base = (__off64_t)vhd->bat[block] * 512;
+	if (pwrite(vhd->fd, src, len, base + vhd->bitmap_size + ofs) != len) return false;
+
+	// bitmap sectors are written only when a sector is used for the first time
+	uint32_t first = ofs / 512, last = (ofs + len - 1) / 512;
+	int lo = -1, hi = -1;
+	for (uint32_t s = first; s <= last; s++)
+	{
+		if (sector_used(bm, s)) continue;
+
+		bm[s >> 3] |= 0x80 >> (s & 7);
+		if (lo < 0) lo = (s >> 3) & ~511;
+		hi = (s >> 3) | 511;
+	}
+
+	return lo < 0 || pwrite(vhd->fd, bm + lo, hi - lo + 1, base + lo) == hi - lo + 1;
+}
+
+int vhd_read(vhd_t *vhd, __off64_t offset, void *buf, int len)
+{
+	if (len <= 0 || offset >= (__off64_t)vhd->size) return 0;
+	if (offset + len > (__off64_t)vhd->size) len = vhd->size - offset;
+
+	uint8_t *dst = (uint8_t*)buf;
+	bool ok = true;
+
+	pthread_mutex_lock(&vhd->lock);
+	for (int done = 0; ok && done < len;)
+	{
+		__off64_t pos = offset + done;
+		uint32_t block = pos / vhd->block_size;
+		uint32_t ofs = pos % vhd->block_size;
+		int cnt = vhd->block_size - ofs;
+		if (cnt > len - done) cnt = len - done;
+
+		ok = read_block(vhd, block, ofs, dst + done, cnt);
+		done += cnt;
+	}
+	pthread_mutex_unlock(&vhd->lock);
+
+	return ok ? len : 0;
+}
+
+int vhd_write(vhd_t *vhd, __off64_t offset, const void *buf, int len)
+{
+	if (!vhd->writable || len <= 0 || offset >= (__off64_t)vhd->size) return 0;
+	if (offset + len > (__off64_t)vhd->size) len = vhd->size - offset;
+
+	const uint8_t *src = (const uint8_t*)buf;
+	bool ok = true;
+
+	pthread_mutex_lock(&vhd->lock);
+	for (int done = 0; ok && done < len;)
+	{
+		__off64_t pos = offset + done;
+		uint32_t block = pos / vhd->block_size;
+		uint32_t ofs = pos % vhd->block_size;
+		int cnt = vhd->block_size - ofs;
+		if (cnt > len - done) cnt = len - done;
+
+		ok = write_block(vhd, block, ofs, src + done, cnt);
+		done += cnt;
+	}
+	pthread_mutex_unlock(&vhd->lock);
+
+	if (!ok) printf("VHD: write error at %llu\n", (unsigned long long)offset);
+	return ok ? len : 0;
+}
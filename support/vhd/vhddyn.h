@@ -0,0 +1,30 @@
+#ifndef VHD_DYN_H
+#define VHD_DYN_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+// Dynamic (sparse) VHD images. The block allocation table and the sector
+// bitmaps are kept in memory, new blocks are appended and the footer is
+// moved behind them in batches. Fixed VHDs are plain images and don't need
+// this, differencing disks are not supported.
+
+struct vhd_t;
+
+// Path must be absolute. Returns null if the file is not a dynamic VHD.
+vhd_t *vhd_open(const char *path, bool writable);
+void vhd_close(vhd_t *vhd);
+
+// Both are thread safe. Access past the end is cut off, 0 on error.
+int vhd_read(vhd_t *vhd, __off64_t offset, void *buf, int len);
+int vhd_write(vhd_t *vhd, __off64_t offset, const void *buf, int len);
+
+// Size of the virtual disk.
+__off64_t vhd_size(vhd_t *vhd);
+void vhd_geometry(vhd_t *vhd, uint16_t *cylinders, uint8_t *heads, uint8_t *sectors);
+
+// Writes the pending footer.
+void vhd_flush(vhd_t *vhd);
+void vhd_flush_all();
+
+#endif
@@ -39,6 +39,7 @@
 #include "../../shmem.h"
 #include "../../ide.h"
 #include "x86_share.h"
+#include "../../latency.h"
 
 #define FDD0_BASE   0xF200
 #define FDD1_BASE   0xF300
@@ -300,13 +301,7 @@ static void x86_dma_recvbuf(uint32_t address, uint32_t length, uint32_t *data)
 
 static int mem_set(uint32_t offset, uint8_t fill_byte, uint32_t size)
 {
-	void *buf = shmem_map(SHMEM_ADDR + offset, size);
-	if (!buf) return 0;
-
-	memset(buf, fill_byte, size);
-	shmem_unmap(buf, size);
-
-	return 1;
+	return shmem_set(SHMEM_ADDR + offset, fill_byte, size);
 }
 
 static int load_rom(const char* name, uint32_t mem_offset)
@@ -755,6 +750,7 @@ static void fdd_io(uint8_t read)
 
 void x86_poll(int only_ide)
 {
+	LATENCY_FUNCTION();
 	if(!only_ide) x86_share_poll();
 
 	uint16_t sd_req = ide_check();
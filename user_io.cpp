@@ -10,8 +10,6 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 
-#include "lib/imlib2/Imlib2.h"
-
 #include "hardware.h"
 #include "osd.h"
 #include "user_io.h"
@@ -36,6 +34,12 @@
 #include "ide.h"
 #include "ide_cdrom.h"
 #include "profiling.h"
+#include "offload.h"
+#include "latency.h"
+#include "input_latency.h"
+#include "block_cache.h"
+#include "disk_overlay.h"
+#include "support/vhd/vhddyn.h"
 
 #include "support.h"
 
@@ -49,6 +53,9 @@ static fileTYPE sd_image[16] = {};
 #define  SD_TYPE_A2 2
 
 static int      sd_type[16] = {};
+static block_cache_t *sd_cache[16] = {};
+static disk_overlay_t *sd_ovl[16] = {};
+static vhd_t *sd_vhd[16] = {};
 static int      sd_image_cangrow[16] = {};
 static uint64_t buffer_lba[16] = { ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,
 								   ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,
@@ -1686,40 +1693,45 @@ int user_io_get_joyswap()
 
 void user_io_l_analog_joystick(unsigned char joystick, char valueX, char valueY)
 {
+	input_latency_send();
 	uint8_t joy = (joystick > 1 || !joyswap) ? joystick : (joystick >= 15) ? (joystick ^ 16) : (joystick ^ 1);
 
 	if (core_type == CORE_TYPE_8BIT)
 	{
-		spi_uio_cmd8_cont(UIO_ASTICK, joy);
-		if(io_ver) spi_w((valueY << 8) | (uint8_t)(valueX));
+		uint16_t w[4] = { UIO_ASTICK, joy };
+		int n = 2;
+		if (io_ver) w[n++] = (valueY << 8) | (uint8_t)(valueX);
 		else
 		{
-			spi8(valueX);
-			spi8(valueY);
+			w[n++] = (uint8_t)valueX;
+			w[n++] = (uint8_t)valueY;
 		}
-		DisableIO();
+		spi_uio_queue(UIO_QUEUE_KEY(UIO_ASTICK, joy), w, n);
 	}
 }
 
 void user_io_r_analog_joystick(unsigned char joystick, char valueX, char valueY)
 {
+	input_latency_send();
 	uint8_t joy = (joystick > 1 || !joyswap) ? joystick : (joystick ^ 1);
 
 	if (core_type == CORE_TYPE_8BIT)
 	{
-		spi_uio_cmd8_cont(UIO_ASTICK_2, joy);
-		if (io_ver) spi_w((valueY << 8) | (uint8_t)(valueX));
+		uint16_t w[4] = { UIO_ASTICK_2, joy };
+		int n = 2;
+		if (io_ver) w[n++] = (valueY << 8) | (uint8_t)(valueX);
 		else
 		{
-			spi8(valueX);
-			spi8(valueY);
+			w[n++] = (uint8_t)valueX;
+			w[n++] = (uint8_t)valueY;
 		}
-		DisableIO();
+		spi_uio_queue(UIO_QUEUE_KEY(UIO_ASTICK_2, joy), w, n);
 	}
 }
 
 void user_io_digital_joystick(unsigned char joystick, uint64_t map, int newdir)
 {
+	input_latency_send();
 	uint8_t joy = (joystick>1 || !joyswap) ? joystick : joystick ^ 1;
 	static int use32 = 0;
 	// primary button mappings are in 31:0, alternate mappings are in 64:32.
@@ -1727,10 +1739,9 @@ void user_io_digital_joystick(unsigned char joystick, uint64_t map, int newdir)
 	// by other mapping being pressed
 	uint32_t bitmask = (uint32_t)(map) | (uint32_t)(map >> 32);
 	use32 |= bitmask >> 16;
-	spi_uio_cmd_cont((joy < 2) ? (UIO_JOYSTICK0 + joy) : (UIO_JOYSTICK2 + joy - 2));
-	spi_w(bitmask);
-	if(use32) spi_w(bitmask >> 16);
-	DisableIO();
+	uint16_t cmd = (joy < 2) ? (UIO_JOYSTICK0 + joy) : (UIO_JOYSTICK2 + joy - 2);
+	uint16_t w[3] = { cmd, (uint16_t)bitmask, (uint16_t)(bitmask >> 16) };
+	spi_uio_queue(UIO_QUEUE_KEY(cmd, 0), w, use32 ? 3 : 2);
 
 	if (!is_minimig() && joy_transl == 1 && newdir)
 	{
@@ -2012,6 +2023,55 @@ void user_io_file_info(const char *ext)
 	DisableFpga();
 }
 
+// Hard disk images by extension, floppies and the like never get an overlay.
+static bool sd_image_is_hdd(const char *name)
+{
+	static const char *exts[] = { ".hdf", ".vhd", ".img", ".hdd", ".hdv" };
+
+	int len = strlen(name);
+	for (const char *ext : exts)
+	{
+		if (len > 4 && !strcasecmp(name + len - 4, ext)) return true;
+	}
+	return false;
+}
+
+// Generic writable images go through a write-back cache so sector writes
+// don't stall the poll loop. Fixed size hard disk images may run on a
+// copy-on-write overlay instead, which makes read-only ones writable.
+// Dynamic VHDs are translated. Images with their own handlers (C64 GCR,
+// Apple II, N64 saves) keep writing directly.
+static int sd_image_attach(int index, const char *name, int writable)
+{
+	if (sd_type[index] != SD_TYPE_DEFAULT || is_n64() || !sd_image[index].filp) return writable;
+
+	int len = strlen(name);
+	if (len > 4 && !strcasecmp(name + len - 4, ".vhd")) sd_vhd[index] = vhd_open(getFullPath(name), writable);
+	if (sd_vhd[index])
+	{
+		sd_image[index].size = vhd_size(sd_vhd[index]);
+		return writable;
+	}
+
+	if (!sd_image_cangrow[index] && sd_image_is_hdd(name)) sd_ovl[index] = disk_overlay_open(getFullPath(name), cfg.disk_overlay);
+	if (sd_ovl[index]) return 1;
+
+	if (writable)
+	{
+		sd_cache[index] = block_cache_open(getFullPath(name));
+		if (sd_cache[index]) printf("Write-back cache enabled on %d slot\n", index);
+	}
+	return writable;
+}
+
+static int sd_image_read(int disk, uint64_t offset, void *buf, int len)
+{
+	if (sd_vhd[disk]) return vhd_read(sd_vhd[disk], offset, buf, len);
+	if (sd_ovl[disk]) return disk_overlay_read(sd_ovl[disk], offset, buf, len);
+	if (sd_cache[disk]) return block_cache_read(sd_cache[disk], offset, buf, len);
+	return FileSeek(&sd_image[disk], offset, SEEK_SET) && FileReadAdv(&sd_image[disk], buf, len);
+}
+
 int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_size)
 {
 	int writable = 0;
@@ -2021,6 +2081,13 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 
 	sd_image_cangrow[index] = (pre != 0);
 	sd_type[index] = SD_TYPE_DEFAULT ;
+
+	block_cache_close(sd_cache[index]);
+	sd_cache[index] = nullptr;
+	disk_overlay_close(sd_ovl[index]);
+	sd_ovl[index] = nullptr;
+	vhd_close(sd_vhd[index]);
+	sd_vhd[index] = nullptr;
 	if (len)
 	{
 		if (!ret)
@@ -2092,6 +2159,8 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 		c64_closeGCR(index);
 	}
 
+	if (ret) writable = sd_image_attach(index, name, writable);
+
 	buffer_lba[index] = -1;
 	if (!index || is_cdi() || (is_saturn() && index==1)) use_save = pre;
 
@@ -2570,6 +2639,71 @@ int user_io_file_tx_a(const char* name, uint16_t index)
 	return 1;
 }
 
+#define FILE_TX_STREAM_CHUNK (128 * 1024)
+
+// Streams the file over the SPI download channel. The next chunk is read
+// (and CRC'ed) by a worker while the current one is being sent, so SD/USB
+// latency overlaps with the FPGA transfer instead of adding to it.
+static void user_io_file_tx_stream(fileTYPE *f, uint32_t bytes2send, uint32_t skip, int use_progress)
+{
+	static uint8_t *stream_buf[2] = {};
+	if (!stream_buf[0])
+	{
+		stream_buf[0] = (uint8_t*)malloc(FILE_TX_STREAM_CHUNK * 2);
+		if (!stream_buf[0])
+		{
+			printf("user_io_file_tx_stream: cannot allocate buffers.\n");
+			return;
+		}
+		stream_buf[1] = stream_buf[0] + FILE_TX_STREAM_CHUNK;
+	}
+
+	const uint32_t size = bytes2send;
+	uint32_t chunk_len[2] = {};
+	uint32_t crc = file_crc;
+	uint32_t requested = 0;
+	uint32_t sent = 0;
+	int cur = 0;
+
+	auto read_chunk = [f, size, &requested, &skip, &crc, &chunk_len](int n)
+	{
+		uint32_t chunk = size - requested;
+		if (chunk > FILE_TX_STREAM_CHUNK) chunk = FILE_TX_STREAM_CHUNK;
+		requested += chunk;
+		chunk_len[n] = chunk;
+
+		uint8_t *buf = stream_buf[n];
+		return offload_add_work([f, buf, chunk, &skip, &crc]
+		{
+			FileReadAdv(f, buf, chunk);
+			if (skip >= chunk) skip -= chunk;
+			else
+			{
+				crc = crc32(crc, buf + skip, chunk - skip);
+				skip = 0;
+			}
+		}, OFFLOAD_HIGH);
+	};
+
+	offload_handle_t pending = read_chunk(cur);
+	while (sent < size)
+	{
+		offload_wait(pending);
+
+		// only one read is in flight at a time so file position and crc stay ordered
+		if (requested < size) pending = read_chunk(cur ^ 1);
+
+		user_io_file_tx_data(stream_buf[cur], chunk_len[cur]);
+		sent += chunk_len[cur];
+		cur ^= 1;
+
+		if (use_progress) ProgressMessage("Loading", f->name, sent, size);
+	}
+
+	offload_wait(pending);
+	file_crc = crc;
+}
+
 int user_io_file_tx(const char* name, unsigned char index, char opensave, char mute, char composite, uint32_t load_addr)
 {
 	fileTYPE f = {};
@@ -2758,8 +2892,13 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			shmem_unmap(mem, map_size);
 		}
 	}
+	else if (dosend && snes_file != SNES_FILE_BS)
+	{
+		user_io_file_tx_stream(&f, bytes2send, skip, use_progress);
+	}
 	else
 	{
+		// BS header patching depends on 4K chunks
 		while (dosend && bytes2send)
 		{
 			uint32_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
@@ -2923,6 +3062,7 @@ void user_io_send_buttons(char force)
 		//special reset for some cores
 		if (!user_io_osd_is_visible() && (key_map & BUTTON2) && !(map & BUTTON2))
 		{
+			block_cache_flush_all(false);
 			if (is_minimig()) minimig_reset();
 			if (is_megacd()) mcd_reset();
 			if (is_neogeo_cd()) neocd_reset();
@@ -2936,7 +3076,8 @@ void user_io_send_buttons(char force)
 
 		key_map = map;
 		if (user_io_osd_is_visible()) map &= ~BUTTON2;
-		spi_uio_cmd16(UIO_BUT_SW, map);
+		uint16_t w[2] = { UIO_BUT_SW, (uint16_t)map };
+		spi_uio_queue(UIO_QUEUE_KEY(UIO_BUT_SW, 0), w, 2);
 		printf("sending keymap: %X\n", map);
 	}
 }
@@ -3003,9 +3144,14 @@ static int coldreset_req = 0;
 
 static uint32_t res_timer = 0;
 
+static void screenshot_poll(bool wait);
+
 void user_io_poll()
 {
 	PROFILE_FUNCTION();
+	LATENCY_FUNCTION();
+
+	screenshot_poll(false);
 
 	if ((core_type != CORE_TYPE_SHARPMZ) &&
 		(core_type != CORE_TYPE_8BIT))
@@ -3190,6 +3336,7 @@ void user_io_poll()
 						if (FileWriteAdv(&sd_image[disk], buffer[disk], sz))
 						{
 							sd_image[disk].size = sz;
+							sd_image_attach(disk, sd_image[disk].path, 1);
 						}
 					}
 					else
@@ -3204,7 +3351,29 @@ void user_io_poll()
 					if (sz && lba <= size)
 					{
 						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						if (sd_vhd[disk])
+						{
+							vhd_write(sd_vhd[disk], lba * blksz, buffer[disk], sz);
+						}
+						else if (sd_ovl[disk])
+						{
+							disk_overlay_write(sd_ovl[disk], lba * blksz, buffer[disk], sz);
+						}
+						else if (sd_cache[disk])
+						{
+							if (!sd_image_cangrow[disk])
+							{
+								__off64_t rem = sd_image[disk].size - lba * blksz;
+								sz = (rem >= sz) ? sz : (int)rem;
+							}
+
+							if (sz)
+							{
+								block_cache_write(sd_cache[disk], lba * blksz, buffer[disk], sz);
+								sd_image[disk].size = block_cache_size(sd_cache[disk]);
+							}
+						}
+						else if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
 						{
 							if (!sd_image_cangrow[disk])
 							{
@@ -3257,13 +3426,10 @@ void user_io_poll()
 					else if (sd_image[disk].size)
 					{
 						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						if (sd_image_read(disk, lba * blksz, buffer[disk], sizeof(buffer[disk])))
 						{
-							if (FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
-							{
-								done = 1;
-								buffer_lba[disk] = lba;
-							}
+							done = 1;
+							buffer_lba[disk] = lba;
 						}
 					}
 
@@ -3336,8 +3502,7 @@ void user_io_poll()
 						cdi_read_cd(buffer[disk], lba, buf_n);
 						buffer_lba[disk] = lba;
 					}
-					else if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET) &&
-						FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
+					else if (sd_image_read(disk, lba * blksz, buffer[disk], sizeof(buffer[disk])))
 					{
 						buffer_lba[disk] = lba;
 					}
@@ -3826,10 +3991,11 @@ static void send_keycode(unsigned short key, int press)
 		{
 			if (press > 1 && !use_ps2ctl) return;
 
-			spi_uio_cmd_cont(UIO_KEYBOARD);
+			uint16_t w[4] = { UIO_KEYBOARD };
+			int n = 1;
 
 			// prepend extended code flag if required
-			if (code & EXT) spi8(0xe0);
+			if (code & EXT) w[n++] = 0xe0;
 
 			// prepend break code if required
             if (!press)
@@ -3837,12 +4003,12 @@ static void send_keycode(unsigned short key, int press)
                 if (ps2_kbd_scan_set == 1)
                         code |= 0x80;
                     else
-                        spi8(0xf0);
+                        w[n++] = 0xf0;
             }
 			// send code itself
-			spi8(code & 0xff);
+			w[n++] = code & 0xff;
 
-			DisableIO();
+			spi_uio_queue(0, w, n);
 		}
 	}
 
@@ -3854,18 +4020,19 @@ static void send_keycode(unsigned short key, int press)
 		{
 			if (press > 1 && !use_ps2ctl) return;
 
-			spi_uio_cmd_cont(UIO_KEYBOARD);
+			uint16_t w[4] = { UIO_KEYBOARD };
+			int n = 1;
 
 			// prepend extended code flag if required
-			if (code & EXT) spi8(0xe0);
+			if (code & EXT) w[n++] = 0xe0;
 
 			// prepend break code if required
-			if (!press) spi8(0xf0);
+			if (!press) w[n++] = 0xf0;
 
 			// send code itself
-			spi8(code & 0xff);
+			w[n++] = code & 0xff;
 
-			DisableIO();
+			spi_uio_queue(0, w, n);
 		}
 	}
 }
@@ -3873,6 +4040,7 @@ static void send_keycode(unsigned short key, int press)
 void user_io_mouse(unsigned char b, int16_t x, int16_t y, int16_t w)
 {
 	if (osd_is_visible && !is_menu()) return;
+	input_latency_send();
 
 	switch (core_type)
 	{
@@ -3949,11 +4117,14 @@ void user_io_mouse(unsigned char b, int16_t x, int16_t y, int16_t w)
 
 			if (!osd_is_visible)
 			{
-				spi_uio_cmd_cont(UIO_MOUSE);
-				spi_w(ps2_mouse[0] | ((w & 0x7f) << 8));
-				spi_w(ps2_mouse[1] | ((((uint16_t)b) << 5) & 0xF00));
-				spi_w(ps2_mouse[2] | ((((uint16_t)b) << 1) & 0x100));
-				DisableIO();
+				// relative movement, never coalesced
+				uint16_t words[4] = {
+					UIO_MOUSE,
+					(uint16_t)(ps2_mouse[0] | ((w & 0x7f) << 8)),
+					(uint16_t)(ps2_mouse[1] | ((((uint16_t)b) << 5) & 0xF00)),
+					(uint16_t)(ps2_mouse[2] | ((((uint16_t)b) << 1) & 0x100))
+				};
+				spi_uio_queue(0, words, 4);
 			}
 		}
 		return;
@@ -4011,6 +4182,7 @@ void user_io_osd_key_enable(char on)
 
 void user_io_kbd(uint16_t key, int press)
 {
+	input_latency_send();
 	static int block_F12 = 0;
 
 	if(is_menu()) spi_uio_cmd(UIO_KEYBOARD); //ping the Menu core to wakeup
@@ -4200,96 +4372,206 @@ uint16_t user_io_get_sdram_cfg()
 	return sdram_cfg;
 }
 
-static struct { const char *fmtstr; Imlib_Load_Error errno; } err_strings[] = {
-  {"file '%s' does not exist", IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST},
-  {"file '%s' is a directory", IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY},
-  {"permission denied to read file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ},
-  {"no loader for the file format used in file '%s'", IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT},
-  {"path for file '%s' is too long", IMLIB_LOAD_ERROR_PATH_TOO_LONG},
-  {"a component of path '%s' does not exist", IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT},
-  {"a component of path '%s' is not a directory", IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY},
-  {"path '%s' has too many symbolic links", IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS},
-  {"ran out of file descriptors trying to access file '%s'", IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS},
-  {"denied write permission for file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE},
-  {"out of disk space writing to file '%s'", IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE},
-  {(const char *)NULL, (Imlib_Load_Error) 0}
+// The frame is only copied out of the scaler buffer on the main thread.
+// Scaling, PNG encoding and writing run on a worker so input doesn't stall.
+// Imlib2 isn't thread safe (video.cpp uses it), miniz encodes instead.
+struct screenshot_t
+{
+	uint8_t *rgb;
+	int width, height;
+	int out_width, out_height;
+	char name[1024];
+	char path[1024];
+	bool ok;
+	offload_handle_t job;
 };
 
-static void print_imlib_load_error (Imlib_Load_Error err, const char *filepath) {
-  int i;
-  for (i = 0; err_strings[i].fmtstr != NULL; i++) {
-    if (err == err_strings[i].errno) {
-	printf("Screenshot Error (%d): ",err);
-	printf(err_strings[i].fmtstr,filepath);
-	printf("\n");
-      return ;
-    }
-  }
-  /* Unrecognised error */
-    printf("Screenshot Error (%d): unrecognized error accessing file '%s'\n",err,filepath);
-  return ;
+#define SCREENSHOT_MAX 4
+static screenshot_t *screenshots[SCREENSHOT_MAX];
+static int screenshot_count = 0;
+
+// Bilinear with aligned pixel centers, weights in 1/256.
+static void screenshot_scale(const uint8_t *src, int sw, int sh, uint8_t *dst, int dw, int dh)
+{
+	int *xs = (int*)malloc(dw * 3 * sizeof(int));
+	if (!xs) return;
+
+	for (int x = 0; x < dw; x++)
+	{
+		int p = (int)(((int64_t)(2 * x + 1) * sw * 256) / (2 * dw)) - 128;
+		if (p < 0) p = 0;
+		if (p > (sw - 1) * 256) p = (sw - 1) * 256;
+		xs[x * 3 + 0] = (p >> 8) * 3;
+		xs[x * 3 + 1] = ((p >> 8) < sw - 1) ? xs[x * 3] + 3 : xs[x * 3];
+		xs[x * 3 + 2] = p & 255;
+	}
+
+	for (int y = 0; y < dh; y++)
+	{
+		int p = (int)(((int64_t)(2 * y + 1) * sh * 256) / (2 * dh)) - 128;
+		if (p < 0) p = 0;
+		if (p > (sh - 1) * 256) p = (sh - 1) * 256;
+
+		const uint8_t *r0 = src + (p >> 8) * sw * 3;
+		const uint8_t *r1 = ((p >> 8) < sh - 1) ? r0 + sw * 3 : r0;
+		int wy = p & 255;
+
+		for (int x = 0; x < dw; x++)
+		{
+			int a = xs[x * 3], b = xs[x * 3 + 1], wx = xs[x * 3 + 2];
+			for (int c = 0; c < 3; c++)
+			{
+				int top = r0[a + c] * (256 - wx) + r0[b + c] * wx;
+				int bot = r1[a + c] * (256 - wx) + r1[b + c] * wx;
+				*dst++ = (top * (256 - wy) + bot * wy + 32768) >> 16;
+			}
+		}
+	}
+
+	free(xs);
 }
 
-bool user_io_screenshot(const char *pngname, int rescale)
+static void screenshot_encode(screenshot_t *s)
 {
-	mister_scaler *ms = mister_scaler_init();
-	if (ms == NULL)
+	const uint8_t *img = s->rgb;
+	int w = s->width;
+	int h = s->height;
+
+	uint8_t *scaled = 0;
+	if (s->out_width > 0 && s->out_height > 0 && (s->out_width != w || s->out_height != h))
 	{
-		printf("problem with scaler, maybe not a new enough version\n");
-		Info("Scaler not compatible");
-		return false;
+		scaled = (uint8_t*)malloc(s->out_width * s->out_height * 3);
+		if (scaled)
+		{
+			screenshot_scale(img, w, h, scaled, s->out_width, s->out_height);
+			img = scaled;
+			w = s->out_width;
+			h = s->out_height;
+		}
+	}
+
+	size_t len = 0;
+	void *png = tdefl_write_image_to_png_file_in_memory_ex(img, w, h, 3, &len, 6, MZ_FALSE);
+	free(scaled);
+	if (!png)
+	{
+		printf("Screenshot Error: cannot encode '%s'\n", s->name);
+		return;
+	}
+
+	int fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0)
+	{
+		printf("Screenshot Error: cannot create '%s'\n", s->path);
 	}
 	else
 	{
-    int scwidth = ms->output_width;
-    int scheight = ms->output_height;
+		s->ok = write(fd, png, len) == (ssize_t)len;
+		if (!s->ok) printf("Screenshot Error: cannot write '%s'\n", s->path);
+		close(fd);
+	}
 
-    if (video_get_rotated())
-    {
+	mz_free(png);
+}
 
-      //If the video is rotated, the scaled output resolution results in a squished image.
-      //Calculate the scaled output res using the original AR
-      scwidth = scheight * ((float)ms->width/ms->height);
-    }
+// Reports finished screenshots, or waits for all of them.
+static void screenshot_poll(bool wait)
+{
+	int n = 0;
+	for (int i = 0; i < screenshot_count; i++)
+	{
+		screenshot_t *s = screenshots[i];
+		if (!wait && !offload_done(s->job))
+		{
+			screenshots[n++] = s;
+			continue;
+		}
 
-		const char *basename = last_filename;
-		if( pngname && *pngname )
-			basename = pngname;
-		unsigned char *outputbuf = (unsigned char *)calloc(ms->width*ms->height * 4, 1);
-		// read the image into the outpubuf - RGBA format
-		mister_scaler_read_32(ms,outputbuf);
-		// using_data will keep a pointer and dispose of the outbuf
-		Imlib_Image im = imlib_create_image_using_data(ms->width,ms->height,(unsigned int *)outputbuf);
-		imlib_context_set_image(im);
-
-		static char filename[1024];
-		FileGenerateScreenshotName(basename, filename, 1024);
-
-		/* do we want to save a rescaled image? */
-		if (rescale)
+		offload_wait(s->job);
+		if (s->ok)
 		{
-			Imlib_Image im_scaled=imlib_create_cropped_scaled_image(0,0,ms->width,ms->height,scwidth,scheight);
-			imlib_free_image_and_decache();
-			imlib_context_set_image(im_scaled);
+			char msg[1024];
+			snprintf(msg, 1024, "Screen saved to\n%s", s->name + strlen(SCREENSHOT_DIR"/"));
+			Info(msg);
 		}
-		Imlib_Load_Error error;
-		imlib_save_image_with_error_return(getFullPath(filename),&error);
-		if (error != IMLIB_LOAD_ERROR_NONE)
+		else
 		{
-			print_imlib_load_error (error, filename);
 			Info("error in saving png");
-			return false;
 		}
-		imlib_free_image_and_decache();
+
+		free(s->rgb);
+		delete s;
+	}
+	screenshot_count = n;
+}
+
+bool user_io_screenshot(const char *pngname, int rescale)
+{
+	mister_scaler *ms = mister_scaler_init();
+	if (ms == NULL)
+	{
+		printf("problem with scaler, maybe not a new enough version\n");
+		Info("Scaler not compatible");
+		return false;
+	}
+
+	int scwidth = ms->output_width;
+	int scheight = ms->output_height;
+
+	if (video_get_rotated())
+	{
+		//If the video is rotated, the scaled output resolution results in a squished image.
+		//Calculate the scaled output res using the original AR
+		scwidth = scheight * ((float)ms->width/ms->height);
+	}
+
+	// RGB24 as in the scaler buffer, just without the line padding
+	uint8_t *rgb = (uint8_t*)malloc(ms->width * ms->height * 3);
+	if (!rgb)
+	{
 		mister_scaler_free(ms);
-		free(outputbuf);
-		char msg[1024];
-		snprintf(msg, 1024, "Screen saved to\n%s", filename + strlen(SCREENSHOT_DIR"/"));
-		Info(msg);
+		Info("error in saving png");
+		return false;
+	}
+
+	screenshot_t *s = new screenshot_t();
+	s->rgb = rgb;
+	s->width = ms->width;
+	s->height = ms->height;
+	if (rescale)
+	{
+		s->out_width = scwidth;
+		s->out_height = scheight;
 	}
+
+	mister_scaler_read(ms, rgb);
+	mister_scaler_free(ms);
+
+	const char *basename = last_filename;
+	if( pngname && *pngname )
+		basename = pngname;
+
+	// numbered names count on the files being there already
+	FileGenerateScreenshotName(basename, s->name, sizeof(s->name));
+	bool clash = screenshot_count >= SCREENSHOT_MAX;
+	for (int i = 0; i < screenshot_count; i++) clash |= !strcmp(screenshots[i]->name, s->name);
+	if (clash)
+	{
+		screenshot_poll(true);
+		FileGenerateScreenshotName(basename, s->name, sizeof(s->name));
+	}
+	snprintf(s->path, sizeof(s->path), "%s", getFullPath(s->name));
+
+	s->job = offload_add_work([s] { screenshot_encode(s); }, OFFLOAD_LOW);
+	screenshots[screenshot_count++] = s;
 	return true;
 }
 
+void user_io_screenshot_wait()
+{
+	screenshot_poll(true);
+}
+
 void user_io_screenshot_cmd(const char *cmd)
 {
 	if( strncmp( cmd, "screenshot", 10 ))
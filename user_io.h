@@ -235,6 +235,7 @@ void user_io_rtc_reset();
 
 void user_io_screenshot_cmd(const char *cmd);
 bool user_io_screenshot(const char *pngname, int rescale);
+void user_io_screenshot_wait();
 
 const char* get_rbf_dir();
 const char* get_rbf_name();
@@ -11,6 +11,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <atomic>
 
 #include "hardware.h"
 #include "user_io.h"
@@ -3110,19 +3112,28 @@ void video_mode_adjust()
 	}
 }
 
+static std::atomic<uint32_t> fb_mode_param;
+static pthread_mutex_t fb_mode_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void fb_write_module_params()
 {
-	int width = fb_width;
-	int height = fb_height;
-	offload_add_work([=]
+	// A job running inline (queue full) may overtake a queued one, so each
+	// job writes the latest mode instead of the one it was submitted with.
+	fb_mode_param = (fb_width << 16) | fb_height;
+	offload_add_work([]
 	{
+		pthread_mutex_lock(&fb_mode_lock);
+		uint32_t mode = fb_mode_param;
+		int width = mode >> 16;
+		int height = mode & 0xFFFF;
 		FILE *fp = fopen("/sys/module/MiSTer_fb/parameters/mode", "wt");
 		if (fp)
 		{
 			fprintf(fp, "%d %d %d %d %d\n", 8888, 1, width, height, width * 4);
 			fclose(fp);
 		}
-	});
+		pthread_mutex_unlock(&fb_mode_lock);
+	}, OFFLOAD_HIGH);
 }
 
 void video_fb_enable(int enable, int n)
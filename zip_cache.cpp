@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "zip_cache.h"
+#include "file_io.h"
+#include "offload.h"
+
+#define MAX_INDEXES        8
+#define MAX_ARCHIVES       4
+#define INDEX_MIN_ENTRIES  64 // smaller archives are parsed as fast as the index is read
+#define INDEX_MAGIC        0x5844495A // "ZIDX"
+#define INDEX_VERSION      1
+#define INDEX_DIR          CONFIG_DIR "/zipindex"
+
+struct index_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t  size;
+	int64_t  mtime;
+	uint32_t count;
+	uint32_t names_len;
+	uint32_t path_len;
+	uint32_t reserved;
+};
+
+struct archive_slot_t
+{
+	mz_zip_archive zip; // must be first, handed out to callers
+	int fd;
+	std::string path;
+	int64_t size;
+	int64_t mtime;
+	int refs;
+	bool stale;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::shared_ptr<zip_index_t>> s_indexes; // most recent first
+static std::vector<archive_slot_t*> s_archives;             // most recent first
+
+static std::string lower(const char *str)
+{
+	std::string res(str);
+	for (auto &c : res) c = tolower(c);
+	return res;
+}
+
+int zip_index_t::locate(const char *name) const
+{
+	auto it = by_name.find(lower(name));
+	return (it == by_name.end()) ? -1 : (int)it->second;
+}
+
+int zip_index_t::find_crc(uint32_t crc32) const
+{
+	auto it = by_crc.find(crc32);
+	return (it == by_crc.end()) ? -1 : (int)it->second;
+}
+
+static bool stat_key(const char *path, int64_t *size, int64_t *mtime)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0) return false;
+
+	*size = st.st_size;
+	*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	return true;
+}
+
+static size_t archive_read(void *opaque, mz_uint64 ofs, void *buf, size_t n)
+{
+	ssize_t ret = pread(((archive_slot_t*)opaque)->fd, buf, n, ofs);
+	return (ret < 0) ? 0 : ret;
+}
+
+static void archive_close(archive_slot_t *slot)
+{
+	mz_zip_reader_end(&slot->zip);
+	close(slot->fd);
+	delete slot;
+}
+
+static void archive_trim()
+{
+	size_t kept = 0;
+	for (auto it = s_archives.begin(); it != s_archives.end();)
+	{
+		archive_slot_t *slot = *it;
+		if (!slot->refs && (slot->stale || kept >= MAX_ARCHIVES))
+		{
+			archive_close(slot);
+			it = s_archives.erase(it);
+			continue;
+		}
+
+		if (!slot->refs) kept++;
+		++it;
+	}
+}
+
+static mz_zip_archive *archive_get_locked(const char *zip_path, int64_t size, int64_t mtime)
+{
+	for (size_t i = 0; i < s_archives.size(); i++)
+	{
+		archive_slot_t *slot = s_archives[i];
+		if (slot->stale || slot->path != zip_path) continue;
+
+		if (slot->size != size || slot->mtime != mtime)
+		{
+			slot->stale = true;
+			continue;
+		}
+
+		slot->refs++;
+		s_archives.erase(s_archives.begin() + i);
+		s_archives.insert(s_archives.begin(), slot);
+		archive_trim();
+		return &slot->zip;
+	}
+
+	int fd = open(zip_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	archive_slot_t *slot = new archive_slot_t();
+	slot->fd = fd;
+	slot->path = zip_path;
+	slot->size = size;
+	slot->mtime = mtime;
+	slot->refs = 1;
+	slot->stale = false;
+
+	mz_zip_zero_struct(&slot->zip);
+	slot->zip.m_pRead = archive_read;
+	slot->zip.m_pIO_opaque = slot;
+	if (!mz_zip_reader_init(&slot->zip, size, 0))
+	{
+		printf("zip_cache: cannot open %s: %s\n", zip_path, mz_zip_get_error_string(mz_zip_get_last_error(&slot->zip)));
+		close(fd);
+		delete slot;
+		return nullptr;
+	}
+
+	s_archives.insert(s_archives.begin(), slot);
+	archive_trim();
+	return &slot->zip;
+}
+
+static void archive_put_locked(mz_zip_archive *zip)
+{
+	archive_slot_t *slot = (archive_slot_t*)zip;
+	if (slot->refs > 0) slot->refs--;
+	archive_trim();
+}
+
+mz_zip_archive *zip_archive_get(const char *zip_path)
+{
+	int64_t size, mtime;
+	if (!stat_key(zip_path, &size, &mtime)) return nullptr;
+
+	pthread_mutex_lock(&cache_lock);
+	mz_zip_archive *zip = archive_get_locked(zip_path, size, mtime);
+	pthread_mutex_unlock(&cache_lock);
+	return zip;
+}
+
+void zip_archive_put(mz_zip_archive *zip)
+{
+	if (!zip) return;
+
+	pthread_mutex_lock(&cache_lock);
+	archive_put_locked(zip);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void index_finish(zip_index_t *idx)
+{
+	idx->by_name.reserve(idx->entries.size());
+	for (uint32_t i = 0; i < idx->count(); i++)
+	{
+		idx->by_name.emplace(lower(idx->name(i)), i);
+		if (!idx->entries[i].is_dir) idx->by_crc.emplace(idx->entries[i].crc32, i);
+	}
+}
+
+static void index_file_name(const char *zip_path, char *out, size_t len)
+{
+	// FNV-1a, the real path is stored inside and checked on load
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (const char *p = zip_path; *p; p++)
+	{
+		hash ^= (uint8_t)*p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	snprintf(out, len, "%s/" INDEX_DIR "/%016llx.idx", getRootDir(), (unsigned long long)hash);
+}
+
+static std::shared_ptr<zip_index_t> index_load(const char *zip_path, int64_t size, int64_t mtime)
+{
+	char name[1024];
+	index_file_name(zip_path, name, sizeof(name));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	std::shared_ptr<zip_index_t> idx;
+	index_header_t hdr;
+	if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == INDEX_MAGIC && hdr.version == INDEX_VERSION &&
+		hdr.size == size && hdr.mtime == mtime && hdr.path_len == strlen(zip_path) &&
+		hdr.count <= hdr.names_len && hdr.names_len <= (64 << 20))
+	{
+		std::string path(hdr.path_len, 0);
+		if (read(fd, &path[0], hdr.path_len) == (ssize_t)hdr.path_len && path == zip_path)
+		{
+			idx = std::make_shared<zip_index_t>();
+			idx->path = path;
+			idx->size = size;
+			idx->mtime = mtime;
+			idx->entries.resize(hdr.count);
+			idx->names.resize(hdr.names_len);
+
+			ssize_t elen = hdr.count * sizeof(zip_index_entry_t);
+			bool ok = read(fd, idx->entries.data(), elen) == elen &&
+				read(fd, idx->names.data(), hdr.names_len) == (ssize_t)hdr.names_len &&
+				hdr.names_len && !idx->names.back();
+
+			for (uint32_t i = 0; ok && i < hdr.count; i++) ok = idx->entries[i].name < hdr.names_len;
+			if (!ok) idx = nullptr;
+		}
+	}
+
+	close(fd);
+	if (idx) index_finish(idx.get());
+	return idx;
+}
+
+static void index_save(const zip_index_t *idx)
+{
+	index_header_t hdr = {};
+	hdr.magic = INDEX_MAGIC;
+	hdr.version = INDEX_VERSION;
+	hdr.size = idx->size;
+	hdr.mtime = idx->mtime;
+	hdr.count = idx->count();
+	hdr.names_len = idx->names.size();
+	hdr.path_len = idx->path.size();
+
+	size_t elen = idx->entries.size() * sizeof(zip_index_entry_t);
+	std::vector<uint8_t> *data = new std::vector<uint8_t>(sizeof(hdr) + hdr.path_len + elen + hdr.names_len);
+	uint8_t *p = data->data();
+	memcpy(p, &hdr, sizeof(hdr)); p += sizeof(hdr);
+	memcpy(p, idx->path.data(), hdr.path_len); p += hdr.path_len;
+	memcpy(p, idx->entries.data(), elen); p += elen;
+	memcpy(p, idx->names.data(), hdr.names_len);
+
+	char name[1024];
+	index_file_name(idx->path.c_str(), name, sizeof(name));
+	std::string dst = name;
+
+	offload_add_work([data, dst]
+	{
+		// both LOW workers may store the same index, they share the tmp name
+		static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+		pthread_mutex_lock(&store_lock);
+
+		std::string dir = dst.substr(0, dst.rfind('/'));
+		mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+
+		std::string tmp = dst + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			bool ok = write(fd, data->data(), data->size()) == (ssize_t)data->size();
+			ok = !fsync(fd) && ok;
+			close(fd);
+			if (!ok || rename(tmp.c_str(), dst.c_str())) unlink(tmp.c_str());
+		}
+		pthread_mutex_unlock(&store_lock);
+		delete data;
+	});
+}
+
+static std::shared_ptr<zip_index_t> index_build(const char *zip_path, int64_t size, int64_t mtime)
+{
+	mz_zip_archive *zip = archive_get_locked(zip_path, size, mtime);
+	if (!zip) return nullptr;
+
+	std::shared_ptr<zip_index_t> idx = std::make_shared<zip_index_t>();
+	idx->path = zip_path;
+	idx->size = size;
+	idx->mtime = mtime;
+
+	uint32_t count = mz_zip_reader_get_num_files(zip);
+	idx->entries.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		zip_index_entry_t *entry = &idx->entries[i];
+		memset(entry, 0, sizeof(zip_index_entry_t));
+
+		char fname[256];
+		mz_zip_reader_get_filename(zip, i, fname, sizeof(fname));
+		entry->name = idx->names.size();
+		idx->names.insert(idx->names.end(), fname, fname + strlen(fname) + 1);
+
+		mz_zip_archive_file_stat s;
+		if (mz_zip_reader_file_stat(zip, i, &s))
+		{
+			entry->crc32 = s.m_crc32;
+			entry->size = s.m_uncomp_size;
+		}
+		entry->is_dir = mz_zip_reader_is_file_a_directory(zip, i);
+		entry->supported = mz_zip_reader_is_file_supported(zip, i);
+	}
+	if (idx->names.empty()) idx->names.push_back(0);
+
+	archive_put_locked(zip);
+	index_finish(idx.get());
+	if (count >= INDEX_MIN_ENTRIES) index_save(idx.get());
+	return idx;
+}
+
+std::shared_ptr<const zip_index_t> zip_index_get(const char *zip_path)
+{
+	int64_t size, mtime;
+	if (!stat_key(zip_path, &size, &mtime)) return nullptr;
+
+	pthread_mutex_lock(&cache_lock);
+
+	std::shared_ptr<zip_index_t> idx;
+	for (auto it = s_indexes.begin(); it != s_indexes.end(); ++it)
+	{
+		if ((*it)->path != zip_path) continue;
+
+		if ((*it)->size == size && (*it)->mtime == mtime) idx = *it;
+		s_indexes.erase(it);
+		break;
+	}
+
+	if (!idx) idx = index_load(zip_path, size, mtime);
+	if (!idx) idx = index_build(zip_path, size, mtime);
+
+	if (idx)
+	{
+		s_indexes.insert(s_indexes.begin(), idx);
+		if (s_indexes.size() > MAX_INDEXES) s_indexes.pop_back();
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return idx;
+}
@@ -0,0 +1,55 @@
+#ifndef ZIP_CACHE_H
+#define ZIP_CACHE_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "lib/miniz/miniz.h"
+
+// Central directory index of a zip archive. Recently used indexes stay in
+// memory, indexes of large archives are also kept in config/zipindex keyed
+// by path, size and mtime so browsing doesn't need to parse the archive.
+
+struct zip_index_entry_t
+{
+	uint32_t name;      // offset into names
+	uint32_t crc32;
+	uint64_t size;      // uncompressed
+	uint8_t  is_dir;
+	uint8_t  supported;
+	uint8_t  reserved[6];
+};
+
+struct zip_index_t
+{
+	std::string path;
+	int64_t size;
+	int64_t mtime;
+
+	std::vector<zip_index_entry_t> entries;
+	std::vector<char> names;
+	std::unordered_map<std::string, uint32_t> by_name; // lower case
+	std::unordered_map<uint32_t, uint32_t> by_crc;
+
+	uint32_t count() const { return entries.size(); }
+	const char *name(uint32_t i) const { return names.data() + entries[i].name; }
+
+	// Same index as in the archive or -1. Names are case insensitive as in mz_zip_reader_locate_file().
+	int locate(const char *name) const;
+
+	// First entry with the given crc or -1.
+	int find_crc(uint32_t crc32) const;
+};
+
+// Path must be absolute. Returns null if the archive can't be read.
+std::shared_ptr<const zip_index_t> zip_index_get(const char *zip_path);
+
+// Shared archive for extraction, initialized only once while it stays in
+// the cache. Reads are positioned, so any number of files (and threads)
+// can extract from it at the same time. Every get needs a matching put.
+mz_zip_archive *zip_archive_get(const char *zip_path);
+void zip_archive_put(mz_zip_archive *zip);
+
+#endif